@@ -0,0 +1,169 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-accumulate.h"
+#include "cordyceps-stalk-kernels.h"
+#include <plugin-support.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdlib.h>
+
+static bool parse_weights(struct cso_accumulator* acc, const char* str)
+{
+	double values[CSO_ACCUMULATE_MAX];
+	double sum = 0.0;
+	int parsed = 0;
+
+	while (str && *str && parsed < acc->count) {
+		char* end;
+		double value = strtod(str, &end);
+		if (end == str || value < 0.0) return false;
+
+		values[parsed++] = value;
+		sum += value;
+
+		str = end;
+		while (*str == ' ') str++;
+		if (*str == ',') str++;
+		else if (*str) return false;
+	}
+
+	if ((str && *str) || (parsed && parsed != acc->count)) return false;
+
+	if (!parsed) {
+		for (int i = 0; i < acc->count; i++) values[i] = 1.0;
+		sum = acc->count;
+	}
+
+	if (sum <= 0.0) return false;
+
+	// Rounding down can leave the total a little short of 256; the
+	// heaviest sub-frame takes up the slack
+	int total = 0;
+	int heaviest = 0;
+
+	for (int i = 0; i < acc->count; i++) {
+		acc->weights[i] = (uint16_t) (values[i] * 256.0 / sum);
+		total += acc->weights[i];
+		if (values[i] > values[heaviest]) heaviest = i;
+	}
+
+	acc->weights[heaviest] += (uint16_t) (256 - total);
+	return true;
+}
+
+bool cso_accumulator_init(struct cso_accumulator* acc, int count,
+			  const char* weights, enum AVPixelFormat format,
+			  int width, int height)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+	int linesizes[4];
+
+	cso_accumulator_free(acc);
+	if (count <= 1) return true;
+
+	if (count > CSO_ACCUMULATE_MAX) {
+		obs_log(LOG_WARNING, "Can't accumulate more than %d sub-frames "
+				     "per frame, using %d",
+			CSO_ACCUMULATE_MAX, CSO_ACCUMULATE_MAX);
+		count = CSO_ACCUMULATE_MAX;
+	}
+
+	if (!desc || desc->comp[0].depth != 8
+	    || (desc->flags & AV_PIX_FMT_FLAG_BITSTREAM)) {
+		obs_log(LOG_WARNING, "Sub-frame accumulation only supports "
+				     "8-bit formats; encoding every frame");
+		return false;
+	}
+
+	if (av_image_fill_linesizes(linesizes, format, width) < 0)
+		return false;
+
+	acc->count = count;
+	if (!parse_weights(acc, weights)) {
+		obs_log(LOG_WARNING, "Invalid shutter weights \"%s\" for %d "
+				     "sub-frames, using equal weights",
+			weights, count);
+		parse_weights(acc, NULL);
+	}
+
+	acc->planes = av_pix_fmt_count_planes(format);
+
+	size_t total = 0;
+	for (int plane = 0; plane < acc->planes; plane++) {
+		bool chroma = plane == 1 || plane == 2;
+		int shift = chroma ? desc->log2_chroma_h : 0;
+
+		acc->row_bytes[plane] = linesizes[plane];
+		acc->heights[plane] = AV_CEIL_RSHIFT(height, shift);
+		total += (size_t) acc->row_bytes[plane] * acc->heights[plane];
+	}
+
+	acc->buffer = bmalloc(total * sizeof(uint16_t));
+
+	uint16_t* rows = acc->buffer;
+	for (int plane = 0; plane < acc->planes; plane++) {
+		acc->rows[plane] = rows;
+		rows += (size_t) acc->row_bytes[plane] * acc->heights[plane];
+	}
+
+	return true;
+}
+
+void cso_accumulator_free(struct cso_accumulator* acc)
+{
+	bfree(acc->buffer);
+	memset(acc, 0, sizeof(struct cso_accumulator));
+}
+
+bool cso_accumulator_add(struct cso_accumulator* acc,
+			 const struct video_data* frame)
+{
+	uint16_t weight = acc->weights[acc->accumulated];
+	bool first = acc->accumulated == 0;
+
+	for (int plane = 0; plane < acc->planes; plane++) {
+		int row_bytes = acc->row_bytes[plane];
+
+		for (int y = 0; y < acc->heights[plane]; y++) {
+			cso_accumulate_row(
+				acc->rows[plane] + (size_t) y * row_bytes,
+				frame->data[plane] + y * frame->linesize[plane],
+				row_bytes, weight, first);
+		}
+	}
+
+	return ++acc->accumulated == acc->count;
+}
+
+void cso_accumulator_resolve(struct cso_accumulator* acc, AVFrame* dst)
+{
+	for (int plane = 0; plane < acc->planes; plane++) {
+		int row_bytes = acc->row_bytes[plane];
+		uint8_t* dst_rows = dst->data[plane];
+		const uint16_t* rows = acc->rows[plane];
+
+		for (int y = 0; y < acc->heights[plane]; y++) {
+			cso_resolve_row(dst_rows + y * dst->linesize[plane],
+					rows + (size_t) y * row_bytes,
+					row_bytes);
+		}
+	}
+
+	acc->accumulated = 0;
+}
@@ -0,0 +1,55 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Blends every K ingested frames into one output frame. Each sub-frame is
+// weighted by its shutter weight; the weights are normalized to sum to 256 so
+// the whole group fits in a 16-bit accumulator per sample. Only 8-bit formats
+// are supported, where every byte of a plane row is one sample.
+
+#pragma once
+
+#include <obs-module.h>
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+#define CSO_ACCUMULATE_MAX 64
+
+struct cso_accumulator {
+	int count;       // Sub-frames per output frame, 0 when not accumulating
+	int accumulated; // Sub-frames in the current group so far
+	uint16_t weights[CSO_ACCUMULATE_MAX];
+
+	int planes;
+	int row_bytes[MAX_AV_PLANES];
+	int heights[MAX_AV_PLANES];
+	uint16_t* rows[MAX_AV_PLANES];
+	uint16_t* buffer;
+};
+
+// weights is a comma separated list with one entry per sub-frame, like
+// "1,2,1" or "1,1,0,0" for a 180 degree shutter. Empty means equal weights.
+bool cso_accumulator_init(struct cso_accumulator* acc, int count,
+			  const char* weights, enum AVPixelFormat format,
+			  int width, int height);
+void cso_accumulator_free(struct cso_accumulator* acc);
+
+// Returns true once the frame completed a group, which then has to be
+// resolved before the next add
+bool cso_accumulator_add(struct cso_accumulator* acc,
+			 const struct video_data* frame);
+void cso_accumulator_resolve(struct cso_accumulator* acc, AVFrame* dst);
@@ -0,0 +1,498 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// For sched_setaffinity(), has to come before any system header
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include "cordyceps-stalk-cpu.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <tlhelp32.h>
+#elif defined(__linux__)
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN32)
+
+static cso_tid_t current_tid(void)
+{
+	return GetCurrentThreadId();
+}
+
+static int nice_to_priority(int nice)
+{
+	if (nice <= -15) return THREAD_PRIORITY_HIGHEST;
+	if (nice < 0) return THREAD_PRIORITY_ABOVE_NORMAL;
+	if (nice < 10) return THREAD_PRIORITY_BELOW_NORMAL;
+	if (nice < 15) return THREAD_PRIORITY_LOWEST;
+	return THREAD_PRIORITY_IDLE;
+}
+
+static bool apply_policy(cso_tid_t tid, const struct cso_cpu_policy* policy)
+{
+	HANDLE thread = OpenThread(THREAD_SET_INFORMATION
+					   | THREAD_QUERY_INFORMATION,
+				   FALSE, tid);
+	if (!thread) return false;
+
+	bool success = true;
+
+	if (policy->affinity
+	    && !SetThreadAffinityMask(thread, (DWORD_PTR) policy->affinity))
+		success = false;
+	if (policy->nice
+	    && !SetThreadPriority(thread, nice_to_priority(policy->nice)))
+		success = false;
+
+	CloseHandle(thread);
+	return success;
+}
+
+static uint64_t thread_time_ns(cso_tid_t tid)
+{
+	HANDLE thread = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE,
+				   tid);
+	if (!thread) return 0;
+
+	FILETIME creation, exit, kernel, user;
+	uint64_t ns = 0;
+
+	if (GetThreadTimes(thread, &creation, &exit, &kernel, &user)) {
+		ULARGE_INTEGER k = {.LowPart = kernel.dwLowDateTime,
+				    .HighPart = kernel.dwHighDateTime};
+		ULARGE_INTEGER u = {.LowPart = user.dwLowDateTime,
+				    .HighPart = user.dwHighDateTime};
+		ns = (k.QuadPart + u.QuadPart) * 100;
+	}
+
+	CloseHandle(thread);
+	return ns;
+}
+
+static void list_threads(struct cso_tid_list* list)
+{
+	da_init(list->tids);
+
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+	if (snapshot == INVALID_HANDLE_VALUE) return;
+
+	DWORD pid = GetCurrentProcessId();
+	THREADENTRY32 entry = {.dwSize = sizeof(THREADENTRY32)};
+
+	for (BOOL more = Thread32First(snapshot, &entry); more;
+	     more = Thread32Next(snapshot, &entry)) {
+		if (entry.th32OwnerProcessID != pid) continue;
+
+		cso_tid_t tid = entry.th32ThreadID;
+		da_push_back(list->tids, &tid);
+	}
+
+	CloseHandle(snapshot);
+}
+
+#elif defined(__linux__)
+
+static cso_tid_t current_tid(void)
+{
+	return (cso_tid_t) syscall(SYS_gettid);
+}
+
+// Both affinity and nice are per thread on Linux, even though the calls are
+// named after processes
+static bool apply_policy(cso_tid_t tid, const struct cso_cpu_policy* policy)
+{
+	bool success = true;
+
+	if (policy->affinity) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64 && i < CPU_SETSIZE; i++)
+			if (policy->affinity & (1ULL << i)) CPU_SET(i, &set);
+
+		if (sched_setaffinity((pid_t) tid, sizeof(set), &set) != 0)
+			success = false;
+	}
+
+	if (policy->nice
+	    && setpriority(PRIO_PROCESS, (id_t) tid, policy->nice) != 0)
+		success = false;
+
+	return success;
+}
+
+static uint64_t thread_time_ns(cso_tid_t tid)
+{
+	char path[64];
+	char buf[512];
+
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/stat", tid);
+
+	FILE* file = fopen(path, "r");
+	if (!file) return 0;
+
+	size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+	fclose(file);
+	buf[len] = 0;
+
+	// The thread name can contain anything, so start after it
+	char* fields = strrchr(buf, ')');
+	unsigned long long utime = 0;
+	unsigned long long stime = 0;
+
+	if (!fields
+	    || sscanf(fields + 1,
+		      " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+		      "%llu %llu",
+		      &utime, &stime)
+		       != 2)
+		return 0;
+
+	long ticks = sysconf(_SC_CLK_TCK);
+	if (ticks <= 0) return 0;
+
+	return (utime + stime) * 1000000000ULL / (unsigned long long) ticks;
+}
+
+static void list_threads(struct cso_tid_list* list)
+{
+	da_init(list->tids);
+
+	DIR* dir = opendir("/proc/self/task");
+	if (!dir) return;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (!isdigit((unsigned char) entry->d_name[0])) continue;
+
+		cso_tid_t tid = strtol(entry->d_name, NULL, 10);
+		da_push_back(list->tids, &tid);
+	}
+
+	closedir(dir);
+}
+
+// New threads start out with their creator's name, so renaming the thread
+// that opens the encoder to something unique marks exactly the threads it
+// starts
+static void mark_opener(struct cso_tid_list* list)
+{
+	prctl(PR_GET_NAME, list->opener_name, 0, 0, 0);
+
+	char marker[16];
+	snprintf(marker, sizeof(marker), "cso-%ld", current_tid());
+	prctl(PR_SET_NAME, marker, 0, 0, 0);
+}
+
+static void unmark_opener(const struct cso_tid_list* list)
+{
+	prctl(PR_SET_NAME, list->opener_name, 0, 0, 0);
+}
+
+static bool started_by_opener(cso_tid_t tid)
+{
+	char path[64];
+	char name[32] = {0};
+	char marker[16];
+
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/comm", tid);
+	snprintf(marker, sizeof(marker), "cso-%ld", current_tid());
+
+	FILE* file = fopen(path, "r");
+	if (!file) return false;
+
+	size_t len = fread(name, 1, sizeof(name) - 1, file);
+	fclose(file);
+	if (len && name[len - 1] == '\n') name[len - 1] = 0;
+
+	return strcmp(name, marker) == 0;
+}
+
+#else
+
+static cso_tid_t current_tid(void)
+{
+	return 0;
+}
+
+static bool apply_policy(cso_tid_t tid, const struct cso_cpu_policy* policy)
+{
+	UNUSED_PARAMETER(tid);
+
+	return !policy->affinity && !policy->nice;
+}
+
+static uint64_t thread_time_ns(cso_tid_t tid)
+{
+	UNUSED_PARAMETER(tid);
+
+	return 0;
+}
+
+static void list_threads(struct cso_tid_list* list)
+{
+	da_init(list->tids);
+}
+
+#endif
+
+static const char* const role_names[CSO_CPU_ROLE_COUNT] = {
+	[CSO_CPU_ENCODER] = "encoder",
+	[CSO_CPU_WRITER] = "writer",
+	[CSO_CPU_INGEST] = "ingest",
+};
+
+
+void cso_cpu_init(struct cso_cpu* cpu)
+{
+	memset(cpu, 0, sizeof(struct cso_cpu));
+	pthread_mutex_init(&cpu->mutex, NULL);
+}
+
+void cso_cpu_free(struct cso_cpu* cpu)
+{
+	da_free(cpu->threads);
+	pthread_mutex_destroy(&cpu->mutex);
+}
+
+void cso_cpu_reset(struct cso_cpu* cpu,
+		   const struct cso_cpu_policy policies[CSO_CPU_ROLE_COUNT])
+{
+	pthread_mutex_lock(&cpu->mutex);
+	memcpy(cpu->policies, policies, sizeof(cpu->policies));
+	memset(cpu->retired_ns, 0, sizeof(cpu->retired_ns));
+	da_free(cpu->threads);
+	cpu->start_ns = os_gettime_ns();
+	cpu->stop_ns = 0;
+	pthread_mutex_unlock(&cpu->mutex);
+}
+
+void cso_cpu_stop(struct cso_cpu* cpu)
+{
+	pthread_mutex_lock(&cpu->mutex);
+	if (cpu->start_ns && !cpu->stop_ns) cpu->stop_ns = os_gettime_ns();
+	pthread_mutex_unlock(&cpu->mutex);
+}
+
+bool cso_cpu_parse_set(const char* spec, uint64_t* mask)
+{
+	*mask = 0;
+	if (!spec) return true;
+
+	const char* c = spec;
+
+	while (*c) {
+		while (*c == ' ' || *c == ',') c++;
+		if (!*c) break;
+		if (!isdigit((unsigned char) *c)) return false;
+
+		char* end;
+		long first = strtol(c, &end, 10);
+		long last = first;
+
+		if (*end == '-') {
+			c = end + 1;
+			if (!isdigit((unsigned char) *c)) return false;
+			last = strtol(c, &end, 10);
+		}
+
+		if (last < first || last > 63) return false;
+
+		for (long i = first; i <= last; i++) *mask |= 1ULL << i;
+		c = end;
+	}
+
+	return true;
+}
+
+int cso_cpu_budget_threads(int budget_percent)
+{
+	if (budget_percent <= 0 || budget_percent >= 100) return 0;
+
+	int threads = os_get_logical_cores() * budget_percent / 100;
+	return threads > 0 ? threads : 1;
+}
+
+static void place(struct cso_cpu* cpu, cso_tid_t tid, enum cso_cpu_role role,
+		  int tag)
+{
+	const struct cso_cpu_policy* policy = &cpu->policies[role];
+
+	if (!apply_policy(tid, policy))
+		obs_log(LOG_WARNING, "Failed to place cordyceps stalk %s "
+				     "thread %ld",
+			role_names[role], (long) tid);
+
+	struct cso_cpu_thread thread = {
+		.tid = tid,
+		.role = role,
+		.tag = tag,
+	};
+	da_push_back(cpu->threads, &thread);
+}
+
+void cso_cpu_enter(struct cso_cpu* cpu, enum cso_cpu_role role)
+{
+	pthread_mutex_lock(&cpu->mutex);
+	place(cpu, current_tid(), role, 0);
+	pthread_mutex_unlock(&cpu->mutex);
+}
+
+void cso_cpu_leave(struct cso_cpu* cpu)
+{
+	cso_tid_t tid = current_tid();
+
+	pthread_mutex_lock(&cpu->mutex);
+
+	for (size_t i = 0; i < cpu->threads.num; i++) {
+		struct cso_cpu_thread* thread = &cpu->threads.array[i];
+		if (thread->tid != tid) continue;
+
+		cpu->retired_ns[thread->role] += thread_time_ns(tid);
+		da_erase(cpu->threads, i);
+		break;
+	}
+
+	pthread_mutex_unlock(&cpu->mutex);
+}
+
+void cso_cpu_adopt_begin(struct cso_tid_list* before)
+{
+	list_threads(before);
+#ifdef __linux__
+	mark_opener(before);
+#endif
+}
+
+int cso_cpu_adopt_end(struct cso_cpu* cpu, struct cso_tid_list* before,
+		      enum cso_cpu_role role, int tag, int expected)
+{
+	struct cso_tid_list after;
+	DARRAY(cso_tid_t) found;
+
+	list_threads(&after);
+	da_init(found);
+
+	for (size_t i = 0; i < after.tids.num; i++) {
+		cso_tid_t tid = after.tids.array[i];
+		bool existed = false;
+
+		for (size_t j = 0; j < before->tids.num && !existed; j++)
+			existed = before->tids.array[j] == tid;
+
+#ifdef __linux__
+		if (!existed && started_by_opener(tid))
+			da_push_back(found, &tid);
+#else
+		if (!existed) da_push_back(found, &tid);
+#endif
+	}
+
+#ifdef __linux__
+	unmark_opener(before);
+	if (expected < 0) found.num = 0;
+#else
+	// Without the name to tell them apart, any thread OBS started in the
+	// meantime would be among them
+	if (expected < 0) {
+		found.num = 0;
+	} else if (found.num != (size_t) expected) {
+		if (found.num)
+			obs_log(LOG_INFO, "Not placing cordyceps stalk encoder "
+					  "threads; %d new threads, expected "
+					  "%d",
+				(int) found.num, expected);
+		found.num = 0;
+	}
+#endif
+
+	pthread_mutex_lock(&cpu->mutex);
+	for (size_t i = 0; i < found.num; i++)
+		place(cpu, found.array[i], role, tag);
+	pthread_mutex_unlock(&cpu->mutex);
+
+	int adopted = (int) found.num;
+
+	da_free(found);
+	da_free(after.tids);
+	da_free(before->tids);
+
+	return adopted;
+}
+
+void cso_cpu_retire(struct cso_cpu* cpu, enum cso_cpu_role role, int tag)
+{
+	pthread_mutex_lock(&cpu->mutex);
+
+	for (size_t i = 0; i < cpu->threads.num;) {
+		struct cso_cpu_thread* thread = &cpu->threads.array[i];
+
+		if (thread->role != role || thread->tag != tag) {
+			i++;
+			continue;
+		}
+
+		cpu->retired_ns[role] += thread_time_ns(thread->tid);
+		da_erase(cpu->threads, i);
+	}
+
+	pthread_mutex_unlock(&cpu->mutex);
+}
+
+void cso_cpu_get_usage(struct cso_cpu* cpu, struct cso_cpu_usage* out)
+{
+	memset(out, 0, sizeof(struct cso_cpu_usage));
+
+	pthread_mutex_lock(&cpu->mutex);
+
+	memcpy(out->role_ns, cpu->retired_ns, sizeof(out->role_ns));
+
+	for (size_t i = 0; i < cpu->threads.num; i++) {
+		struct cso_cpu_thread* thread = &cpu->threads.array[i];
+
+		out->role_ns[thread->role] += thread_time_ns(thread->tid);
+		if (thread->role == CSO_CPU_ENCODER) out->encoder_threads++;
+	}
+
+	uint64_t end_ns = cpu->stop_ns ? cpu->stop_ns : os_gettime_ns();
+	uint64_t wall_ns = cpu->start_ns ? end_ns - cpu->start_ns : 0;
+
+	pthread_mutex_unlock(&cpu->mutex);
+
+	uint64_t total_ns = 0;
+	for (int i = 0; i < CSO_CPU_ROLE_COUNT; i++)
+		total_ns += out->role_ns[i];
+
+	int cores = os_get_logical_cores();
+	if (wall_ns && cores > 0)
+		out->percent = 100.0 * (double) total_ns
+			       / ((double) wall_ns * (double) cores);
+}
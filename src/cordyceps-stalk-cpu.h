@@ -0,0 +1,112 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Thread placement for everything the output runs, so recording leaves the
+// game's own threads alone. Threads are grouped by role; each role can be
+// pinned to a set of CPUs and given a nice value.
+//
+// The encoder's threads are started by the encoder library itself, so they're
+// found by comparing the process's threads before and after the encoder is
+// opened. On Linux only threads started by the thread opening the encoder
+// count; elsewhere they're only placed if there are exactly as many as the
+// encoder says it runs, so a thread OBS starts meanwhile isn't taken for one.
+//
+// Placement and per-thread CPU times work on Linux and Windows. Elsewhere
+// settings are ignored and times read as zero.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/darray.h>
+
+enum cso_cpu_role {
+	CSO_CPU_ENCODER,
+	CSO_CPU_WRITER, // Write thread and sinks
+	CSO_CPU_INGEST, // Only the shared memory thread, OBS's is left alone
+	CSO_CPU_ROLE_COUNT,
+};
+
+#ifdef _WIN32
+typedef unsigned long cso_tid_t;
+#else
+typedef long cso_tid_t;
+#endif
+
+struct cso_cpu_policy {
+	uint64_t affinity; // Bit per logical CPU, 0 leaves affinity alone
+	int nice; // -20 to 19 like Unix nice, 0 leaves priority alone
+};
+
+struct cso_cpu_thread {
+	cso_tid_t tid;
+	enum cso_cpu_role role;
+	int tag; // Segment for encoder threads
+};
+
+struct cso_tid_list {
+	DARRAY(cso_tid_t) tids;
+	char opener_name[16]; // Linux only
+};
+
+struct cso_cpu {
+	struct cso_cpu_policy policies[CSO_CPU_ROLE_COUNT];
+
+	pthread_mutex_t mutex;
+	DARRAY(struct cso_cpu_thread) threads;
+	uint64_t retired_ns[CSO_CPU_ROLE_COUNT]; // Threads already gone
+	uint64_t start_ns;
+	uint64_t stop_ns;
+};
+
+struct cso_cpu_usage {
+	uint64_t role_ns[CSO_CPU_ROLE_COUNT];
+	int encoder_threads;
+	double percent; // Of every logical CPU, since the recording started
+};
+
+void cso_cpu_init(struct cso_cpu* cpu);
+void cso_cpu_free(struct cso_cpu* cpu);
+
+// Starts over for a new recording
+void cso_cpu_reset(struct cso_cpu* cpu,
+		   const struct cso_cpu_policy policies[CSO_CPU_ROLE_COUNT]);
+void cso_cpu_stop(struct cso_cpu* cpu);
+
+// Parses a CPU list like "0-3,8,10-11". An empty list gives an empty mask.
+bool cso_cpu_parse_set(const char* spec, uint64_t* mask);
+
+// Encoder threads that fit in a budget given in percent of all logical CPUs,
+// or 0 for no limit
+int cso_cpu_budget_threads(int budget_percent);
+
+// Registers the calling thread and applies its role's policy. leave has to
+// come from the same thread.
+void cso_cpu_enter(struct cso_cpu* cpu, enum cso_cpu_role role);
+void cso_cpu_leave(struct cso_cpu* cpu);
+
+// Called by the same thread around opening the encoder. end registers and
+// places the threads the encoder started, expected being how many it says
+// it runs or -1 to place none, and returns how many were placed.
+void cso_cpu_adopt_begin(struct cso_tid_list* before);
+int cso_cpu_adopt_end(struct cso_cpu* cpu, struct cso_tid_list* before,
+		      enum cso_cpu_role role, int tag, int expected);
+// Books the CPU time of threads that are about to exit
+void cso_cpu_retire(struct cso_cpu* cpu, enum cso_cpu_role role, int tag);
+
+void cso_cpu_get_usage(struct cso_cpu* cpu, struct cso_cpu_usage* out);
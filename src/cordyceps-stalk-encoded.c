@@ -0,0 +1,486 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-encoded.h"
+#include <util/platform.h>
+
+static void encoded_deactivate(struct cso_encoded_data* cse)
+{
+	if (cse->write_thread_active) {
+		os_event_signal(cse->stop_event);
+		os_sem_post(cse->write_semaphore);
+		pthread_join(cse->write_thread, NULL);
+		cse->write_thread_active = false;
+	}
+
+	pthread_mutex_lock(&cse->write_mutex);
+	for (size_t i = 0; i < cse->packets.num; i++)
+		cso_packet_pool_put(&cse->packet_pool, cse->packets.array[i]);
+	da_free(cse->packets);
+	pthread_mutex_unlock(&cse->write_mutex);
+
+	if (cse->context.output_ctx)
+		cso_muxer_close(cse->context.output_ctx,
+				cse->context.initialized);
+
+	if (cse->written_frames || cse->gated_frames)
+		obs_log(LOG_INFO, "Cordyceps-stalk encoded output wrote %lld "
+				  "frames, gated out %lld",
+			(long long) cse->written_frames,
+			(long long) cse->gated_frames);
+
+	avcodec_free_context(&cse->context.video_ctx);
+	memset(&cse->context, 0, sizeof(struct ffmpeg_context));
+	dstr_free(&cse->path);
+}
+
+static int process_packet(struct cso_encoded_data* cse)
+{
+	AVPacket* packet = NULL;
+
+	pthread_mutex_lock(&cse->write_mutex);
+	if (cse->packets.num) {
+		packet = cse->packets.array[0];
+		da_erase(cse->packets, 0);
+	}
+	pthread_mutex_unlock(&cse->write_mutex);
+
+	if (!packet) return 0;
+
+	if (os_atomic_load_bool(&cse->stopping)) {
+		cso_packet_pool_put(&cse->packet_pool, packet);
+		return 0;
+	}
+
+	av_packet_rescale_ts(packet, cse->context.time_base,
+			     cse->context.video_stream->time_base);
+
+	cse->total_bytes += packet->size;
+
+	int ret = av_write_frame(cse->context.output_ctx, packet);
+	if (ret < 0) obs_log(LOG_WARNING, "Error while writing packet: %s",
+			av_err2str(ret));
+	av_write_frame(cse->context.output_ctx, NULL);
+
+	cso_packet_pool_put(&cse->packet_pool, packet);
+	return ret;
+}
+
+static void* write_thread(void* data)
+{
+	struct cso_encoded_data* cse = data;
+
+	while (os_sem_wait(cse->write_semaphore) == 0) {
+		if (os_event_try(cse->stop_event) == 0) break;
+
+		int ret = process_packet(cse);
+		if (ret != 0) {
+			int code = OBS_OUTPUT_ERROR;
+
+			pthread_detach(cse->write_thread);
+			cse->write_thread_active = false;
+
+			if (ret == -ENOSPC) code = OBS_OUTPUT_NO_SPACE;
+
+			obs_output_signal_stop(cse->output, code);
+			encoded_deactivate(cse);
+			break;
+		}
+	}
+
+	cse->active = false;
+	return NULL;
+}
+
+static void encoded_stop_full(struct cso_encoded_data* cse)
+{
+	if (cse->active) {
+		obs_output_end_data_capture(cse->output);
+
+		cse->requested_frames = 0;
+
+		encoded_deactivate(cse);
+	}
+}
+
+// Sets up video_ctx from what OBS knows about encoder, then opens the file
+static bool init_muxer(struct cso_encoded_data* cse, obs_encoder_t* encoder)
+{
+	struct ffmpeg_config* config = &cse->context.config;
+
+	obs_data_t* settings = obs_output_get_settings(cse->output);
+	bool path_create_success = cso_make_filepath(
+		obs_data_get_string(settings, "dirpath"), 0, &cse->path);
+	obs_data_release(settings);
+
+	if (!path_create_success) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk encoded "
+				     "output; given path was not directory");
+		return false;
+	}
+
+	// OBS and FFmpeg happen to use the same names for these
+	const char* codec = obs_encoder_get_codec(encoder);
+	const AVCodecDescriptor* descriptor =
+		codec ? avcodec_descriptor_get_by_name(codec) : NULL;
+
+	if (!descriptor || descriptor->type != AVMEDIA_TYPE_VIDEO) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk encoded "
+				     "output; unknown codec \"%s\"",
+			codec ? codec : "");
+		return false;
+	}
+
+	const struct video_output_info* voi =
+		video_output_get_info(obs_encoder_video(encoder));
+
+	cso_encoder_config_from_video(config, voi);
+	config->filepath = cse->path.array;
+	config->width = (int) obs_encoder_get_width(encoder);
+	config->height = (int) obs_encoder_get_height(encoder);
+	config->hdr_nominal_peak_level =
+		(int) obs_get_video_hdr_nominal_peak_level();
+	config->output_format = av_guess_format("mp4", NULL, NULL);
+
+	if (!config->output_format) {
+		obs_log(LOG_ERROR, "Failed to start cordyceps stalk encoded "
+				   "output; could not get mp4 output format");
+		return false;
+	}
+
+	AVCodecContext* video_ctx = avcodec_alloc_context3(NULL);
+	if (!video_ctx) return false;
+	cse->context.video_ctx = video_ctx;
+
+	video_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+	video_ctx->codec_id = descriptor->id;
+	video_ctx->width = config->width;
+	video_ctx->height = config->height;
+	video_ctx->pix_fmt = config->pixel_format;
+	video_ctx->color_range = config->color_range;
+	video_ctx->color_primaries = config->color_primaries;
+	video_ctx->color_trc = config->color_trc;
+	video_ctx->colorspace = config->colorspace;
+	video_ctx->time_base = (AVRational){config->fps_den, config->fps_num};
+	video_ctx->framerate = (AVRational){config->fps_num, config->fps_den};
+	cse->context.time_base = video_ctx->time_base;
+
+	// Headers (SPS/PPS and the like), only there once the encoder has
+	// been initialized
+	uint8_t* extra_data = NULL;
+	size_t extra_size = 0;
+	if (obs_encoder_get_extra_data(encoder, &extra_data, &extra_size)
+	    && extra_size) {
+		video_ctx->extradata =
+			av_mallocz(extra_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (!video_ctx->extradata) return false;
+
+		memcpy(video_ctx->extradata, extra_data, extra_size);
+		video_ctx->extradata_size = (int) extra_size;
+	}
+
+	if (!cso_muxer_open(&cse->context)) return false;
+
+	cse->context.initialized = true;
+	return true;
+}
+
+// Applies the frame request gate to a packet. Returns false if it should be
+// dropped.
+static bool gate_packet(struct cso_encoded_data* cse, bool keyframe)
+{
+	bool pass = true;
+
+	pthread_mutex_lock(&cse->frame_request_mutex);
+
+	// Nothing after a dropped packet decodes until the next keyframe, so
+	// those don't use up requested frames either. The first keyframe
+	// always gets written, same as the raw output's first frame.
+	if (!keyframe && (cse->resync || !cse->started)) {
+		pass = false;
+	} else if (!cse->realtime_mode && cse->started) {
+		if (cse->requested_frames > 0) cse->requested_frames--;
+		else pass = false;
+	}
+
+	pthread_mutex_unlock(&cse->frame_request_mutex);
+
+	return pass;
+}
+
+static void cse_encoded_packet(void* data, struct encoder_packet* pkt)
+{
+	struct cso_encoded_data* cse = data;
+
+	// OBS hands over NULL when the encoder fails. Like a write error,
+	// signalling the stop already ends data capture.
+	if (!pkt) {
+		if (os_atomic_load_bool(&cse->active)) {
+			obs_output_signal_stop(cse->output,
+					       OBS_OUTPUT_ENCODE_ERROR);
+			encoded_deactivate(cse);
+			os_atomic_set_bool(&cse->active, false);
+		}
+		return;
+	}
+
+	if (!os_atomic_load_bool(&cse->active)
+	    || pkt->type != OBS_ENCODER_VIDEO)
+		return;
+
+	if (!gate_packet(cse, pkt->keyframe)) {
+		cse->resync = true;
+		cse->gated_frames++;
+		return;
+	}
+
+	AVRational packet_time_base = {pkt->timebase_num, pkt->timebase_den};
+	int64_t pts = av_rescale_q(pkt->pts, packet_time_base,
+				   cse->context.time_base);
+	int64_t dts = av_rescale_q(pkt->dts, packet_time_base,
+				   cse->context.time_base);
+
+	// Carry on right after the last frame written, whatever got dropped
+	// in between
+	if (!cse->started || cse->resync)
+		cse->ts_offset = pts - cse->next_pts;
+
+	pts -= cse->ts_offset;
+	dts -= cse->ts_offset;
+
+	// With B-frames, a keyframe's dts can land behind the last packet's
+	if (cse->started && dts <= cse->last_dts) {
+		int64_t shift = cse->last_dts + 1 - dts;
+		cse->ts_offset -= shift;
+		pts += shift;
+		dts += shift;
+	}
+
+	AVPacket* packet = cso_packet_pool_get(&cse->packet_pool);
+	if (!packet || av_new_packet(packet, (int) pkt->size) < 0) {
+		obs_log(LOG_WARNING, "Cordyceps stalk encoded output failed "
+				     "to allocate a packet!");
+		cso_packet_pool_put(&cse->packet_pool, packet);
+		cse->resync = true;
+		return;
+	}
+
+	memcpy(packet->data, pkt->data, pkt->size);
+	packet->pts = pts;
+	packet->dts = dts;
+	packet->duration = 1;
+	if (pkt->keyframe) packet->flags |= AV_PKT_FLAG_KEY;
+
+	cse->started = true;
+	cse->resync = false;
+	cse->last_dts = dts;
+	if (pts + 1 > cse->next_pts) cse->next_pts = pts + 1;
+	cse->written_frames++;
+
+	pthread_mutex_lock(&cse->write_mutex);
+	da_push_back(cse->packets, &packet);
+	pthread_mutex_unlock(&cse->write_mutex);
+	os_sem_post(cse->write_semaphore);
+}
+
+static const char* cse_get_name(void* unused)
+{
+	UNUSED_PARAMETER(unused);
+
+	return "Cordyceps Stalk Encoded Output";
+}
+
+static void* cse_create(obs_data_t* settings, obs_output_t* output)
+{
+	UNUSED_PARAMETER(settings);
+
+	struct cso_encoded_data* cse = bzalloc(sizeof(struct cso_encoded_data));
+
+	cse->output = output;
+	pthread_mutex_init(&cse->write_mutex, NULL);
+	os_sem_init(&cse->write_semaphore, 0);
+	os_event_init(&cse->stop_event, OS_EVENT_TYPE_AUTO);
+	dstr_init(&cse->path);
+
+	cso_packet_pool_init(&cse->packet_pool, &cse->alloc_stats);
+
+	cse->realtime_mode = false;
+	cse->requested_frames = 0;
+	pthread_mutex_init(&cse->frame_request_mutex, NULL);
+
+	proc_handler_t* ph = obs_output_get_proc_handler(cse->output);
+
+	proc_handler_add(ph, "void set_realtime_mode(in bool value)",
+			 proc_set_realtime_mode, cse);
+	proc_handler_add(ph, "void get_realtime_mode(out bool value)",
+			 proc_get_realtime_mode, cse);
+	proc_handler_add(ph, "void request_frames(in int count)",
+			 proc_request_frames, cse);
+	proc_handler_add(ph, "void get_requested_frames(out int count)",
+			 proc_get_requested_frames, cse);
+
+	return cse;
+}
+
+static void cse_destroy(void* data)
+{
+	struct cso_encoded_data* cse = data;
+
+	if (cse) {
+		encoded_stop_full(cse);
+
+		pthread_mutex_destroy(&cse->write_mutex);
+		os_sem_destroy(cse->write_semaphore);
+		os_event_destroy(cse->stop_event);
+		pthread_mutex_destroy(&cse->frame_request_mutex);
+		dstr_free(&cse->path);
+
+		cso_packet_pool_free(&cse->packet_pool);
+
+		bfree(cse);
+	}
+}
+
+// Unlike the raw output this starts synchronously; there's no encoder of our
+// own to open
+static bool cse_start(void* data)
+{
+	struct cso_encoded_data* cse = data;
+
+	if (os_atomic_load_bool(&cse->active)) return false;
+
+	obs_encoder_t* encoder = obs_output_get_video_encoder(cse->output);
+	if (!encoder) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk encoded "
+				     "output; no video encoder attached");
+		return false;
+	}
+
+	if (!obs_output_can_begin_data_capture(cse->output, 0)) return false;
+	if (!obs_output_initialize_encoders(cse->output, 0)) return false;
+
+	os_atomic_set_bool(&cse->stopping, false);
+	cse->total_bytes = 0;
+	memset(&cse->alloc_stats, 0, sizeof(struct cso_alloc_stats));
+	cse->started = false;
+	cse->resync = false;
+	cse->ts_offset = 0;
+	cse->next_pts = 0;
+	cse->last_dts = 0;
+	cse->written_frames = 0;
+	cse->gated_frames = 0;
+
+	if (!init_muxer(cse, encoder)) {
+		encoded_deactivate(cse);
+		return false;
+	}
+
+	cse->active = true;
+
+	if (pthread_create(&cse->write_thread, NULL, write_thread, cse) != 0) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk encoded "
+				     "output; failed to create write thread");
+		cse->active = false;
+		encoded_deactivate(cse);
+		return false;
+	}
+
+	cse->write_thread_active = true;
+	obs_output_begin_data_capture(cse->output, 0);
+
+	obs_log(LOG_INFO, "Cordyceps-stalk encoded output starting on "
+			  "encoder \"%s\" (%s)",
+		obs_encoder_get_name(encoder), obs_encoder_get_id(encoder));
+
+	return true;
+}
+
+static void cse_stop(void* data, uint64_t stop_ts)
+{
+	struct cso_encoded_data* cse = data;
+
+	if (os_atomic_load_bool(&cse->active)) {
+		if (stop_ts > 0) os_atomic_set_bool(&cse->stopping, true);
+
+		encoded_stop_full(cse);
+	}
+}
+
+static uint64_t cse_get_total_bytes(void* data)
+{
+	struct cso_encoded_data* cse = data;
+
+	return cse->total_bytes;
+}
+
+static void proc_set_realtime_mode(void* data, calldata_t* cd)
+{
+	struct cso_encoded_data* cse = data;
+
+	bool value = calldata_bool(cd, "value");
+
+	pthread_mutex_lock(&cse->frame_request_mutex);
+	cse->realtime_mode = value;
+	pthread_mutex_unlock(&cse->frame_request_mutex);
+}
+
+static void proc_get_realtime_mode(void* data, calldata_t* cd)
+{
+	struct cso_encoded_data* cse = data;
+
+	pthread_mutex_lock(&cse->frame_request_mutex);
+	bool value = cse->realtime_mode;
+	pthread_mutex_unlock(&cse->frame_request_mutex);
+
+	calldata_set_bool(cd, "value", value);
+}
+
+static void proc_request_frames(void* data, calldata_t* cd)
+{
+	struct cso_encoded_data* cse = data;
+
+	int64_t count = calldata_int(cd, "count");
+	if (count < 0) count = 0;
+
+	pthread_mutex_lock(&cse->frame_request_mutex);
+	cse->requested_frames += count;
+	pthread_mutex_unlock(&cse->frame_request_mutex);
+}
+
+static void proc_get_requested_frames(void* data, calldata_t* cd)
+{
+	struct cso_encoded_data* cse = data;
+
+	pthread_mutex_lock(&cse->frame_request_mutex);
+	int64_t count = cse->requested_frames;
+	pthread_mutex_unlock(&cse->frame_request_mutex);
+
+	calldata_set_int(cd, "count", count);
+}
+
+struct obs_output_info cordyceps_stalk_encoded_output = {
+	.id = "cordyceps-stalk-encoded-output",
+	.flags = OBS_OUTPUT_VIDEO | OBS_OUTPUT_ENCODED,
+	.get_name = cse_get_name,
+	.create = cse_create,
+	.destroy = cse_destroy,
+	.start = cse_start,
+	.stop = cse_stop,
+	.encoded_packet = cse_encoded_packet,
+	.get_total_bytes = cse_get_total_bytes
+};
@@ -0,0 +1,82 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Variant of the output that records the packets of one of OBS's own video
+// encoders instead of encoding raw frames itself, so a canvas that's also
+// being streamed or recorded only gets encoded once. realtime_mode and frame
+// requests gate packets instead of frames.
+//
+// An inter-coded stream can't lose a frame without breaking the frames that
+// reference it, so once a packet is gated out, everything up to the next
+// keyframe goes with it. Frame requests are only exact in realtime mode or
+// with an intra-only encoder; otherwise a short keyframe interval on the
+// shared encoder keeps the loss down. Timestamps are rewritten so the file
+// plays back without gaps, the same as a gated raw recording.
+
+#pragma once
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <util/threading.h>
+#include <util/dstr.h>
+
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-pool.h"
+
+struct cso_encoded_data {
+	obs_output_t* output;
+
+	// video_ctx only describes the stream to the muxer, it's never opened
+	struct ffmpeg_context context;
+	struct dstr path;
+
+	volatile bool active;
+	volatile bool stopping;
+
+	uint64_t total_bytes;
+
+	bool write_thread_active;
+	pthread_mutex_t write_mutex;
+	os_sem_t* write_semaphore;
+	os_event_t* stop_event;
+	pthread_t write_thread;
+	DARRAY(AVPacket*) packets;
+
+	struct cso_alloc_stats alloc_stats;
+	struct cso_packet_pool packet_pool;
+
+	volatile bool realtime_mode;
+	volatile int64_t requested_frames;
+	pthread_mutex_t frame_request_mutex;
+
+	// Encoder's packet thread only. Timestamps are in frames.
+	bool started;
+	bool resync; // A packet was gated out, waiting for a keyframe
+	int64_t ts_offset;
+	int64_t next_pts;
+	int64_t last_dts;
+	int64_t written_frames;
+	int64_t gated_frames;
+};
+
+static void proc_set_realtime_mode(void* data, calldata_t* cd);
+static void proc_get_realtime_mode(void* data, calldata_t* cd);
+static void proc_request_frames(void* data, calldata_t* cd);
+static void proc_get_requested_frames(void* data, calldata_t* cd);
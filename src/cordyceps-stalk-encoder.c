@@ -0,0 +1,965 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Mostly copied from obs-ffmpeg-output.c
+
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-kernels.h"
+#include "include/obs-ffmpeg-formats.h"
+#include <plugin-support.h>
+#include <time.h>
+#include <libavutil/opt.h>
+#include <libavutil/mastering_display_metadata.h>
+#include <libavutil/imgutils.h>
+
+void cso_encoder_config_from_video(struct ffmpeg_config* config,
+				   const struct video_output_info* voi)
+{
+	config->pixel_format = obs_to_ffmpeg_video_format(voi->format);
+	config->fps_num = (int) voi->fps_num;
+	config->fps_den = (int) voi->fps_den;
+
+	config->color_range = voi->range == VIDEO_RANGE_FULL
+				      ? AVCOL_RANGE_JPEG
+				      : AVCOL_RANGE_MPEG;
+	config->colorspace = format_is_yuv(voi->format) ? AVCOL_SPC_BT709
+							: AVCOL_SPC_RGB;
+
+	// Copied verbatim from obs-ffmpeg-output.c
+	switch (voi->colorspace) {
+	case VIDEO_CS_601:
+		config->color_primaries = AVCOL_PRI_SMPTE170M;
+		config->color_trc = AVCOL_TRC_SMPTE170M;
+		config->colorspace = AVCOL_SPC_SMPTE170M;
+		break;
+	case VIDEO_CS_DEFAULT:
+	case VIDEO_CS_709:
+		config->color_primaries = AVCOL_PRI_BT709;
+		config->color_trc = AVCOL_TRC_BT709;
+		config->colorspace = AVCOL_SPC_BT709;
+		break;
+	case VIDEO_CS_SRGB:
+		config->color_primaries = AVCOL_PRI_BT709;
+		config->color_trc = AVCOL_TRC_IEC61966_2_1;
+		config->colorspace = AVCOL_SPC_BT709;
+		break;
+	case VIDEO_CS_2100_PQ:
+		config->color_primaries = AVCOL_PRI_BT2020;
+		config->color_trc = AVCOL_TRC_SMPTE2084;
+		config->colorspace = AVCOL_SPC_BT2020_NCL;
+		break;
+	case VIDEO_CS_2100_HLG:
+		config->color_primaries = AVCOL_PRI_BT2020;
+		config->color_trc = AVCOL_TRC_ARIB_STD_B67;
+		config->colorspace = AVCOL_SPC_BT2020_NCL;
+		break;
+	}
+}
+
+static int clamp_aligned(int value, int max, int align)
+{
+	if (value < 0) value = 0;
+	if (value > max) value = max;
+
+	return value & ~(align - 1);
+}
+
+bool cso_encoder_apply_crop(struct ffmpeg_config* config,
+			    const struct cso_crop* crop)
+{
+	const AVPixFmtDescriptor* desc =
+		av_pix_fmt_desc_get(config->pixel_format);
+	if (!desc) return false;
+
+	int align_x = 1 << desc->log2_chroma_w;
+	int align_y = 1 << desc->log2_chroma_h;
+
+	int x = clamp_aligned(crop->x, config->width, align_x);
+	int y = clamp_aligned(crop->y, config->height, align_y);
+	int width = clamp_aligned(crop->width > 0 ? crop->width
+						  : config->width - x,
+				  config->width - x, align_x);
+	int height = clamp_aligned(crop->height > 0 ? crop->height
+						    : config->height - y,
+				   config->height - y, align_y);
+
+	if (width == config->width && height == config->height) return false;
+
+	if (width < align_x || height < align_y) {
+		obs_log(LOG_WARNING, "Crop %dx%d at %d,%d leaves nothing of "
+				     "the %dx%d frame; ignoring it",
+			crop->width, crop->height, crop->x, crop->y,
+			config->width, config->height);
+		return false;
+	}
+
+	config->crop_x = x;
+	config->crop_y = y;
+	config->width = width;
+	config->height = height;
+
+	return true;
+}
+
+static int scale_factor(const struct ffmpeg_config* config)
+{
+	return config->scale > 1 ? config->scale : 1;
+}
+
+// Bytes per sample of the plane's first component, 0 if the plane has none
+static int plane_sample_size(const AVPixFmtDescriptor* desc, int plane)
+{
+	for (int comp = 0; comp < desc->nb_components; comp++)
+		if (desc->comp[comp].plane == plane)
+			return desc->comp[comp].step;
+
+	return 0;
+}
+
+bool cso_encoder_apply_scale(struct ffmpeg_config* config, int scale)
+{
+	const AVPixFmtDescriptor* desc =
+		av_pix_fmt_desc_get(config->pixel_format);
+
+	config->scale = 1;
+	if (scale <= 1 || !desc) return false;
+
+	if (scale > CSO_MAX_SCALE) {
+		obs_log(LOG_WARNING, "Upscaling by %d isn't supported, only up "
+				     "to %d; not upscaling",
+			scale, CSO_MAX_SCALE);
+		return false;
+	}
+
+	// Packed 4:2:2 shares its chroma between pairs of pixels in one
+	// sample, repeating samples would pair them up wrong
+	bool supported = !(desc->flags & AV_PIX_FMT_FLAG_BITSTREAM)
+			 && ((desc->flags & AV_PIX_FMT_FLAG_PLANAR)
+			     || !desc->log2_chroma_w);
+
+	for (int plane = 0; plane < MAX_AV_PLANES && supported; plane++) {
+		int size = plane_sample_size(desc, plane);
+		supported = size == 0 || size == 1 || size == 2 || size == 4;
+	}
+
+	if (!supported) {
+		obs_log(LOG_WARNING, "Upscaling isn't supported for %s video; "
+				     "not upscaling",
+			av_get_pix_fmt_name(config->pixel_format));
+		return false;
+	}
+
+	config->scale = scale;
+	return true;
+}
+
+void cso_encoder_crop_frame(const struct ffmpeg_config* config,
+			    struct video_data* frame)
+{
+	const AVPixFmtDescriptor* desc =
+		av_pix_fmt_desc_get(config->pixel_format);
+
+	for (int plane = 0; plane < MAX_AV_PLANES; plane++) {
+		if (!frame->data[plane]) continue;
+
+		// First component stored in this plane; its step is the
+		// distance between horizontally adjacent samples
+		int comp = 0;
+		while (comp < desc->nb_components
+		       && desc->comp[comp].plane != plane)
+			comp++;
+		if (comp == desc->nb_components) continue;
+
+		bool chroma = comp == 1 || comp == 2;
+		int x = config->crop_x >> (chroma ? desc->log2_chroma_w : 0);
+		int y = config->crop_y >> (chroma ? desc->log2_chroma_h : 0);
+
+		frame->data[plane] += (size_t) y * frame->linesize[plane]
+				      + (size_t) x * desc->comp[comp].step;
+	}
+}
+
+// x264's presets, fastest first. The other backends translate their position
+// in this list into their own speed settings.
+static const char* const x264_presets[] = {
+	"ultrafast", "superfast", "veryfast", "faster", "fast",
+	"medium",    "slow",      "slower",   "veryslow", "placebo",
+};
+
+#define CSO_PRESET_COUNT (sizeof(x264_presets) / sizeof(*x264_presets))
+
+static size_t preset_index(const char* preset)
+{
+	for (size_t i = 0; i < CSO_PRESET_COUNT; i++)
+		if (strcmp(preset, x264_presets[i]) == 0) return i;
+
+	return 2; // veryfast, the plugin's default
+}
+
+static void set_x264_options(AVCodecContext* video_ctx,
+			     const struct cso_encoder_settings* settings)
+{
+	av_opt_set(video_ctx->priv_data, "preset", settings->preset, 0);
+	// Frames forced to I by force_keyframe have to be IDR frames to be
+	// any use as cut points
+	av_opt_set_int(video_ctx->priv_data, "forced-idr", 1, 0);
+	video_ctx->thread_count = settings->threads;
+
+	// zerolatency is sliced threads, no lookahead and no B-frames
+	if (settings->low_latency) {
+		av_opt_set(video_ctx->priv_data, "tune", "zerolatency", 0);
+		video_ctx->max_b_frames = 0;
+	}
+}
+
+static void set_x265_options(AVCodecContext* video_ctx,
+			     const struct cso_encoder_settings* settings)
+{
+	av_opt_set(video_ctx->priv_data, "preset", settings->preset, 0);
+	av_opt_set_int(video_ctx->priv_data, "forced-idr", 1, 0);
+
+	// Same as x264's, plus a single frame thread
+	if (settings->low_latency) {
+		av_opt_set(video_ctx->priv_data, "tune", "zerolatency", 0);
+		video_ctx->max_b_frames = 0;
+	}
+
+	// libx265 ignores thread_count and sizes its own thread pool
+	if (settings->threads > 0) {
+		char params[32];
+		snprintf(params, sizeof(params), "pools=%d", settings->threads);
+		av_opt_set(video_ctx->priv_data, "x265-params", params, 0);
+	}
+}
+
+static void set_svtav1_options(AVCodecContext* video_ctx,
+			       const struct cso_encoder_settings* settings)
+{
+	// SVT-AV1 presets run from 0 (slowest) to 13; numbers pass through
+	static const int presets[CSO_PRESET_COUNT] = {12, 11, 10, 9, 8,
+						      6,  5,  4,  2, 0};
+	int preset = presets[preset_index(settings->preset)];
+	if (settings->preset[0] >= '0' && settings->preset[0] <= '9')
+		preset = atoi(settings->preset);
+
+	av_opt_set_int(video_ctx->priv_data, "preset", preset, 0);
+
+	// Low delay prediction structure, which has no hidden frames to wait
+	// on, and no lookahead
+	struct dstr params;
+	dstr_init(&params);
+	if (settings->threads > 0)
+		dstr_catf(&params, "lp=%d", settings->threads);
+	if (settings->low_latency)
+		dstr_catf(&params, "%spred-struct=1:lookahead=0",
+			  params.len ? ":" : "");
+
+	if (params.len)
+		av_opt_set(video_ctx->priv_data, "svtav1-params", params.array,
+			   0);
+	dstr_free(&params);
+}
+
+static void set_vp9_options(AVCodecContext* video_ctx,
+			    const struct cso_encoder_settings* settings)
+{
+	// The realtime deadline is what keeps libvpx anywhere near capture
+	// speed; slower presets trade that for compression
+	static const int cpu_used[CSO_PRESET_COUNT] = {8, 7, 6, 5, 4,
+						       3, 2, 1, 0, 0};
+	size_t index = preset_index(settings->preset);
+
+	av_opt_set(video_ctx->priv_data, "deadline",
+		   index <= 3 || settings->low_latency ? "realtime" : "good",
+		   0);
+
+	// Alt-ref frames are what libvpx holds frames back for
+	if (settings->low_latency) {
+		av_opt_set_int(video_ctx->priv_data, "lag-in-frames", 0, 0);
+		av_opt_set_int(video_ctx->priv_data, "auto-alt-ref", 0, 0);
+	}
+
+	av_opt_set_int(video_ctx->priv_data, "cpu-used", cpu_used[index], 0);
+	av_opt_set_int(video_ctx->priv_data, "row-mt", 1, 0);
+
+	// Tiles are at least 256 pixels wide, and they're what row-mt
+	// spreads across threads
+	int tile_columns = 0;
+	while (tile_columns < 6
+	       && 256 << (tile_columns + 1) <= video_ctx->width)
+		tile_columns++;
+	av_opt_set_int(video_ctx->priv_data, "tile-columns", tile_columns, 0);
+
+	video_ctx->thread_count = settings->threads;
+}
+
+struct cso_backend {
+	const char* name; // As given in the codec setting
+	const char* encoder;
+	// Maps x264's CRF scale onto the encoder's
+	double crf_scale;
+	double crf_offset;
+	double crf_max;
+	void (*set_options)(AVCodecContext* video_ctx,
+			    const struct cso_encoder_settings* settings);
+};
+
+static const struct cso_backend backends[] = {
+	[CSO_CODEC_H264] = {"h264", "libx264", 1.0, 0.0, 51.0,
+			    set_x264_options},
+	[CSO_CODEC_HEVC] = {"hevc", "libx265", 1.0, 5.0, 51.0,
+			    set_x265_options},
+	[CSO_CODEC_AV1] = {"av1", "libsvtav1", 1.5, 0.0, 63.0,
+			   set_svtav1_options},
+	[CSO_CODEC_VP9] = {"vp9", "libvpx-vp9", 1.35, 0.0, 63.0,
+			   set_vp9_options},
+};
+
+enum cso_codec cso_codec_from_string(const char* name)
+{
+	if (!name) return CSO_CODEC_H264;
+
+	for (size_t i = 0; i < sizeof(backends) / sizeof(*backends); i++)
+		if (strcmp(name, backends[i].name) == 0)
+			return (enum cso_codec) i;
+
+	return CSO_CODEC_H264;
+}
+
+const char* cso_codec_to_string(enum cso_codec codec)
+{
+	return backends[codec].name;
+}
+
+void cso_encoder_get_settings(obs_data_t* settings,
+			      struct cso_encoder_settings* out)
+{
+	memset(out, 0, sizeof(struct cso_encoder_settings));
+
+	out->codec = cso_codec_from_string(obs_data_get_string(settings,
+							       "codec"));
+	out->threads = (int) obs_data_get_int(settings, "threads");
+
+	out->gop_size = (int) obs_data_get_int(settings, "gop_size");
+	out->rate_control =
+		strcmp(obs_data_get_string(settings, "rate_control"), "abr")
+				== 0
+			? CSO_RATE_CONTROL_ABR
+			: CSO_RATE_CONTROL_CRF;
+	out->crf = obs_data_get_double(settings, "crf");
+	out->bitrate = (int) obs_data_get_int(settings, "bitrate");
+	out->max_bitrate = (int) obs_data_get_int(settings, "max_bitrate");
+	out->buffer_size = (int) obs_data_get_int(settings, "buffer_size");
+	snprintf(out->preset, sizeof(out->preset), "%s",
+		 obs_data_get_string(settings, "preset"));
+	out->low_latency = obs_data_get_bool(settings, "low_latency");
+}
+
+bool cso_encoder_settings_equal(const struct cso_encoder_settings* a,
+				const struct cso_encoder_settings* b)
+{
+	return a->codec == b->codec && a->threads == b->threads
+	       && a->gop_size == b->gop_size
+	       && a->rate_control == b->rate_control
+	       && a->crf == b->crf && a->bitrate == b->bitrate
+	       && a->max_bitrate == b->max_bitrate
+	       && a->buffer_size == b->buffer_size
+	       && strcmp(a->preset, b->preset) == 0
+	       && a->low_latency == b->low_latency;
+}
+
+void cso_encoder_apply_rate_control(
+	AVCodecContext* video_ctx, const struct cso_encoder_settings* settings)
+{
+	if (settings->rate_control == CSO_RATE_CONTROL_ABR) {
+		video_ctx->bit_rate = (int64_t) settings->bitrate * 1000;
+	} else {
+		const struct cso_backend* backend = &backends[settings->codec];
+		double crf = settings->crf * backend->crf_scale
+			     + backend->crf_offset;
+		if (crf > backend->crf_max) crf = backend->crf_max;
+
+		video_ctx->bit_rate = 0;
+		av_opt_set_double(video_ctx->priv_data, "crf", crf, 0);
+	}
+
+	video_ctx->rc_max_rate = (int64_t) settings->max_bitrate * 1000;
+	video_ctx->rc_buffer_size = settings->buffer_size * 1000;
+}
+
+static bool vbv_enabled(const struct cso_encoder_settings* settings)
+{
+	return settings->max_bitrate > 0 && settings->buffer_size > 0;
+}
+
+bool cso_encoder_can_reconfigure_live(
+	const struct ffmpeg_context* context,
+	const struct cso_encoder_settings* settings)
+{
+	const struct cso_encoder_settings* current = &context->config.encoder;
+
+	// libx264 runs x264_encoder_reconfig() when it sees these change;
+	// other encoders would silently ignore them
+	if (strcmp(context->vcodec->name, "libx264") != 0) return false;
+
+	// Keyframe interval and preset are fixed once x264 is opened, and
+	// x264 can retune VBV but not switch it on or off
+	return current->codec == settings->codec
+	       && current->threads == settings->threads
+	       && current->gop_size == settings->gop_size
+	       && strcmp(current->preset, settings->preset) == 0
+	       && current->low_latency == settings->low_latency
+	       && current->rate_control == settings->rate_control
+	       && vbv_enabled(current) == vbv_enabled(settings);
+}
+
+static int pix_fmt_depth(enum AVPixelFormat format)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+	return desc ? desc->comp[0].depth : 0;
+}
+
+// Picks the encoder and the pixel format it gets fed, and how frames have to
+// be ingested to produce that format
+static bool select_encoder(struct ffmpeg_context* context,
+			   enum AVPixelFormat* format_out)
+{
+	enum AVPixelFormat src_format = context->config.pixel_format;
+	int src_depth = pix_fmt_depth(src_format);
+	bool high_bit_depth = src_depth > 8;
+
+	const struct cso_backend* backend =
+		&backends[context->config.encoder.codec];
+
+	// Plenty of libx264 builds are 8-bit only, so HDR canvases get to try
+	// libx265 before giving up
+	bool h264 = context->config.encoder.codec == CSO_CODEC_H264;
+	const AVCodec* candidates[] = {
+		avcodec_find_encoder_by_name(backend->encoder),
+		h264 && high_bit_depth ? avcodec_find_encoder_by_name("libx265")
+				       : NULL,
+	};
+
+	context->vcodec = NULL;
+
+	for (size_t i = 0; i < sizeof(candidates) / sizeof(*candidates); i++) {
+		const AVCodec* codec = candidates[i];
+		if (!codec) continue;
+
+		enum AVPixelFormat format = src_format;
+		if (codec->pix_fmts)
+			format = avcodec_find_best_pix_fmt_of_list(
+				codec->pix_fmts, src_format, 0, NULL);
+
+		if (pix_fmt_depth(format) < src_depth) continue;
+
+		context->vcodec = codec;
+		*format_out = format;
+		break;
+	}
+
+	if (!context->vcodec) {
+		if (high_bit_depth)
+			obs_log(LOG_ERROR, "Failed to open cordyceps stalk "
+					   "encoder; no available encoder "
+					   "supports %d-bit video", src_depth);
+		else
+			obs_log(LOG_ERROR, "Failed to open cordyceps stalk "
+					   "encoder; failed to get %s encoder",
+				backend->encoder);
+		return false;
+	}
+
+	if (*format_out == src_format) {
+		context->ingest = CSO_INGEST_COPY;
+	} else if (src_format == AV_PIX_FMT_P010LE
+		   && *format_out == AV_PIX_FMT_YUV420P10LE) {
+		context->ingest = CSO_INGEST_P010;
+	} else if (src_format == AV_PIX_FMT_NV12
+		   && *format_out == AV_PIX_FMT_YUV420P) {
+		context->ingest = CSO_INGEST_NV12;
+	} else {
+		// Copying rows between different layouts just produces garbage
+		obs_log(LOG_ERROR, "Failed to open cordyceps stalk encoder; "
+				   "%s takes %s, no conversion from %s",
+			context->vcodec->name, av_get_pix_fmt_name(*format_out),
+			av_get_pix_fmt_name(src_format));
+		return false;
+	}
+
+	return true;
+}
+
+bool cso_encoder_open(struct ffmpeg_context* context)
+{
+	enum AVPixelFormat closest_format;
+	if (!select_encoder(context, &closest_format)) return false;
+
+	// Init codec context
+	context->video_ctx = avcodec_alloc_context3(context->vcodec);
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+	if (context->config.buffer_pool)
+		cso_buffer_pool_attach(context->config.buffer_pool,
+				       context->video_ctx);
+#endif
+	int scale = scale_factor(&context->config);
+	context->video_ctx->width = context->config.width * scale;
+	context->video_ctx->height = context->config.height * scale;
+	context->video_ctx->time_base = (AVRational) {context->config.fps_den,
+						     context->config.fps_num};
+	context->video_ctx->framerate = (AVRational) {context->config.fps_num,
+						     context->config.fps_den};
+	context->video_ctx->gop_size = context->config.encoder.gop_size;
+	context->video_ctx->pix_fmt = closest_format;
+	context->video_ctx->color_range = context->config.color_range;
+	context->video_ctx->color_primaries = context->config.color_primaries;
+	context->video_ctx->color_trc = context->config.color_trc;
+	context->video_ctx->colorspace = context->config.colorspace;
+	context->video_ctx->chroma_sample_location = determine_chroma_location(
+		closest_format, context->config.colorspace);
+
+	context->time_base = context->video_ctx->time_base;
+
+	// Might be unnecessary for my case but doesn't hurt to add
+	if (context->config.output_format->flags & AVFMT_GLOBALHEADER)
+		context->video_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	// Open video codec. With the libx265 fallback the backend isn't the
+	// configured one, so go by what was actually picked.
+	struct cso_encoder_settings encoder = context->config.encoder;
+	encoder.codec = cso_codec_from_string(
+		avcodec_get_name(context->vcodec->id));
+	backends[encoder.codec].set_options(context->video_ctx, &encoder);
+	cso_encoder_apply_rate_control(context->video_ctx, &encoder);
+
+	if (avcodec_open2(context->video_ctx, context->vcodec, NULL) < 0) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk encoder; "
+				     "failed to open video codec");
+		return false;
+	}
+
+	context->vframe = av_frame_alloc();
+	if (!context->vframe) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk encoder; "
+				     "failed to allocate video frame");
+		return false;
+	}
+
+	context->vframe->format = context->video_ctx->pix_fmt;
+	context->vframe->width = context->video_ctx->width;
+	context->vframe->height = context->video_ctx->height;
+	context->vframe->color_range = context->config.color_range;
+	context->vframe->color_primaries = context->config.color_primaries;
+	context->vframe->color_trc = context->config.color_trc;
+	context->vframe->colorspace = context->config.colorspace;
+	context->vframe->chroma_location = determine_chroma_location(
+		context->video_ctx->pix_fmt, context->config.colorspace);
+
+	if (av_frame_get_buffer(context->vframe, base_get_alignment()) < 0) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk encoder; "
+				     "failed to allocate video frame buffer");
+		return false;
+	}
+
+	return true;
+}
+
+bool cso_muxer_open(struct ffmpeg_context* context)
+{
+	avformat_alloc_output_context2(&context->output_ctx,
+				       context->config.output_format, NULL,
+				       context->config.filepath);
+
+	if (!context->output_ctx) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk output "
+				     "file; failed to create output context");
+		return false;
+	}
+
+	enum AVCodecID codec_id = context->video_ctx->codec_id;
+
+	if (avformat_query_codec(context->config.output_format, codec_id,
+				 FF_COMPLIANCE_NORMAL)
+	    != 1) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk output "
+				     "file; %s can't hold %s video",
+			context->config.output_format->name,
+			avcodec_get_name(codec_id));
+		return false;
+	}
+
+	context->video_stream = avformat_new_stream(context->output_ctx, NULL);
+	if (!context->video_stream) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk output "
+				     "file; failed to initialize video stream");
+		return false;
+	}
+
+	context->video_stream->time_base = context->time_base;
+	context->video_stream->avg_frame_rate = context->video_ctx->framerate;
+
+	avcodec_parameters_from_context(context->video_stream->codecpar,
+					context->video_ctx);
+
+	// The default hev1 tag doesn't play in QuickTime or Safari
+	if (codec_id == AV_CODEC_ID_HEVC)
+		context->video_stream->codecpar->codec_tag =
+			MKTAG('h', 'v', 'c', '1');
+
+	// Back to creating stream
+	// Not sure what the following is for exactly but again, can't hurt to
+	// add in case it's important
+	const bool pq = context->config.color_trc == AVCOL_TRC_SMPTE2084;
+	const bool hlg = context->config.color_trc == AVCOL_TRC_ARIB_STD_B67;
+
+	if (pq || hlg) {
+		const int hdr_nominal_peak_level =
+			pq ? context->config.hdr_nominal_peak_level
+			   : (hlg ? 1000 : 0);
+
+		size_t content_size;
+		AVContentLightMetadata *const content =
+			av_content_light_metadata_alloc(&content_size);
+		content->MaxCLL = hdr_nominal_peak_level;
+		content->MaxFALL = hdr_nominal_peak_level;
+
+		av_packet_side_data_add(
+			&context->video_stream->codecpar->coded_side_data,
+			&context->video_stream->codecpar->nb_coded_side_data,
+			AV_PKT_DATA_CONTENT_LIGHT_LEVEL, (uint8_t*) content,
+			content_size, 0);
+
+		AVMasteringDisplayMetadata* const mastering =
+			av_mastering_display_metadata_alloc();
+		mastering->display_primaries[0][0] = av_make_q(17, 25);
+		mastering->display_primaries[0][1] = av_make_q(8, 25);
+		mastering->display_primaries[1][0] = av_make_q(53, 200);
+		mastering->display_primaries[1][1] = av_make_q(69, 100);
+		mastering->display_primaries[2][0] = av_make_q(3, 20);
+		mastering->display_primaries[2][1] = av_make_q(3, 50);
+		mastering->white_point[0] = av_make_q(3127, 10000);
+		mastering->white_point[1] = av_make_q(329, 1000);
+		mastering->min_luminance = av_make_q(0, 1);
+		mastering->max_luminance = av_make_q(hdr_nominal_peak_level, 1);
+		mastering->has_primaries = 1;
+		mastering->has_luminance = 1;
+
+		av_packet_side_data_add(
+			&context->video_stream->codecpar->coded_side_data,
+			&context->video_stream->codecpar->nb_coded_side_data,
+			AV_PKT_DATA_MASTERING_DISPLAY_METADATA,
+			(uint8_t*) mastering, sizeof(*mastering), 0);
+	}
+
+	// Open output file
+	if (avio_open2(&context->output_ctx->pb, context->config.filepath,
+		       AVIO_FLAG_WRITE, NULL, NULL) < 0) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk output "
+				     "file; failed to open output filepath");
+		return false;
+	}
+
+	if (avformat_write_header(context->output_ctx, NULL) < 0) {
+		obs_log(LOG_WARNING, "Failed to open cordyceps stalk output "
+				     "file; failed to write file header");
+		return false;
+	}
+
+	return true;
+}
+
+bool cso_make_filepath(const char* dir, int segment, struct dstr* target)
+{
+	size_t len = strlen(dir);
+	if (!len || (dir[len - 1] != '/' && dir[len - 1] != '\\')) return false;
+
+	char name_buf[1024];
+	time_t cur_time = time(NULL);
+	size_t ret = strftime(name_buf, 1024, "cordyceps %Y-%m-%d "
+					      "%H-%M-%S",
+			      localtime(&cur_time));
+	if (!ret) return false;
+
+	dstr_cat(target, dir);
+	dstr_cat(target, name_buf);
+
+	// Segments can start within the same second as the previous one
+	if (segment) dstr_catf(target, " part %d", segment + 1);
+
+	dstr_cat(target, ".mp4");
+
+	return true;
+}
+
+void cso_muxer_close(AVFormatContext* output_ctx, bool write_trailer)
+{
+	if (write_trailer) av_write_trailer(output_ctx);
+
+	avio_close(output_ctx->pb);
+	avformat_free_context(output_ctx);
+}
+
+static void ingest_copy(struct ffmpeg_context* context,
+			const struct video_data* frame)
+{
+	int h_chroma_shift;
+	int v_chroma_shift;
+	av_pix_fmt_get_chroma_sub_sample(context->video_ctx->pix_fmt,
+					 &h_chroma_shift, &v_chroma_shift);
+
+	for (int plane = 0; plane < MAX_AV_PLANES; plane++) {
+		if (!frame->data[plane]) continue;
+
+		// Only the pixels themselves; with a crop, the rest of the
+		// source row belongs to pixels outside of it
+		int frame_rowsize = (int) frame->linesize[plane];
+		int pic_rowsize = context->vframe->linesize[plane];
+		int bytes = av_image_get_linesize(context->video_ctx->pix_fmt,
+						  context->video_ctx->width,
+						  plane);
+		if (bytes > frame_rowsize) bytes = frame_rowsize;
+		int plane_height = context->video_ctx->height
+				   >> (plane ? v_chroma_shift : 0);
+
+		for (int y = 0; y < plane_height; y++) {
+			int pos_frame = y * frame_rowsize;
+			int pos_pic = y * pic_rowsize;
+
+			memcpy(context->vframe->data[plane] + pos_pic,
+			       frame->data[plane] + pos_frame, bytes);
+		}
+	}
+}
+
+static void ingest_p010(struct ffmpeg_context* context,
+			const struct video_data* frame)
+{
+	AVFrame* vframe = context->vframe;
+	int width = vframe->width;
+	int height = vframe->height;
+
+	for (int y = 0; y < height; y++) {
+		cso_p010_luma_row(
+			(uint16_t*) (vframe->data[0] + y * vframe->linesize[0]),
+			(const uint16_t*) (frame->data[0]
+					   + y * frame->linesize[0]),
+			width);
+	}
+
+	for (int y = 0; y < height >> 1; y++) {
+		cso_p010_chroma_row(
+			(uint16_t*) (vframe->data[1] + y * vframe->linesize[1]),
+			(uint16_t*) (vframe->data[2] + y * vframe->linesize[2]),
+			(const uint16_t*) (frame->data[1]
+					   + y * frame->linesize[1]),
+			width >> 1);
+	}
+}
+
+static void ingest_nv12(struct ffmpeg_context* context,
+			const struct video_data* frame)
+{
+	AVFrame* vframe = context->vframe;
+	int width = vframe->width;
+	int height = vframe->height;
+
+	for (int y = 0; y < height; y++)
+		memcpy(vframe->data[0] + y * vframe->linesize[0],
+		       frame->data[0] + y * frame->linesize[0], width);
+
+	for (int y = 0; y < height >> 1; y++) {
+		cso_nv12_chroma_row(vframe->data[1] + y * vframe->linesize[1],
+				    vframe->data[2] + y * vframe->linesize[2],
+				    frame->data[1] + y * frame->linesize[1],
+				    width >> 1);
+	}
+}
+
+// Spreads a row already in the encoder's layout over the scale x scale block of
+// rows starting at dst_y
+static void upscale_row(struct ffmpeg_context* context, int plane, int dst_y,
+			const uint8_t* src, int count, int size)
+{
+	AVFrame* vframe = context->vframe;
+	int scale = context->config.scale;
+	int linesize = vframe->linesize[plane];
+	uint8_t* dst = vframe->data[plane] + (size_t) dst_y * linesize;
+
+	cso_upscale_row(dst, src, count, size, scale);
+
+	for (int i = 1; i < scale; i++)
+		memcpy(dst + (size_t) i * linesize, dst,
+		       (size_t) count * size * scale);
+}
+
+// Where a row that needs converting gets converted before upscale_row: the
+// last row of its block, which upscale_row only overwrites after reading it
+static uint8_t* staging_row(struct ffmpeg_context* context, int plane,
+			    int dst_y)
+{
+	AVFrame* vframe = context->vframe;
+	int row = dst_y + context->config.scale - 1;
+
+	return vframe->data[plane] + (size_t) row * vframe->linesize[plane];
+}
+
+static void ingest_scaled_copy(struct ffmpeg_context* context,
+			       const struct video_data* frame)
+{
+	const AVPixFmtDescriptor* desc =
+		av_pix_fmt_desc_get(context->video_ctx->pix_fmt);
+	int scale = context->config.scale;
+
+	for (int plane = 0; plane < MAX_AV_PLANES; plane++) {
+		int size = plane_sample_size(desc, plane);
+		if (!frame->data[plane] || !size) continue;
+
+		bool chroma = plane == 1 || plane == 2;
+		int width = context->config.width
+			    >> (chroma ? desc->log2_chroma_w : 0);
+		int height = context->config.height
+			     >> (chroma ? desc->log2_chroma_h : 0);
+
+		for (int y = 0; y < height; y++) {
+			const uint8_t* src = frame->data[plane]
+					     + (size_t) y
+						       * frame->linesize[plane];
+			upscale_row(context, plane, y * scale, src, width,
+				    size);
+		}
+	}
+}
+
+static void ingest_scaled_p010(struct ffmpeg_context* context,
+			       const struct video_data* frame)
+{
+	int width = context->config.width;
+	int height = context->config.height;
+	int scale = context->config.scale;
+
+	for (int y = 0; y < height; y++) {
+		uint16_t* luma = (uint16_t*) staging_row(context, 0, y * scale);
+
+		cso_p010_luma_row(luma,
+				  (const uint16_t*) (frame->data[0]
+						     + y * frame->linesize[0]),
+				  width);
+		upscale_row(context, 0, y * scale, (uint8_t*) luma, width, 2);
+	}
+
+	for (int y = 0; y < height >> 1; y++) {
+		const uint8_t* src = frame->data[1] + y * frame->linesize[1];
+		uint16_t* u = (uint16_t*) staging_row(context, 1, y * scale);
+		uint16_t* v = (uint16_t*) staging_row(context, 2, y * scale);
+
+		cso_p010_chroma_row(u, v, (const uint16_t*) src, width >> 1);
+		upscale_row(context, 1, y * scale, (uint8_t*) u, width >> 1, 2);
+		upscale_row(context, 2, y * scale, (uint8_t*) v, width >> 1, 2);
+	}
+}
+
+static void ingest_scaled_nv12(struct ffmpeg_context* context,
+			       const struct video_data* frame)
+{
+	int width = context->config.width;
+	int height = context->config.height;
+	int scale = context->config.scale;
+
+	for (int y = 0; y < height; y++)
+		upscale_row(context, 0, y * scale,
+			    frame->data[0] + y * frame->linesize[0], width, 1);
+
+	for (int y = 0; y < height >> 1; y++) {
+		uint8_t* u = staging_row(context, 1, y * scale);
+		uint8_t* v = staging_row(context, 2, y * scale);
+
+		cso_nv12_chroma_row(u, v,
+				    frame->data[1] + y * frame->linesize[1],
+				    width >> 1);
+		upscale_row(context, 1, y * scale, u, width >> 1, 1);
+		upscale_row(context, 2, y * scale, v, width >> 1, 1);
+	}
+}
+
+const char* cso_encoder_ingest_name(enum cso_ingest ingest)
+{
+	switch (ingest) {
+	case CSO_INGEST_P010:
+		return "P010 repack";
+	case CSO_INGEST_NV12:
+		return "NV12 chroma split";
+	default:
+		return "copy";
+	}
+}
+
+void cso_encoder_frame_sent(struct ffmpeg_context* context, int64_t pts,
+			    uint64_t now_ns)
+{
+	context->sent_ns[pts % CSO_LATENCY_SLOTS] = now_ns;
+	context->frames_in_flight++;
+
+	if (context->frames_in_flight > context->max_in_flight)
+		context->max_in_flight = context->frames_in_flight;
+}
+
+uint64_t cso_encoder_packet_received(struct ffmpeg_context* context,
+				     const AVPacket* packet, uint64_t now_ns)
+{
+	if (context->frames_in_flight <= 0 || packet->pts < 0) return 0;
+
+	context->frames_in_flight--;
+
+	uint64_t latency_ns =
+		now_ns - context->sent_ns[packet->pts % CSO_LATENCY_SLOTS];
+	context->latency_total_ns += latency_ns;
+	context->latency_samples++;
+
+	return latency_ns;
+}
+
+void cso_encoder_ingest(struct ffmpeg_context* context,
+			const struct video_data* frame)
+{
+	if (scale_factor(&context->config) > 1) {
+		switch (context->ingest) {
+		case CSO_INGEST_COPY:
+			ingest_scaled_copy(context, frame);
+			break;
+		case CSO_INGEST_P010:
+			ingest_scaled_p010(context, frame);
+			break;
+		case CSO_INGEST_NV12:
+			ingest_scaled_nv12(context, frame);
+			break;
+		}
+		return;
+	}
+
+	switch (context->ingest) {
+	case CSO_INGEST_COPY:
+		ingest_copy(context, frame);
+		break;
+	case CSO_INGEST_P010:
+		ingest_p010(context, frame);
+		break;
+	case CSO_INGEST_NV12:
+		ingest_nv12(context, frame);
+		break;
+	}
+}
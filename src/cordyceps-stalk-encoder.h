@@ -0,0 +1,206 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Encoder and muxer setup shared by the output and the replay tool. Nothing in
+// here touches the running OBS instance; everything it needs comes in through
+// ffmpeg_config.
+
+#pragma once
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <util/dstr.h>
+
+#include "cordyceps-stalk-pool.h"
+
+// Software encoders a recording can use. Each maps the shared preset and CRF
+// settings onto its own options, see the backend table in the .c file.
+enum cso_codec {
+	CSO_CODEC_H264, // libx264
+	CSO_CODEC_HEVC, // libx265
+	CSO_CODEC_AV1,  // libsvtav1
+	CSO_CODEC_VP9,  // libvpx-vp9
+};
+
+enum cso_rate_control {
+	CSO_RATE_CONTROL_CRF,
+	CSO_RATE_CONTROL_ABR,
+};
+
+// Encoder settings that update_settings is allowed to change mid-recording.
+// Bitrates are in kbps, same as x264 takes them. crf and preset are on x264's
+// scales whatever the codec, so switching codecs keeps roughly the same
+// quality and speed.
+struct cso_encoder_settings {
+	enum cso_codec codec;
+	int threads; // 0 lets the encoder decide
+	int gop_size; // Also known as keyframe interval
+	enum cso_rate_control rate_control;
+	double crf;
+	int bitrate;
+	int max_bitrate; // 0 disables VBV
+	int buffer_size;
+	char preset[32];
+	// No lookahead, B-frames or frame threads, so each frame's packet
+	// comes out right after it goes in. Costs compression.
+	bool low_latency;
+};
+
+// How frames from OBS get into the encoder's frame
+enum cso_ingest {
+	CSO_INGEST_COPY, // Same layout on both sides, plain row copies
+	CSO_INGEST_P010, // P010 repacked into 10-bit planar 4:2:0
+	CSO_INGEST_NV12, // NV12 chroma split into planar 4:2:0
+};
+
+// Frames the encoder can hold at once before latency tracking loses count.
+// Well past x264's deepest lookahead plus frame threads.
+#define CSO_LATENCY_SLOTS 512
+
+struct ffmpeg_config {
+	const char* filepath; // Lives in the recording's arena
+	const AVOutputFormat* output_format;
+	struct cso_buffer_pool* buffer_pool;
+	struct cso_encoder_settings encoder;
+	int width;
+	int height;
+	int fps_num;
+	int fps_den;
+	int hdr_nominal_peak_level; // Only used for PQ
+
+	// Top left corner of the encoded area within the source frame. width
+	// and height above are the size of that area.
+	int crop_x;
+	int crop_y;
+
+	// Integer upscale of that area in the encoder's frame, 0 or 1 for
+	// none. The encoded size is width and height times this.
+	int scale;
+
+	enum AVPixelFormat pixel_format;
+	enum AVColorRange color_range;
+	enum AVColorPrimaries color_primaries;
+	enum AVColorTransferCharacteristic color_trc;
+	enum AVColorSpace colorspace;
+};
+
+struct ffmpeg_context {
+	AVStream* video_stream;
+	AVCodecContext* video_ctx;
+	const AVCodec* vcodec;
+	AVFormatContext* output_ctx;
+
+	AVFrame* vframe;
+	int64_t total_frames;
+
+	enum cso_ingest ingest;
+	uint64_t ingest_total_ns;
+	int64_t ingested_frames;
+
+	// When each frame still inside the encoder went in, by pts, see
+	// cso_encoder_frame_sent()
+	uint64_t sent_ns[CSO_LATENCY_SLOTS];
+	int frames_in_flight;
+	int max_in_flight;
+	uint64_t latency_total_ns;
+	int64_t latency_samples;
+
+	// Copied out of the codec context so the write thread can rescale
+	// packets without touching an encoder that might be getting replaced
+	AVRational time_base;
+	int segment;
+
+	struct ffmpeg_config config;
+
+	bool initialized;
+};
+
+// Fills in the pixel format, frame rate and colour fields of config
+void cso_encoder_config_from_video(struct ffmpeg_config* config,
+				   const struct video_output_info* voi);
+
+// Crop rectangle in source pixels. Zero width or height means everything
+// right of or below the corner.
+struct cso_crop {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Shrinks config to crop, which gets clamped to the source frame and aligned
+// to the pixel format's chroma subsampling. Needs config's pixel format and
+// the uncropped size already set. Returns false if nothing gets cropped.
+bool cso_encoder_apply_crop(struct ffmpeg_config* config,
+			    const struct cso_crop* crop);
+
+#define CSO_MAX_SCALE 4
+
+// Sets config to upscale the encoded area by scale with nearest-neighbour
+// sampling, if the pixel format allows. Needs config's pixel format set.
+// Returns false if nothing gets upscaled.
+bool cso_encoder_apply_scale(struct ffmpeg_config* config, int scale);
+
+// Points frame at the crop area of the source frame it describes
+void cso_encoder_crop_frame(const struct ffmpeg_config* config,
+			    struct video_data* frame);
+
+enum cso_codec cso_codec_from_string(const char* name);
+const char* cso_codec_to_string(enum cso_codec codec);
+
+void cso_encoder_get_settings(obs_data_t* settings,
+			      struct cso_encoder_settings* out);
+bool cso_encoder_settings_equal(const struct cso_encoder_settings* a,
+				const struct cso_encoder_settings* b);
+
+// Rate control fields that libx264 re-reads from the codec context on every
+// frame, so they can be changed on an open encoder
+void cso_encoder_apply_rate_control(
+	AVCodecContext* video_ctx, const struct cso_encoder_settings* settings);
+bool cso_encoder_can_reconfigure_live(
+	const struct ffmpeg_context* context,
+	const struct cso_encoder_settings* settings);
+
+// Opens the encoder and its input frame for context->config
+bool cso_encoder_open(struct ffmpeg_context* context);
+
+const char* cso_encoder_ingest_name(enum cso_ingest ingest);
+
+// Encoder delay bookkeeping, called after a frame is sent to the encoder and
+// for each packet that comes out. Packets have to keep their frame's pts.
+// Returns how long the packet's frame spent in the encoder, 0 if unknown.
+void cso_encoder_frame_sent(struct ffmpeg_context* context, int64_t pts,
+			    uint64_t now_ns);
+uint64_t cso_encoder_packet_received(struct ffmpeg_context* context,
+				     const AVPacket* packet, uint64_t now_ns);
+
+// Copies a frame from OBS into context->vframe, which must be writable.
+// Upscales on the way in when config.scale asks for it.
+void cso_encoder_ingest(struct ffmpeg_context* context,
+			const struct video_data* frame);
+
+// Creates the output file for context->config.filepath and writes its header.
+// Takes the stream's parameters from context->video_ctx, which is normally the
+// open encoder.
+bool cso_muxer_open(struct ffmpeg_context* context);
+void cso_muxer_close(AVFormatContext* output_ctx, bool write_trailer);
+
+// Appends a timestamped recording name in dir, which has to end in a slash
+bool cso_make_filepath(const char* dir, int segment, struct dstr* target);
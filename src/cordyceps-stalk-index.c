@@ -0,0 +1,77 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-index.h"
+#include "cordyceps-stalk-raw.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+
+bool cso_index_open(struct cso_index* index, const char* media_path,
+		    AVRational time_base)
+{
+	// Don't retry (and log) on every keyframe if the first attempt failed
+	if (index->failed) return false;
+
+	struct dstr path;
+	dstr_init_copy(&path, media_path);
+	dstr_cat(&path, ".csidx");
+
+	index->file = os_fopen(path.array, "wb");
+	if (!index->file) {
+		obs_log(LOG_WARNING, "Failed to open seek index \"%s\"",
+			path.array);
+		index->failed = true;
+		dstr_free(&path);
+		return false;
+	}
+
+	dstr_free(&path);
+
+	fwrite("CSIX", 1, 4, index->file);
+	cso_write_le(index->file, CSO_INDEX_VERSION, 4);
+	cso_write_le(index->file, (uint32_t) time_base.num, 4);
+	cso_write_le(index->file, (uint32_t) time_base.den, 4);
+
+	return true;
+}
+
+void cso_index_add(struct cso_index* index, int64_t frame, int64_t offset,
+		   const char* label)
+{
+	if (!index->file) return;
+
+	size_t label_len = label ? strlen(label) : 0;
+	if (label_len > UINT16_MAX) label_len = UINT16_MAX;
+
+	cso_write_le(index->file, (uint64_t) frame, 8);
+	cso_write_le(index->file, (uint64_t) offset, 8);
+	cso_write_le(index->file, label_len, 2);
+	if (label_len) fwrite(label, 1, label_len, index->file);
+
+	// Keep the index usable if OBS goes down mid-recording
+	fflush(index->file);
+}
+
+void cso_index_close(struct cso_index* index)
+{
+	if (index->file) fclose(index->file);
+
+	index->file = NULL;
+	index->failed = false;
+}
@@ -0,0 +1,47 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Sidecar seek index written next to each recording as "<file>.csidx", so
+// editing tools can find keyframes without scanning the file.
+//
+// All integers are little-endian.
+//   Header: "CSIX", u32 version, u32 time base num, u32 time base den
+//   Entry:  u64 frame, u64 byte offset, u16 label length, label bytes
+//
+// Frame numbers count encoded frames from the start of the file; multiplying
+// by the time base gives the presentation time in seconds. The byte offset is
+// where the keyframe's data starts in the file. Entries are appended as the
+// keyframes are written, in file order.
+
+#pragma once
+
+#include <obs-module.h>
+#include <libavutil/avutil.h>
+
+#define CSO_INDEX_VERSION 1
+
+struct cso_index {
+	FILE* file;
+	bool failed;
+};
+
+bool cso_index_open(struct cso_index* index, const char* media_path,
+		    AVRational time_base);
+void cso_index_add(struct cso_index* index, int64_t frame, int64_t offset,
+		   const char* label);
+void cso_index_close(struct cso_index* index);
@@ -0,0 +1,368 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-kernels.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#define CSO_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#define CSO_NEON
+#include <arm_neon.h>
+#endif
+
+void cso_p010_luma_row(uint16_t* dst, const uint16_t* src, int width)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	for (; x + 8 <= width; x += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + x));
+		_mm_storeu_si128((__m128i*) (dst + x), _mm_srli_epi16(v, 6));
+	}
+#elif defined(CSO_NEON)
+	for (; x + 8 <= width; x += 8)
+		vst1q_u16(dst + x, vshrq_n_u16(vld1q_u16(src + x), 6));
+#endif
+
+	for (; x < width; x++) dst[x] = src[x] >> 6;
+}
+
+void cso_p010_chroma_row(uint16_t* dst_u, uint16_t* dst_v,
+			 const uint16_t* src, int width)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	const __m128i low_mask = _mm_set1_epi32(0xFFFF);
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*) (src + x * 2));
+		__m128i b = _mm_loadu_si128((const __m128i*) (src + x * 2 + 8));
+
+		a = _mm_srli_epi16(a, 6);
+		b = _mm_srli_epi16(b, 6);
+
+		// Samples are at most 10 bits after the shift, so the signed
+		// saturating pack can't clip anything
+		__m128i u = _mm_packs_epi32(_mm_and_si128(a, low_mask),
+					    _mm_and_si128(b, low_mask));
+		__m128i v = _mm_packs_epi32(_mm_srli_epi32(a, 16),
+					    _mm_srli_epi32(b, 16));
+
+		_mm_storeu_si128((__m128i*) (dst_u + x), u);
+		_mm_storeu_si128((__m128i*) (dst_v + x), v);
+	}
+#elif defined(CSO_NEON)
+	for (; x + 8 <= width; x += 8) {
+		uint16x8x2_t uv = vld2q_u16(src + x * 2);
+		vst1q_u16(dst_u + x, vshrq_n_u16(uv.val[0], 6));
+		vst1q_u16(dst_v + x, vshrq_n_u16(uv.val[1], 6));
+	}
+#endif
+
+	for (; x < width; x++) {
+		dst_u[x] = src[x * 2] >> 6;
+		dst_v[x] = src[x * 2 + 1] >> 6;
+	}
+}
+
+void cso_nv12_chroma_row(uint8_t* dst_u, uint8_t* dst_v, const uint8_t* src,
+			 int width)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	const __m128i low_mask = _mm_set1_epi16(0xFF);
+
+	for (; x + 16 <= width; x += 16) {
+		const uint8_t* pair = src + x * 2;
+		__m128i a = _mm_loadu_si128((const __m128i*) pair);
+		__m128i b = _mm_loadu_si128((const __m128i*) (pair + 16));
+
+		__m128i u = _mm_packus_epi16(_mm_and_si128(a, low_mask),
+					     _mm_and_si128(b, low_mask));
+		__m128i v = _mm_packus_epi16(_mm_srli_epi16(a, 8),
+					     _mm_srli_epi16(b, 8));
+
+		_mm_storeu_si128((__m128i*) (dst_u + x), u);
+		_mm_storeu_si128((__m128i*) (dst_v + x), v);
+	}
+#elif defined(CSO_NEON)
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x2_t uv = vld2q_u8(src + x * 2);
+		vst1q_u8(dst_u + x, uv.val[0]);
+		vst1q_u8(dst_v + x, uv.val[1]);
+	}
+#endif
+
+	for (; x < width; x++) {
+		dst_u[x] = src[x * 2];
+		dst_v[x] = src[x * 2 + 1];
+	}
+}
+
+void cso_accumulate_row(uint16_t* acc, const uint8_t* src, int count,
+			uint16_t weight, bool first)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16((short) weight);
+
+	for (; x + 16 <= count; x += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i*) (src + x));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w);
+
+		if (!first) {
+			lo = _mm_add_epi16(
+				lo, _mm_loadu_si128((__m128i*) (acc + x)));
+			hi = _mm_add_epi16(
+				hi, _mm_loadu_si128((__m128i*) (acc + x + 8)));
+		}
+
+		_mm_storeu_si128((__m128i*) (acc + x), lo);
+		_mm_storeu_si128((__m128i*) (acc + x + 8), hi);
+	}
+#elif defined(CSO_NEON)
+	for (; x + 16 <= count; x += 16) {
+		uint8x16_t s = vld1q_u8(src + x);
+		uint16x8_t lo = first ? vdupq_n_u16(0) : vld1q_u16(acc + x);
+		uint16x8_t hi = first ? vdupq_n_u16(0) : vld1q_u16(acc + x + 8);
+
+		vst1q_u16(acc + x, vmlaq_n_u16(lo, vmovl_u8(vget_low_u8(s)),
+					       weight));
+		vst1q_u16(acc + x + 8,
+			  vmlaq_n_u16(hi, vmovl_u8(vget_high_u8(s)), weight));
+	}
+#endif
+
+	for (; x < count; x++) {
+		uint16_t value = (uint16_t) (src[x] * weight);
+		acc[x] = first ? value : (uint16_t) (acc[x] + value);
+	}
+}
+
+void cso_resolve_row(uint8_t* dst, const uint16_t* acc, int count)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	// At most 255 * 256 + 128, still fits in 16 bits
+	const __m128i round = _mm_set1_epi16(128);
+
+	for (; x + 16 <= count; x += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i*) (acc + x));
+		__m128i hi = _mm_loadu_si128((const __m128i*) (acc + x + 8));
+
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+
+		_mm_storeu_si128((__m128i*) (dst + x),
+				 _mm_packus_epi16(lo, hi));
+	}
+#elif defined(CSO_NEON)
+	for (; x + 16 <= count; x += 16) {
+		uint8x8_t lo = vrshrn_n_u16(vld1q_u16(acc + x), 8);
+		uint8x8_t hi = vrshrn_n_u16(vld1q_u16(acc + x + 8), 8);
+		vst1q_u8(dst + x, vcombine_u8(lo, hi));
+	}
+#endif
+
+	for (; x < count; x++) dst[x] = (uint8_t) ((acc[x] + 128) >> 8);
+}
+
+uint32_t cso_cell_bits(const uint8_t* src, int cell_width, int cells)
+{
+	uint32_t threshold = (uint32_t) cell_width * 128;
+	uint32_t bits = 0;
+	int cell = 0;
+
+#if defined(CSO_SSE2)
+	if (cell_width % 8 == 0) {
+		const __m128i zero = _mm_setzero_si128();
+
+		for (; cell < cells; cell++) {
+			const uint8_t* run = src + cell * cell_width;
+			__m128i sum = zero;
+
+			for (int x = 0; x < cell_width; x += 8) {
+				__m128i s = _mm_loadl_epi64(
+					(const __m128i*) (run + x));
+				sum = _mm_add_epi64(sum, _mm_sad_epu8(s, zero));
+			}
+
+			if ((uint32_t) _mm_cvtsi128_si32(sum) >= threshold)
+				bits |= 1u << cell;
+		}
+	}
+#elif defined(CSO_NEON)
+	if (cell_width % 8 == 0) {
+		for (; cell < cells; cell++) {
+			const uint8_t* run = src + cell * cell_width;
+			uint16x8_t sum = vdupq_n_u16(0);
+
+			// At most 32 loads of 255 per lane
+			for (int x = 0; x < cell_width; x += 8)
+				sum = vaddw_u8(sum, vld1_u8(run + x));
+
+			uint64x2_t total = vpaddlq_u32(vpaddlq_u16(sum));
+			if (vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1)
+			    >= threshold)
+				bits |= 1u << cell;
+		}
+	}
+#endif
+
+	for (; cell < cells; cell++) {
+		const uint8_t* run = src + cell * cell_width;
+		uint32_t sum = 0;
+
+		for (int x = 0; x < cell_width; x++) sum += run[x];
+
+		if (sum >= threshold) bits |= 1u << cell;
+	}
+
+	return bits;
+}
+
+#if defined(CSO_SSE2)
+// Every element of v, size bytes wide, twice in a row across lo and hi
+static inline void sse2_repeat2(__m128i v, int size, __m128i* lo,
+				__m128i* hi)
+{
+	switch (size) {
+	case 1:
+		*lo = _mm_unpacklo_epi8(v, v);
+		*hi = _mm_unpackhi_epi8(v, v);
+		break;
+	case 2:
+		*lo = _mm_unpacklo_epi16(v, v);
+		*hi = _mm_unpackhi_epi16(v, v);
+		break;
+	case 4:
+		*lo = _mm_unpacklo_epi32(v, v);
+		*hi = _mm_unpackhi_epi32(v, v);
+		break;
+	default:
+		*lo = _mm_unpacklo_epi64(v, v);
+		*hi = _mm_unpackhi_epi64(v, v);
+		break;
+	}
+}
+#endif
+
+void cso_upscale_row(uint8_t* dst, const uint8_t* src, int count, int size,
+		     int factor)
+{
+	int x = 0;
+
+#if defined(CSO_SSE2)
+	int step = 16 / size;
+
+	if (factor == 2) {
+		for (; x + step <= count; x += step) {
+			__m128i v = _mm_loadu_si128(
+				(const __m128i*) (src + x * size));
+			__m128i* out = (__m128i*) (dst + x * size * 2);
+			__m128i lo, hi;
+
+			sse2_repeat2(v, size, &lo, &hi);
+			_mm_storeu_si128(out, lo);
+			_mm_storeu_si128(out + 1, hi);
+		}
+	} else if (factor == 4) {
+		for (; x + step <= count; x += step) {
+			__m128i v = _mm_loadu_si128(
+				(const __m128i*) (src + x * size));
+			__m128i* out = (__m128i*) (dst + x * size * 4);
+			__m128i lo, hi, a, b;
+
+			// Twice, then each pair of copies twice again
+			sse2_repeat2(v, size, &lo, &hi);
+			sse2_repeat2(lo, size * 2, &a, &b);
+			_mm_storeu_si128(out, a);
+			_mm_storeu_si128(out + 1, b);
+			sse2_repeat2(hi, size * 2, &a, &b);
+			_mm_storeu_si128(out + 2, a);
+			_mm_storeu_si128(out + 3, b);
+		}
+	}
+#elif defined(CSO_NEON)
+	// The interleaving stores write each lane factor times in a row
+	if (size == 1) {
+		for (; x + 16 <= count; x += 16) {
+			uint8x16_t v = vld1q_u8(src + x);
+			uint8_t* out = dst + x * factor;
+
+			if (factor == 2)
+				vst2q_u8(out, (uint8x16x2_t) {{v, v}});
+			else if (factor == 3)
+				vst3q_u8(out, (uint8x16x3_t) {{v, v, v}});
+			else
+				vst4q_u8(out, (uint8x16x4_t) {{v, v, v, v}});
+		}
+	} else if (size == 2) {
+		for (; x + 8 <= count; x += 8) {
+			uint16x8_t v = vld1q_u16((const uint16_t*) src + x);
+			uint16_t* out = (uint16_t*) dst + x * factor;
+
+			if (factor == 2)
+				vst2q_u16(out, (uint16x8x2_t) {{v, v}});
+			else if (factor == 3)
+				vst3q_u16(out, (uint16x8x3_t) {{v, v, v}});
+			else
+				vst4q_u16(out, (uint16x8x4_t) {{v, v, v, v}});
+		}
+	} else {
+		for (; x + 4 <= count; x += 4) {
+			uint32x4_t v = vld1q_u32((const uint32_t*) src + x);
+			uint32_t* out = (uint32_t*) dst + x * factor;
+
+			if (factor == 2)
+				vst2q_u32(out, (uint32x4x2_t) {{v, v}});
+			else if (factor == 3)
+				vst3q_u32(out, (uint32x4x3_t) {{v, v, v}});
+			else
+				vst4q_u32(out, (uint32x4x4_t) {{v, v, v, v}});
+		}
+	}
+#endif
+
+	// Fixed-size copies, so the compiler turns them into plain moves
+	for (; x < count; x++) {
+		const uint8_t* in = src + x * size;
+		uint8_t* out = dst + x * size * factor;
+
+		for (int i = 0; i < factor; i++, out += size) {
+			switch (size) {
+			case 1:
+				*out = *in;
+				break;
+			case 2:
+				memcpy(out, in, 2);
+				break;
+			default:
+				memcpy(out, in, 4);
+				break;
+			}
+		}
+	}
+}
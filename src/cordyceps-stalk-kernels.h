@@ -0,0 +1,59 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Per-row pixel kernels used when ingesting frames. Each has an SSE2 or NEON
+// version where available and a scalar fallback; none of them require any
+// particular alignment.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// P010 stores 10-bit samples in the high bits of each 16-bit word, the
+// encoders want them in the low bits
+void cso_p010_luma_row(uint16_t* dst, const uint16_t* src, int width);
+
+// Splits an interleaved P010 chroma row into separate U and V rows. width is
+// in chroma samples.
+void cso_p010_chroma_row(uint16_t* dst_u, uint16_t* dst_v,
+			 const uint16_t* src, int width);
+
+// Same for 8-bit NV12 chroma, for encoders that only take planar 4:2:0
+void cso_nv12_chroma_row(uint8_t* dst_u, uint8_t* dst_v, const uint8_t* src,
+			 int width);
+
+// Adds weight * src to a 16-bit accumulation row, or overwrites it with that
+// when first is set. Weights of a group must sum to at most 256 so the
+// accumulator can't overflow.
+void cso_accumulate_row(uint16_t* acc, const uint8_t* src, int count,
+			uint16_t weight, bool first);
+
+// Divides an accumulation row by 256 with rounding
+void cso_resolve_row(uint8_t* dst, const uint16_t* acc, int count);
+
+// Bit i is set when the mean of the i-th run of cell_width samples is at least
+// half range. cells is at most 32, and cell_width at most 256.
+uint32_t cso_cell_bits(const uint8_t* src, int cell_width, int cells);
+
+// Nearest-neighbour upscale of a row: each of count samples, size bytes wide
+// (1, 2 or 4), is written factor times (2 to 4) in a row. 3x has no SSE2
+// version.
+void cso_upscale_row(uint8_t* dst, const uint8_t* src, int count, int size,
+		     int factor);
@@ -28,8 +28,38 @@ static void ffmpeg_log(void* param, int level, const char* format, va_list args)
 		blogva(LOG_DEBUG, format, args);
 }
 
+static void open_take(struct cso_data* cso, const char* title);
+static void close_take(struct cso_data* cso);
+static void add_chapters(struct cso_data* cso, AVFormatContext* output_ctx,
+			 int segment);
+
+static void log_cpu_usage(struct cso_data* cso)
+{
+	struct cso_cpu_usage usage;
+	cso_cpu_get_usage(&cso->cpu, &usage);
+
+	if (!usage.role_ns[CSO_CPU_ENCODER]) return;
+
+	obs_log(LOG_INFO, "Cordyceps-stalk CPU time: encoder %.1f s, writer "
+			  "%.1f s, ingest %.1f s (%.1f%% of all CPUs)",
+		usage.role_ns[CSO_CPU_ENCODER] / 1e9,
+		usage.role_ns[CSO_CPU_WRITER] / 1e9,
+		usage.role_ns[CSO_CPU_INGEST] / 1e9, usage.percent);
+}
+
 static void ffmpeg_deactivate(struct cso_data* cso)
 {
+	// Has to go first, it feeds the encoder the same way OBS's video
+	// thread does
+	if (cso->shm_thread_active) {
+		os_atomic_set_bool(&cso->shm_stopping, true);
+		pthread_join(cso->shm_thread, NULL);
+		cso->shm_thread_active = false;
+	}
+
+	cso_shm_close(&cso->shm);
+	os_atomic_set_bool(&cso->direct_ingest, false);
+
 	if (cso->write_thread_active) {
 		os_event_signal(cso->stop_event);
 		os_sem_post(cso->write_semaphore);
@@ -37,58 +67,291 @@ static void ffmpeg_deactivate(struct cso_data* cso)
 		cso->write_thread_active = false;
 	}
 
+	// Nothing encodes anymore, so a running take ends here
+	close_take(cso);
+	if (cso->next_output_ctx)
+		add_chapters(cso, cso->next_output_ctx,
+			     cso->write_segment + 1);
+
 	pthread_mutex_lock(&cso->write_mutex);
 
 	for (size_t i = 0; i < cso->packets.num; i++)
-		av_packet_free(cso->packets.array + i);
+		cso_packet_pool_put(&cso->packet_pool, cso->packets.array[i]);
 	da_free(cso->packets);
+	da_free(cso->packet_times);
+
+	// Segment switch that the write thread never got to
+	if (cso->next_output_ctx) {
+		cso_muxer_close(cso->next_output_ctx, true);
+		cso->next_output_ctx = NULL;
+		cso->next_video_stream = NULL;
+	}
+
+	for (size_t i = 0; i < cso->keyframe_labels.num; i++)
+		bfree(cso->keyframe_labels.array[i].label);
+	da_free(cso->keyframe_labels);
 
 	pthread_mutex_unlock(&cso->write_mutex);
 
-	if (cso->context.initialized) av_write_trailer(cso->context.output_ctx);
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso->session = false;
+	cso->take_active = false;
+	cso->take_started = false;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	// Both pipeline threads are done with their trace buffers by now
+	if (cso->trace.enabled && cso->context.config.filepath) {
+		struct dstr trace_path;
+		dstr_init_copy(&trace_path, cso->context.config.filepath);
+		dstr_cat(&trace_path, ".trace.json");
 
-	if (cso->context.video_stream) {
-		avcodec_free_context(&cso->context.video_ctx);
-		av_frame_unref(cso->context.vframe);
-		av_frame_free(&cso->context.vframe);
-	}
+		cso_trace_write(&cso->trace, trace_path.array);
 
-	if (cso->context.output_ctx) {
-		avio_close(cso->context.output_ctx->pb);
-		avformat_free_context(cso->context.output_ctx);
+		dstr_free(&trace_path);
+	}
+	cso_trace_free(&cso->trace);
+	cso_index_close(&cso->index);
+
+	if (cso->context.ingested_frames)
+		obs_log(LOG_INFO, "Cordyceps-stalk ingest took %.1f us per "
+				  "frame on average over %lld frames (%s)",
+			(double) cso->context.ingest_total_ns
+				/ (double) cso->context.ingested_frames
+				/ 1000.0,
+			(long long) cso->context.ingested_frames,
+			cso_encoder_ingest_name(cso->context.ingest));
+
+	if (cso->context.latency_samples)
+		obs_log(LOG_INFO, "Cordyceps-stalk encoder held frames for "
+				  "%.2f ms on average, up to %d at a time%s",
+			(double) cso->context.latency_total_ns
+				/ (double) cso->context.latency_samples
+				/ 1000000.0,
+			cso->context.max_in_flight,
+			cso->context.config.encoder.low_latency
+				? " (low latency)"
+				: "");
+
+	// A partially accumulated group is dropped
+	cso_accumulator_free(&cso->accumulator);
+
+	if (cso->stamp.enabled)
+		obs_log(LOG_INFO, "Cordyceps-stalk skipped %ld repeated frames "
+				  "by their stamps, %ld frames had no stamp",
+			cso->stamp.stale, cso->stamp.unreadable);
+	memset(&cso->stamp, 0, sizeof(cso->stamp));
+
+	cso_raw_writer_close(&cso->raw);
+	cso->raw_dump = false;
+
+	// Both threads that feed the sinks are gone, this drains them
+	cso_sinks_stop(&cso->sinks);
+
+	// Blocks until the queued stills are written
+	cso_still_pool_stop(&cso->stills);
+	if (cso->stills.written || cso->stills.dropped || cso->stills.failed)
+		obs_log(LOG_INFO, "Cordyceps-stalk wrote %ld stills (%ld "
+				  "dropped, %ld failed)",
+			cso->stills.written, cso->stills.dropped,
+			cso->stills.failed);
+
+	if (cso->context.initialized) {
+		add_chapters(cso, cso->context.output_ctx, cso->write_segment);
+		av_write_trailer(cso->context.output_ctx);
 	}
 
+	// Only left over from segments that never got a trailer
+	for (size_t i = 0; i < cso->takes.num; i++)
+		bfree(cso->takes.array[i].title);
+	da_free(cso->takes);
+
+	cso_cpu_retire(&cso->cpu, CSO_CPU_ENCODER, cso->context.segment);
+	avcodec_free_context(&cso->context.video_ctx);
+	av_frame_free(&cso->context.vframe);
+
+	cso_cpu_stop(&cso->cpu);
+	log_cpu_usage(cso);
+
+	if (cso->context.output_ctx)
+		cso_muxer_close(cso->context.output_ctx, false);
+
+	// Encoder is gone, so nothing can ask for buffers anymore
+	cso_buffer_pool_free(&cso->buffer_pool);
+	cso_arena_reset(&cso->arena);
+
 	memset(&cso->context, 0, sizeof(struct ffmpeg_context));
 }
 
+// Turns the takes recorded in segment into chapters of its file. Has to happen
+// before the trailer, which is where the mp4 muxer writes them.
+static void add_chapters(struct cso_data* cso, AVFormatContext* output_ctx,
+			 int segment)
+{
+	pthread_mutex_lock(&cso->write_mutex);
+
+	for (size_t i = 0; i < cso->takes.num;) {
+		struct cso_take* take = &cso->takes.array[i];
+
+		if (take->segment != segment) {
+			i++;
+			continue;
+		}
+
+		AVChapter** chapters = av_realloc_array(
+			output_ctx->chapters, output_ctx->nb_chapters + 1,
+			sizeof(AVChapter*));
+		AVChapter* chapter = av_mallocz(sizeof(AVChapter));
+
+		if (chapters) output_ctx->chapters = chapters;
+
+		if (chapters && chapter) {
+			chapter->id = output_ctx->nb_chapters;
+			chapter->time_base = take->time_base;
+			chapter->start = take->start;
+			chapter->end = take->end >= 0 ? take->end : take->start;
+			av_dict_set(&chapter->metadata, "title", take->title,
+				    0);
+			output_ctx->chapters[output_ctx->nb_chapters++] =
+				chapter;
+		} else {
+			av_free(chapter);
+		}
+
+		bfree(take->title);
+		da_erase(cso->takes, i);
+	}
+
+	pthread_mutex_unlock(&cso->write_mutex);
+}
+
+// Called by the write thread when it reaches a segment marker
+static void finish_segment(struct cso_data* cso)
+{
+	add_chapters(cso, cso->context.output_ctx, cso->write_segment);
+	cso_muxer_close(cso->context.output_ctx, true);
+	cso_index_close(&cso->index);
+	cso->write_segment++;
+
+	pthread_mutex_lock(&cso->write_mutex);
+	cso->context.output_ctx = cso->next_output_ctx;
+	cso->context.video_stream = cso->next_video_stream;
+	cso->next_output_ctx = NULL;
+	cso->next_video_stream = NULL;
+	pthread_mutex_unlock(&cso->write_mutex);
+}
+
+// Adds a keyframe that was just written to the sidecar index, along with the
+// label it was forced with, if any
+static void index_keyframe(struct cso_data* cso, int64_t frame,
+			   int64_t offset)
+{
+	char* label = NULL;
+
+	pthread_mutex_lock(&cso->write_mutex);
+
+	// Anything at or before this frame has either been matched now or
+	// never came out as a keyframe
+	for (size_t i = 0; i < cso->keyframe_labels.num;) {
+		struct cso_keyframe_label* entry =
+			&cso->keyframe_labels.array[i];
+
+		if (entry->segment > cso->write_segment
+		    || (entry->segment == cso->write_segment
+			&& entry->frame > frame)) {
+			i++;
+			continue;
+		}
+
+		if (entry->segment == cso->write_segment
+		    && entry->frame == frame) {
+			bfree(label);
+			label = entry->label;
+		} else {
+			bfree(entry->label);
+		}
+
+		da_erase(cso->keyframe_labels, i);
+	}
+
+	pthread_mutex_unlock(&cso->write_mutex);
+
+	if (!cso->index.file)
+		cso_index_open(&cso->index, cso->context.output_ctx->url,
+			       cso->context.time_base);
+
+	cso_index_add(&cso->index, frame, offset, label);
+	bfree(label);
+}
+
 static int process_packet(struct cso_data* cso)
 {
 	AVPacket* packet = NULL;
+	bool got_entry = false;
+	uint64_t queued_ns = 0;
 	int ret;
 
 	pthread_mutex_lock(&cso->write_mutex);
 	if (cso->packets.num) {
 		packet = cso->packets.array[0];
 		da_erase(cso->packets, 0);
+		got_entry = true;
+	}
+	if (cso->packet_times.num) {
+		queued_ns = cso->packet_times.array[0];
+		da_erase(cso->packet_times, 0);
 	}
 	pthread_mutex_unlock(&cso->write_mutex);
 
-	if (!packet) return 0;
+	if (!got_entry) return 0;
+
+	if (!packet) {
+		finish_segment(cso);
+		return 0;
+	}
+
+	// Packets are still in the encoder's time base here, which counts
+	// frames
+	int64_t frame = packet->pts;
+
+	cso_trace_end(&cso->trace, CSO_TRACE_THREAD_WRITE, "queue_wait",
+		      queued_ns, frame);
 
 	if (os_atomic_load_bool(&cso->stopping)) {
-		av_packet_free(&packet);
+		cso_packet_pool_put(&cso->packet_pool, packet);
 		return 0;
 	}
 
+	AVRational stream_time_base = cso->context.video_stream->time_base;
+	packet->pts = av_rescale_q_rnd(packet->pts, cso->context.time_base,
+				       stream_time_base,
+				       AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+	packet->dts = av_rescale_q_rnd(packet->dts, cso->context.time_base,
+				       stream_time_base,
+				       AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+	packet->duration = av_rescale_q(packet->duration,
+					cso->context.time_base,
+					stream_time_base);
+
 	cso->total_bytes += packet->size;
 
+	bool keyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+	int64_t offset = keyframe ? avio_tell(cso->context.output_ctx->pb)
+				  : 0;
+
+	uint64_t write_ns = cso_trace_begin(&cso->trace);
+
 	ret = av_write_frame(cso->context.output_ctx, packet);
 	if (ret < 0) obs_log(LOG_WARNING, "Error while writing packet: %s",
 			av_err2str(ret));
 	// Flush buffer, I want packets written immediately
 	av_write_frame(cso->context.output_ctx, NULL);
 
-	av_packet_free(&packet);
+	cso_trace_end(&cso->trace, CSO_TRACE_THREAD_WRITE, "write", write_ns,
+		      frame);
+
+	if (keyframe && ret >= 0) index_keyframe(cso, frame, offset);
+
+	cso_packet_pool_put(&cso->packet_pool, packet);
 	return ret;
 }
 
@@ -96,6 +359,8 @@ static void* write_thread(void* data)
 {
 	struct cso_data* cso = data;
 
+	cso_cpu_enter(&cso->cpu, CSO_CPU_WRITER);
+
 	while (os_sem_wait(cso->write_semaphore) == 0) {
 		if (os_event_try(cso->stop_event) == 0) break;
 
@@ -114,6 +379,7 @@ static void* write_thread(void* data)
 		}
 	}
 
+	cso_cpu_leave(&cso->cpu);
 	cso->active = false;
 	return NULL;
 }
@@ -129,28 +395,146 @@ static void cso_stop_full(struct cso_data* cso)
 	}
 }
 
-static bool make_filepath(const char* dir, struct dstr* target)
+static void ingest_frame(struct cso_data* cso, struct video_data* frame);
+
+static void* shm_thread(void* data)
+{
+	struct cso_data* cso = data;
+	struct video_data frame;
+
+	cso_cpu_enter(&cso->cpu, CSO_CPU_INGEST);
+
+	while (!os_atomic_load_bool(&cso->shm_stopping)) {
+		if (!cso_shm_acquire(&cso->shm, &frame)) {
+			os_sleep_ms(1);
+			continue;
+		}
+
+		ingest_frame(cso, &frame);
+		cso_shm_release(&cso->shm);
+	}
+
+	cso_cpu_leave(&cso->cpu);
+	return NULL;
+}
+
+// OBS never begins data capture for a direct recording, so it doesn't send
+// activate itself. It still sends stop once the output ends data capture.
+static bool start_direct_ingest(struct cso_data* cso)
 {
-	size_t len = strlen(dir);
-	if (dir[len - 1] != '/' && dir[len - 1] != '\\') return false;
+	cso->active = true;
+
+	if (pthread_create(&cso->write_thread, NULL, write_thread, cso) != 0) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
+				     "failed to create write thread");
+		cso_stop_full(cso);
+		return false;
+	}
 
-	char name_buf[1024];
-	time_t cur_time = time(NULL);
-	size_t ret = strftime(name_buf, 1024, "cordyceps %Y-%m-%d "
-					      "%H-%M-%S.mp4",
-			      localtime(&cur_time));
-	if (!ret) return false;
+	cso->write_thread_active = true;
 
-	dstr_cat(target, dir);
-	dstr_cat(target, name_buf);
+	os_atomic_set_bool(&cso->shm_stopping, false);
+	if (pthread_create(&cso->shm_thread, NULL, shm_thread, cso) != 0) {
+		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
+				     "failed to create shared memory thread");
+		cso_stop_full(cso);
+		return false;
+	}
+
+	cso->shm_thread_active = true;
+	os_atomic_set_bool(&cso->direct_ingest, true);
+
+	uint8_t stack[128];
+	struct calldata params;
+	calldata_init_fixed(&params, stack, sizeof(stack));
+	calldata_set_ptr(&params, "output", cso->output);
+	signal_handler_signal(obs_output_get_signal_handler(cso->output),
+			      "activate", &params);
+
+	obs_log(LOG_INFO, "Cordyceps-stalk output starting from shared "
+			  "memory (%ux%u at %u/%u fps)",
+		cso->shm.header->width, cso->shm.header->height,
+		cso->shm.header->fps_num, cso->shm.header->fps_den);
 
 	return true;
 }
 
+// The CPU budget caps encoder threads, whatever the threads setting says
+static void get_encoder_settings(obs_data_t* settings,
+				 struct cso_encoder_settings* out)
+{
+	cso_encoder_get_settings(settings, out);
+
+	int max_threads = cso_cpu_budget_threads(
+		(int) obs_data_get_int(settings, "cpu_budget"));
+	if (max_threads && (out->threads <= 0 || out->threads > max_threads))
+		out->threads = max_threads;
+}
+
+static void get_cpu_policies(obs_data_t* settings,
+			     struct cso_cpu_policy policies[CSO_CPU_ROLE_COUNT])
+{
+	static const char* const keys[CSO_CPU_ROLE_COUNT] = {
+		[CSO_CPU_ENCODER] = "encoder_affinity",
+		[CSO_CPU_WRITER] = "writer_affinity",
+		[CSO_CPU_INGEST] = "ingest_affinity",
+	};
+
+	int nice = (int) obs_data_get_int(settings, "thread_nice");
+
+	for (int i = 0; i < CSO_CPU_ROLE_COUNT; i++) {
+		const char* spec = obs_data_get_string(settings, keys[i]);
+
+		policies[i].nice = nice;
+		if (!cso_cpu_parse_set(spec, &policies[i].affinity)) {
+			obs_log(LOG_WARNING, "Ignoring %s \"%s\"; expected a "
+					     "CPU list like \"0-3,8\"",
+				keys[i], spec);
+			policies[i].affinity = 0;
+		}
+	}
+}
+
+// Opens context's encoder and places the threads it starts
+static bool open_encoder(struct cso_data* cso, struct ffmpeg_context* context)
+{
+	struct cso_tid_list before;
+	cso_cpu_adopt_begin(&before);
+
+	bool success = cso_encoder_open(context);
+	int expected = success ? context->video_ctx->thread_count : -1;
+
+	cso_cpu_adopt_end(&cso->cpu, &before, CSO_CPU_ENCODER,
+			  context->segment, expected);
+	return success;
+}
+
+static void get_crop(obs_data_t* settings, struct cso_crop* crop)
+{
+	crop->x = (int) obs_data_get_int(settings, "crop_x");
+	crop->y = (int) obs_data_get_int(settings, "crop_y");
+	crop->width = (int) obs_data_get_int(settings, "crop_width");
+	crop->height = (int) obs_data_get_int(settings, "crop_height");
+}
+
+// Moves the top of the crop below the frame stamp, so it isn't encoded
+static void crop_stamp(struct cso_crop* crop, int stamp_height)
+{
+	if (crop->y >= stamp_height) return;
+
+	if (crop->height > 0) {
+		crop->height -= stamp_height - crop->y;
+		if (crop->height < 1) crop->height = 1;
+	}
+
+	crop->y = stamp_height;
+}
+
 static bool init_ffmpeg(struct cso_data* cso)
 {
 	video_t* video = obs_output_video(cso->output);
 	const struct video_output_info* voi = video_output_get_info(video);
+	struct video_output_info shm_voi = {0};
 	struct ffmpeg_config config;
 	obs_data_t* settings;
 
@@ -159,64 +543,114 @@ static bool init_ffmpeg(struct cso_data* cso)
 	struct dstr path;
 	dstr_init(&path);
 
-	bool path_create_success =
-		make_filepath(obs_data_get_string(settings, "dirpath"), &path);
+	bool path_create_success = cso_make_filepath(
+		obs_data_get_string(settings, "dirpath"), 0, &path);
 
 	if (!path_create_success) {
 		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
 				     "given path was not directory");
+		dstr_free(&path);
+		obs_data_release(settings);
 		return false;
 	}
 
-	config.filepath = path.array;
-	config.gop_size = (int) obs_data_get_int(settings, "gop_size");
-
-	double crf = obs_data_get_double(settings, "crf");
-	const char* preset = obs_data_get_string(settings, "preset");
+	config.filepath = cso_arena_strdup(&cso->arena, path.array);
+	config.buffer_pool = &cso->buffer_pool;
+	dstr_free(&path);
+	get_encoder_settings(settings, &config.encoder);
+
+	struct cso_cpu_policy cpu_policies[CSO_CPU_ROLE_COUNT];
+	get_cpu_policies(settings, cpu_policies);
+	cso_cpu_reset(&cso->cpu, cpu_policies);
+
+	if (obs_data_get_bool(settings, "trace")) cso_trace_start(&cso->trace);
+	else cso_trace_free(&cso->trace);
+
+	int accumulate_frames =
+		(int) obs_data_get_int(settings, "accumulate_frames");
+	const char* shutter_weights = cso_arena_strdup(
+		&cso->arena, obs_data_get_string(settings, "shutter_weights"));
+	cso->still_format = cso_still_format_from_string(
+		obs_data_get_string(settings, "still_format"));
+	cso->still_interval =
+		(int) obs_data_get_int(settings, "still_interval");
+	bool raw_dump = obs_data_get_bool(settings, "raw_dump");
+	const char* ingest_source =
+		obs_data_get_string(settings, "ingest_source");
+	bool direct = ingest_source && strcmp(ingest_source, "shm") == 0;
+	const char* shm_name = cso_arena_strdup(
+		&cso->arena, obs_data_get_string(settings, "shm_name"));
+	struct cso_crop crop;
+	get_crop(settings, &crop);
+	const char* sinks = cso_arena_strdup(
+		&cso->arena, obs_data_get_string(settings, "sinks"));
+	int sink_buffer_mb = (int) obs_data_get_int(settings, "sink_buffer_mb");
+	bool session = obs_data_get_bool(settings, "session_mode");
+	bool stamp = obs_data_get_bool(settings, "frame_stamp");
+	int stamp_cell_size =
+		(int) obs_data_get_int(settings, "frame_stamp_cell_size");
+	bool stamp_crop = obs_data_get_bool(settings, "frame_stamp_crop");
+	int upscale = (int) obs_data_get_int(settings, "upscale");
 
 	obs_data_release(settings);
 
 	config.width = (int) obs_output_get_width(cso->output);
 	config.height = (int) obs_output_get_height(cso->output);
 
-	config.pixel_format =
-		obs_to_ffmpeg_video_format(video_output_get_format(video));
-
-	config.color_range = voi->range == VIDEO_RANGE_FULL ? AVCOL_RANGE_JPEG
-							    : AVCOL_RANGE_MPEG;
-	config.colorspace = format_is_yuv(voi->format) ? AVCOL_SPC_BT709
-						       : AVCOL_SPC_RGB;
-
-	// Copied verbatim from obs-ffmpeg-output.c
-	switch (voi->colorspace) {
-	case VIDEO_CS_601:
-		config.color_primaries = AVCOL_PRI_SMPTE170M;
-		config.color_trc = AVCOL_TRC_SMPTE170M;
-		config.colorspace = AVCOL_SPC_SMPTE170M;
-		break;
-	case VIDEO_CS_DEFAULT:
-	case VIDEO_CS_709:
-		config.color_primaries = AVCOL_PRI_BT709;
-		config.color_trc = AVCOL_TRC_BT709;
-		config.colorspace = AVCOL_SPC_BT709;
-		break;
-	case VIDEO_CS_SRGB:
-		config.color_primaries = AVCOL_PRI_BT709;
-		config.color_trc = AVCOL_TRC_IEC61966_2_1;
-		config.colorspace = AVCOL_SPC_BT709;
-		break;
-	case VIDEO_CS_2100_PQ:
-		config.color_primaries = AVCOL_PRI_BT2020;
-		config.color_trc = AVCOL_TRC_SMPTE2084;
-		config.colorspace = AVCOL_SPC_BT2020_NCL;
-		break;
-	case VIDEO_CS_2100_HLG:
-		config.color_primaries = AVCOL_PRI_BT2020;
-		config.color_trc = AVCOL_TRC_ARIB_STD_B67;
-		config.colorspace = AVCOL_SPC_BT2020_NCL;
-		break;
+	// The producer decides the format, OBS's video settings don't matter
+	if (direct) {
+		if (!shm_name || !*shm_name) shm_name = CSO_SHM_DEFAULT_NAME;
+		if (!cso_shm_open(&cso->shm, shm_name)) return false;
+
+		cso_shm_get_info(&cso->shm, &shm_voi);
+		voi = &shm_voi;
+		config.width = (int) shm_voi.width;
+		config.height = (int) shm_voi.height;
 	}
 
+	cso_encoder_config_from_video(&config, voi);
+	config.hdr_nominal_peak_level =
+		(int) obs_get_video_hdr_nominal_peak_level();
+	config.crop_x = 0;
+	config.crop_y = 0;
+	config.scale = 1;
+
+	if (config.pixel_format != AV_PIX_FMT_NONE) {
+		int full_width = config.width;
+		int full_height = config.height;
+
+		// Shared memory producers only write the frames they want, so
+		// there's nothing to gate there. Stamps are read before
+		// ingest_frame crops, so they can be cropped away.
+		if (stamp && !direct
+		    && cso_stamp_init(&cso->stamp, stamp_cell_size,
+				      config.pixel_format, full_width,
+				      full_height)) {
+			obs_log(LOG_INFO, "Cordyceps-stalk gating frames on "
+					  "their stamps");
+			if (stamp_crop)
+				crop_stamp(&crop,
+					   cso_stamp_height(&cso->stamp));
+		}
+
+		if (cso_encoder_apply_crop(&config, &crop))
+			obs_log(LOG_INFO, "Cordyceps-stalk encoding %dx%d at "
+					  "%d,%d of the %dx%d frame",
+				config.width, config.height, config.crop_x,
+				config.crop_y, full_width, full_height);
+
+		// OBS and everything before ingest stay at the canvas size,
+		// only the encoder sees the upscaled frame
+		if (cso_encoder_apply_scale(&config, upscale))
+			obs_log(LOG_INFO, "Cordyceps-stalk upscaling %dx%d by "
+					  "%d to %dx%d",
+				config.width, config.height, config.scale,
+				config.width * config.scale,
+				config.height * config.scale);
+	}
+
+	cso->context.config = config;
+
 	if (config.pixel_format == AV_PIX_FMT_NONE) {
 		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
 				     "pixel format was invalid.");
@@ -229,197 +663,103 @@ static bool init_ffmpeg(struct cso_data* cso)
 		return false;
 	}
 
-	cso->context.config = config;
-
 	// Beginning of ffmpeg init
-	const AVOutputFormat* output_format =
-		av_guess_format("mp4", NULL, NULL);
+	cso->context.config.output_format = av_guess_format("mp4", NULL, NULL);
 
-	if (!output_format) {
+	if (!cso->context.config.output_format) {
 		obs_log(LOG_ERROR, "Failed to start cordyceps stalk output; "
 				   "could not get mp4 output format");
 		return false;
 	}
 
-	avformat_alloc_output_context2(&cso->context.output_ctx, output_format,
-				       NULL, cso->context.config.filepath);
-
-	if (!cso->context.output_ctx) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to create output context");
+	if (!open_encoder(cso, &cso->context)
+	    || !cso_muxer_open(&cso->context))
 		return false;
-	}
 
-	if (cso->context.output_ctx->oformat->video_codec != AV_CODEC_ID_H264) {
-		obs_log(LOG_ERROR, "Failed to start cordyceps stalk output; "
-				   "output format video codec was not H264");
-		return false;
-	}
-
-	// Init video output stream
-	struct obs_video_info ovi;
-	if (!obs_get_video_info(&ovi)) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "no active videoo");
-		return false;
-	}
-
-	cso->context.vcodec = avcodec_find_encoder(AV_CODEC_ID_H264);
-	if (!cso->context.vcodec) {
-		obs_log(LOG_ERROR, "Failed to start cordyceps stalk output; "
-				   "failed to get H264 encoder");
-		return false;
-	}
+	cso_sinks_start(&cso->sinks, sinks, sink_buffer_mb, &cso->packet_pool,
+			&cso->cpu);
+	cso_sinks_begin_segment(&cso->sinks, &cso->context);
 
-	cso->context.video_stream = avformat_new_stream(
-		cso->context.output_ctx,
-		cso->context.vcodec);
-	if (!cso->context.video_stream) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to initialize video stream");
-		return false;
-	}
-
-	// Init codec context
-	enum AVPixelFormat closest_format = cso->context.config.pixel_format;
-	if (cso->context.vcodec->pix_fmts)
-		closest_format = avcodec_find_best_pix_fmt_of_list(
-			cso->context.vcodec->pix_fmts, closest_format, 0, NULL);
-
-	cso->context.video_ctx = avcodec_alloc_context3(cso->context.vcodec);
-	cso->context.video_ctx->bit_rate = 0;
-	cso->context.video_ctx->width = cso->context.config.width;
-	cso->context.video_ctx->height = cso->context.config.height;
-	cso->context.video_ctx->time_base = (AVRational) {(int) ovi.fps_den,
-							 (int) ovi.fps_num};
-	cso->context.video_ctx->framerate = (AVRational) {(int) ovi.fps_num,
-							 (int) ovi.fps_den};
-	cso->context.video_ctx->gop_size = cso->context.config.gop_size;
-	cso->context.video_ctx->pix_fmt = closest_format;
-	cso->context.video_ctx->color_range = cso->context.config.color_range;
-	cso->context.video_ctx->color_primaries =
-		cso->context.config.color_primaries;
-	cso->context.video_ctx->color_trc = cso->context.config.color_trc;
-	cso->context.video_ctx->colorspace = cso->context.config.colorspace;
-	cso->context.video_ctx->chroma_sample_location =
-		determine_chroma_location(closest_format,
-					  cso->context.config.colorspace);
-	cso->context.video_ctx->thread_count = 0;
-
-	cso->context.video_stream->time_base =
-		cso->context.video_ctx->time_base;
-	cso->context.video_stream->avg_frame_rate =
-		(AVRational) {(int) ovi.fps_num, (int) ovi.fps_den};
-
-	// Might be unnecessary for my case but doesn't hurt to add
-	if (cso->context.output_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-		cso->context.video_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-	// Open video codec
-	av_opt_set(cso->context.video_ctx->priv_data, "preset", preset, 0);
-	av_opt_set_double(cso->context.video_ctx->priv_data, "crf", crf, 0);
-
-	if (avcodec_open2(cso->context.video_ctx, cso->context.vcodec, NULL)
-	    < 0) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to open video codec");
-		return false;
-	}
-
-	cso->context.vframe = av_frame_alloc();
-	if (!cso->context.vframe) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to allocate video frame");
-		return false;
-	}
-
-	cso->context.vframe->format = cso->context.video_ctx->pix_fmt;
-	cso->context.vframe->width = cso->context.video_ctx->width;
-	cso->context.vframe->height = cso->context.video_ctx->height;
-	cso->context.vframe->color_range = cso->context.config.color_range;
-	cso->context.vframe->color_primaries =
-		cso->context.config.color_primaries;
-	cso->context.vframe->color_trc = cso->context.config.color_trc;
-	cso->context.vframe->colorspace = cso->context.config.colorspace;
-	cso->context.vframe->chroma_location = determine_chroma_location(
-		cso->context.video_ctx->pix_fmt,
-		cso->context.config.colorspace);
-
-	if (av_frame_get_buffer(cso->context.vframe, base_get_alignment())
-	    < 0) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to allocate video frame buffer");
-		return false;
+	// Set before any frame can arrive, so none gets in ahead of the first
+	// take
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso->session = session;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+	if (session)
+		obs_log(LOG_INFO, "Cordyceps-stalk output in session mode, "
+				  "waiting for a take");
+
+	// Accumulation reads the frames from OBS directly, so it only works
+	// when they're already in the encoder's layout and size
+	if (accumulate_frames > 1
+	    && (cso->context.ingest != CSO_INGEST_COPY || config.scale > 1)) {
+		obs_log(LOG_WARNING, "Sub-frame accumulation isn't supported "
+				     "for this video format or when "
+				     "upscaling; encoding every frame");
+	} else if (cso_accumulator_init(&cso->accumulator, accumulate_frames,
+					shutter_weights,
+					config.pixel_format, config.width,
+					config.height)
+		   && cso->accumulator.count > 1) {
+		obs_log(LOG_INFO, "Cordyceps-stalk accumulating %d sub-frames "
+				  "per frame",
+			cso->accumulator.count);
 	}
 
-	avcodec_parameters_from_context(cso->context.video_stream->codecpar,
-					cso->context.video_ctx);
-
-	// Back to creating stream
-	// Not sure what the following is for exactly but again, can't hurt to
-	// add in case it's important
-	const bool pq = cso->context.config.color_trc == AVCOL_TRC_SMPTE2084;
-	const bool hlg = cso->context.config.color_trc ==
-			 AVCOL_TRC_ARIB_STD_B67;
-
-	if (pq || hlg) {
-		const int hdr_nominal_peak_level =
-			pq ? (int)obs_get_video_hdr_nominal_peak_level()
-			   : (hlg ? 1000 : 0);
-
-		size_t content_size;
-		AVContentLightMetadata *const content =
-			av_content_light_metadata_alloc(&content_size);
-		content->MaxCLL = hdr_nominal_peak_level;
-		content->MaxFALL = hdr_nominal_peak_level;
-
-		av_packet_side_data_add(
-			&cso->context.video_stream->codecpar->coded_side_data,
-			&cso->context.video_stream->codecpar->
-			 nb_coded_side_data,
-			AV_PKT_DATA_CONTENT_LIGHT_LEVEL, (uint8_t*) content,
-			content_size, 0);
-
-		AVMasteringDisplayMetadata* const mastering =
-			av_mastering_display_metadata_alloc();
-		mastering->display_primaries[0][0] = av_make_q(17, 25);
-		mastering->display_primaries[0][1] = av_make_q(8, 25);
-		mastering->display_primaries[1][0] = av_make_q(53, 200);
-		mastering->display_primaries[1][1] = av_make_q(69, 100);
-		mastering->display_primaries[2][0] = av_make_q(3, 20);
-		mastering->display_primaries[2][1] = av_make_q(3, 50);
-		mastering->white_point[0] = av_make_q(3127, 10000);
-		mastering->white_point[1] = av_make_q(329, 1000);
-		mastering->min_luminance = av_make_q(0, 1);
-		mastering->max_luminance = av_make_q(hdr_nominal_peak_level, 1);
-		mastering->has_primaries = 1;
-		mastering->has_luminance = 1;
-
-		av_packet_side_data_add(
-			&cso->context.video_stream->codecpar->coded_side_data,
-			&cso->context.video_stream->codecpar->
-			 nb_coded_side_data,
-			AV_PKT_DATA_MASTERING_DISPLAY_METADATA,
-			(uint8_t*) mastering, sizeof(*mastering), 0);
-	}
-
-	// Open output file
-	if (avio_open2(&cso->context.output_ctx->pb,
-		       cso->context.config.filepath, AVIO_FLAG_WRITE, NULL,
-		       NULL) < 0) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to open output filepath");
-		return false;
+	// Shared memory producers are only held back by the encoder, OBS
+	// delivers one frame per tick
+	uint64_t source_interval_ns = 0;
+	if (!direct && config.fps_num > 0) {
+		int sub_frames = cso->accumulator.count > 1
+					 ? cso->accumulator.count
+					 : 1;
+		source_interval_ns = 1000000000ULL * (uint64_t) config.fps_den
+				     * (uint64_t) sub_frames
+				     / (uint64_t) config.fps_num;
 	}
 
-	if (avformat_write_header(cso->context.output_ctx, NULL) < 0) {
-		obs_log(LOG_WARNING, "Failed to start cordyceps stalk output; "
-				     "failed to write file header");
-		return false;
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso_pacing_set_source_interval(&cso->pacing, source_interval_ns);
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+	cso->frame_cost_ns = 0;
+
+	// The still threads only start once a still is taken, most
+	// recordings never ask for one
+	memset(&cso->stills, 0, sizeof(cso->stills));
+	cso->stills_unavailable = false;
+
+	// Dumps what OBS hands over, before any ingest conversion
+	if (raw_dump) {
+		struct cso_raw_info info = {
+			.format = config.pixel_format,
+			.width = config.width,
+			.height = config.height,
+			.fps_num = config.fps_num,
+			.fps_den = config.fps_den,
+			.color_range = config.color_range,
+			.color_primaries = config.color_primaries,
+			.color_trc = config.color_trc,
+			.colorspace = config.colorspace,
+		};
+
+		struct dstr raw_path;
+		dstr_init_copy(&raw_path, config.filepath);
+		dstr_cat(&raw_path, ".csraw");
+
+		if (!cso_raw_info_init(&info))
+			obs_log(LOG_WARNING, "Raw dumps aren't supported for "
+					     "this video format");
+		else
+			cso->raw_dump = cso_raw_writer_open(
+				&cso->raw, raw_path.array, &info);
+
+		dstr_free(&raw_path);
 	}
 
 	cso->context.initialized = true;
 
+	if (direct) return start_direct_ingest(cso);
+
 	if (!obs_output_can_begin_data_capture(cso->output, 0)) {
 		return false;
 	}
@@ -445,10 +785,12 @@ static void* start_thread(void* data)
 {
 	struct cso_data* cso = data;
 
-	if (!init_ffmpeg(cso)) obs_output_signal_stop(cso->output,
-				       OBS_OUTPUT_CONNECT_FAILED);
+	if (!init_ffmpeg(cso)) {
+		obs_output_signal_stop(cso->output, OBS_OUTPUT_CONNECT_FAILED);
 
-	// TODO: Possible memory leak on failure to init
+		// Frees whatever init got to before failing
+		ffmpeg_deactivate(cso);
+	}
 
 	cso->starting = false;
 	return NULL;
@@ -474,9 +816,23 @@ static void* cso_create(obs_data_t* settings, obs_output_t* output)
 
 	av_log_set_callback(ffmpeg_log);
 
+	cso_packet_pool_init(&cso->packet_pool, &cso->alloc_stats);
+	cso->buffer_pool.stats = &cso->alloc_stats;
+	cso->arena.stats = &cso->alloc_stats;
+
+	pthread_mutex_init(&cso->reconfig_mutex, NULL);
+	dstr_init(&cso->pending_dirpath);
+
 	cso->realtime_mode = false;
 	cso->requested_frames = 0;
+	dstr_init(&cso->keyframe_label);
+	dstr_init(&cso->take_name);
+	dstr_init(&cso->open_take);
 	pthread_mutex_init(&cso->frame_request_mutex, NULL);
+	cso_pacing_init(&cso->pacing);
+
+	cso_raw_writer_init(&cso->raw);
+	cso_cpu_init(&cso->cpu);
 
 	proc_handler_t* ph = obs_output_get_proc_handler(cso->output);
 
@@ -486,6 +842,53 @@ static void* cso_create(obs_data_t* settings, obs_output_t* output)
 			 proc_get_realtime_mode, cso);
 	proc_handler_add(ph, "void request_frames(in int count)",
 			 proc_request_frames, cso);
+	proc_handler_add(ph, "void get_requested_frames(out int count)",
+			 proc_get_requested_frames, cso);
+	proc_handler_add(ph,
+			 "void get_alloc_stats(out int packet_allocs, "
+			 "out int packet_reuses, out int buffer_allocs, "
+			 "out int buffer_oversize, out int arena_blocks)",
+			 proc_get_alloc_stats, cso);
+	proc_handler_add(ph, "void force_keyframe(in string label)",
+			 proc_force_keyframe, cso);
+	proc_handler_add(ph, "void capture_still()", proc_capture_still, cso);
+	proc_handler_add(ph,
+			 "void begin_take(in string name, out bool success, "
+			 "out int take)",
+			 proc_begin_take, cso);
+	proc_handler_add(ph, "void end_take(out bool success)", proc_end_take,
+			 cso);
+	proc_handler_add(ph,
+			 "void get_take(out bool session, out bool active, "
+			 "out int take)",
+			 proc_get_take, cso);
+	proc_handler_add(ph, "void get_direct_ingest(out bool active)",
+			 proc_get_direct_ingest, cso);
+	proc_handler_add(ph,
+			 "void get_pacing(out int batch, out int window, "
+			 "out float fps, out float latency_ms, "
+			 "out float encode_latency_ms, "
+			 "out int frames_in_flight)",
+			 proc_get_pacing, cso);
+	proc_handler_add(ph,
+			 "void calibrate(out bool success, out int frames, "
+			 "out float fps, out int batch, out int window, "
+			 "out int frames_in_flight)",
+			 proc_calibrate, cso);
+	proc_handler_add(ph,
+			 "void get_cpu_usage(out int encoder_ms, "
+			 "out int writer_ms, out int ingest_ms, "
+			 "out int encoder_threads, out float percent)",
+			 proc_get_cpu_usage, cso);
+	proc_handler_add(ph,
+			 "void get_frame_stamp(out bool enabled, "
+			 "out int last_id, out int stale, out int unreadable)",
+			 proc_get_frame_stamp, cso);
+
+	signal_handler_add(obs_output_get_signal_handler(output),
+			   "void pacing(ptr output, int batch, int window, "
+			   "float fps, float latency_ms, "
+			   "float encode_latency_ms, int frames_in_flight)");
 
 	return cso;
 }
@@ -503,7 +906,18 @@ static void cso_destroy(void* data)
 		os_sem_destroy(cso->write_semaphore);
 		os_event_destroy(cso->stop_event);
 
+		pthread_mutex_destroy(&cso->reconfig_mutex);
+		dstr_free(&cso->pending_dirpath);
+
 		pthread_mutex_destroy(&cso->frame_request_mutex);
+		dstr_free(&cso->keyframe_label);
+		dstr_free(&cso->take_name);
+		dstr_free(&cso->open_take);
+
+		cso_raw_writer_free(&cso->raw);
+		cso_cpu_free(&cso->cpu);
+		cso_packet_pool_free(&cso->packet_pool);
+		cso_arena_free(&cso->arena);
 
 		bfree(cso);
 	}
@@ -513,10 +927,17 @@ static bool cso_start(void* data)
 {
 	struct cso_data* cso = data;
 
-	if (cso->starting) return false;
+	// A direct recording isn't active as far as OBS is concerned, so it
+	// could try to start one on top of it
+	if (cso->starting || os_atomic_load_bool(&cso->active)) return false;
 
 	os_atomic_set_bool(&cso->stopping, false);
+	os_atomic_set_bool(&cso->reconfig_pending, false);
 	cso->total_bytes = 0;
+	memset(&cso->alloc_stats, 0, sizeof(struct cso_alloc_stats));
+	cso->write_segment = 0;
+	cso->keyframe_requested = false;
+	cso->take_count = 0;
 
 	int ret = pthread_create(&cso->start_thread, NULL, start_thread, cso);
 	return (cso->starting = (ret == 0));
@@ -536,28 +957,435 @@ static void cso_stop(void* data, uint64_t stop_ts)
 	}
 }
 
+static void queue_packet(struct cso_data* cso, AVPacket* packet)
+{
+	// Has to happen first, the write thread can unref the packet as soon
+	// as it's queued
+	if (packet) cso_sinks_push(&cso->sinks, packet);
+
+	pthread_mutex_lock(&cso->write_mutex);
+	da_push_back(cso->packets, &packet);
+	if (cso->trace.enabled) {
+		uint64_t queued_ns = os_gettime_ns();
+		da_push_back(cso->packet_times, &queued_ns);
+	}
+	pthread_mutex_unlock(&cso->write_mutex);
+	os_sem_post(cso->write_semaphore);
+}
+
+// Sends a frame to the encoder and queues every packet it has ready. Passing
+// NULL flushes the encoder.
+static int encode_frame(struct cso_data* cso, AVFrame* frame)
+{
+	int64_t frame_number = frame ? frame->pts : -1;
+
+	uint64_t stage_ns = cso_trace_begin(&cso->trace);
+	int ret = avcodec_send_frame(cso->context.video_ctx, frame);
+	cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO, "send_frame",
+		      stage_ns, frame_number);
+
+	if (ret == 0 && frame)
+		cso_encoder_frame_sent(&cso->context, frame->pts,
+				       os_gettime_ns());
+
+	while (ret == 0) {
+		AVPacket* packet = cso_packet_pool_get(&cso->packet_pool);
+
+		stage_ns = cso_trace_begin(&cso->trace);
+		ret = avcodec_receive_packet(cso->context.video_ctx, packet);
+		cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO,
+			      "receive_packet", stage_ns, frame_number);
+
+		if (ret == 0) {
+			uint64_t latency_ns = cso_encoder_packet_received(
+				&cso->context, packet, os_gettime_ns());
+			if (latency_ns) cso->frame_latency_ns = latency_ns;
+		}
+
+		if (ret == 0 && packet->size) queue_packet(cso, packet);
+		else cso_packet_pool_put(&cso->packet_pool, packet);
+	}
+
+	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ret = 0;
+
+	return ret;
+}
+
+// Finishes the current file and continues in a new one with a freshly opened
+// encoder. The new encoder and file are fully set up before the old ones are
+// touched, so frames keep flowing and a failure just keeps the old settings.
+static void switch_segment(struct cso_data* cso,
+			   const struct cso_encoder_settings* settings,
+			   const char* dirpath)
+{
+	struct ffmpeg_context next;
+	memset(&next, 0, sizeof(struct ffmpeg_context));
+
+	next.config = cso->context.config;
+	next.config.encoder = *settings;
+	next.segment = cso->context.segment + 1;
+
+	struct dstr path;
+	dstr_init(&path);
+
+	if (!cso_make_filepath(dirpath, next.segment, &path)) {
+		obs_log(LOG_WARNING, "Failed to switch cordyceps stalk output "
+				     "segment; given path was not directory");
+		dstr_free(&path);
+		return;
+	}
+
+	next.config.filepath = cso_arena_strdup(&cso->arena, path.array);
+	dstr_free(&path);
+
+	bool opened = open_encoder(cso, &next);
+
+	// The accumulator resolves straight into the encoder's frame in the
+	// layout it was set up for, so the new encoder has to take the same
+	bool layout_changed =
+		opened && cso->accumulator.count > 1
+		&& (next.ingest != CSO_INGEST_COPY
+		    || next.video_ctx->pix_fmt
+			       != cso->context.video_ctx->pix_fmt);
+	if (layout_changed)
+		obs_log(LOG_WARNING, "Can't switch to %s while accumulating "
+				     "sub-frames, it takes a different pixel "
+				     "format",
+			next.vcodec->name);
+
+	if (!opened || layout_changed || !cso_muxer_open(&next)) {
+		obs_log(LOG_WARNING, "Failed to switch cordyceps stalk output "
+				     "segment; keeping previous settings");
+		cso_cpu_retire(&cso->cpu, CSO_CPU_ENCODER, next.segment);
+		avcodec_free_context(&next.video_ctx);
+		av_frame_free(&next.vframe);
+		if (next.output_ctx) cso_muxer_close(next.output_ctx, false);
+		return;
+	}
+
+	// Whatever the old encoder still has buffered belongs to the old file
+	if (encode_frame(cso, NULL) < 0)
+		obs_log(LOG_WARNING, "Cordyceps stalk output failed to flush "
+				     "encoder at segment switch");
+
+	pthread_mutex_lock(&cso->write_mutex);
+	cso->next_output_ctx = next.output_ctx;
+	cso->next_video_stream = next.video_stream;
+	pthread_mutex_unlock(&cso->write_mutex);
+
+	queue_packet(cso, NULL);
+	cso_sinks_begin_segment(&cso->sinks, &next);
+
+	cso_cpu_retire(&cso->cpu, CSO_CPU_ENCODER, cso->context.segment);
+	avcodec_free_context(&cso->context.video_ctx);
+	av_frame_free(&cso->context.vframe);
+
+	cso->context.vcodec = next.vcodec;
+	cso->context.video_ctx = next.video_ctx;
+	cso->context.vframe = next.vframe;
+	cso->context.time_base = next.time_base;
+	cso->context.ingest = next.ingest;
+	cso->context.config = next.config;
+
+	// A take spanning the switch goes on as a chapter of the new file
+	bool take_open = !dstr_is_empty(&cso->open_take);
+	struct dstr take_title;
+	dstr_init_copy_dstr(&take_title, &cso->open_take);
+	close_take(cso);
+
+	cso->context.segment = next.segment;
+	cso->context.total_frames = 0;
+
+	if (take_open) open_take(cso, take_title.array);
+	dstr_free(&take_title);
+
+	obs_log(LOG_INFO, "Cordyceps-stalk output switched to new segment "
+			  "\"%s\"", cso->context.config.filepath);
+}
+
+// Runs on the video thread, the only thread that touches the encoder
+static void apply_pending_settings(struct cso_data* cso)
+{
+	struct cso_encoder_settings settings;
+	struct dstr dirpath;
+
+	pthread_mutex_lock(&cso->reconfig_mutex);
+
+	// Can't start another segment until the write thread has switched
+	// over to the last one
+	pthread_mutex_lock(&cso->write_mutex);
+	bool switch_in_progress = cso->next_output_ctx != NULL;
+	pthread_mutex_unlock(&cso->write_mutex);
+
+	if (switch_in_progress || !cso->reconfig_pending) {
+		pthread_mutex_unlock(&cso->reconfig_mutex);
+		return;
+	}
+
+	settings = cso->pending_encoder;
+	dstr_init_copy_dstr(&dirpath, &cso->pending_dirpath);
+	cso->reconfig_pending = false;
+
+	pthread_mutex_unlock(&cso->reconfig_mutex);
+
+	if (cso_encoder_settings_equal(&cso->context.config.encoder, &settings)) {
+		// Nothing the encoder cares about changed
+	} else if (cso_encoder_can_reconfigure_live(&cso->context, &settings)) {
+		cso_encoder_apply_rate_control(cso->context.video_ctx, &settings);
+		cso->context.config.encoder = settings;
+
+		obs_log(LOG_INFO, "Cordyceps-stalk output reconfigured "
+				  "encoder without restarting");
+	} else {
+		switch_segment(cso, &settings, dirpath.array);
+	}
+
+	dstr_free(&dirpath);
+}
+
+// Starts a chapter at the next frame to be encoded
+static void open_take(struct cso_data* cso, const char* title)
+{
+	struct cso_take take = {
+		.segment = cso->context.segment,
+		.start = cso->context.total_frames,
+		.end = -1,
+		.time_base = cso->context.time_base,
+		.title = bstrdup(title),
+	};
+
+	pthread_mutex_lock(&cso->write_mutex);
+	da_push_back(cso->takes, &take);
+	pthread_mutex_unlock(&cso->write_mutex);
+
+	dstr_copy(&cso->open_take, title);
+}
+
+// Nothing gets encoded between takes, so a take can be closed any time
+// before the next one starts and still end on the right frame
+static void close_take(struct cso_data* cso)
+{
+	if (dstr_is_empty(&cso->open_take)) return;
+
+	// The open take is always the newest, and its file isn't finished
+	// yet, so the write thread can't have taken it
+	pthread_mutex_lock(&cso->write_mutex);
+	if (cso->takes.num)
+		da_end(cso->takes)->end = cso->context.total_frames;
+	pthread_mutex_unlock(&cso->write_mutex);
+
+	dstr_free(&cso->open_take);
+}
+
+// Whether the frame belongs to a take. A new take gets its chapter and an IDR
+// frame to start on, labelled with its name in the seek index.
+static bool take_frame(struct cso_data* cso)
+{
+	struct dstr title;
+	dstr_init(&title);
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	bool active = cso->take_active;
+	bool started = cso->take_started;
+	if (started) {
+		dstr_copy_dstr(&title, &cso->take_name);
+		cso->keyframe_requested = true;
+		dstr_copy_dstr(&cso->keyframe_label, &cso->take_name);
+	}
+	cso->take_started = false;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	if (started) {
+		close_take(cso);
+		open_take(cso, title.array);
+	}
+
+	dstr_free(&title);
+
+	// A sub-frame group that a take ended in the middle of still gets
+	// finished
+	return active || cso->accumulator.accumulated > 0;
+}
+
+// Marks the frame about to be encoded as a keyframe if one was requested
+static void take_keyframe_request(struct cso_data* cso)
+{
+	char* label = NULL;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	bool requested = cso->keyframe_requested;
+	if (requested && !dstr_is_empty(&cso->keyframe_label))
+		label = bstrdup(cso->keyframe_label.array);
+	cso->keyframe_requested = false;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	cso->context.vframe->pict_type = requested ? AV_PICTURE_TYPE_I
+						   : AV_PICTURE_TYPE_NONE;
+
+	if (!label) return;
+
+	struct cso_keyframe_label entry = {
+		.segment = cso->context.segment,
+		.frame = cso->context.total_frames,
+		.label = label,
+	};
+
+	pthread_mutex_lock(&cso->write_mutex);
+	da_push_back(cso->keyframe_labels, &entry);
+	pthread_mutex_unlock(&cso->write_mutex);
+}
+
+// Hands the frame about to be encoded to the still writers if a still was
+// requested or the interval is due
+static void take_still_request(struct cso_data* cso)
+{
+	int interval = cso->still_interval;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	bool requested = cso->still_requested;
+	cso->still_requested = false;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	if (!requested && (interval <= 0
+			   || cso->context.total_frames % interval != 0))
+		return;
+
+	// Not fatal, the recording just goes without stills
+	if (!cso->stills.thread_count) {
+		if (cso->stills_unavailable) return;
+		if (!cso_still_pool_start(&cso->stills, cso->still_format)) {
+			cso->stills_unavailable = true;
+			return;
+		}
+	}
+
+	cso_still_pool_submit(&cso->stills, cso->context.vframe,
+			      cso->context.config.filepath,
+			      cso->context.total_frames);
+}
+
+static void signal_pacing(struct cso_data* cso,
+			  const struct cso_pacing* pacing)
+{
+	uint8_t stack[256];
+	struct calldata params;
+	calldata_init_fixed(&params, stack, sizeof(stack));
+	calldata_set_ptr(&params, "output", cso->output);
+	calldata_set_int(&params, "batch", pacing->batch);
+	calldata_set_int(&params, "window", pacing->window);
+	calldata_set_float(&params, "fps", cso_pacing_fps(pacing));
+	calldata_set_float(&params, "latency_ms", pacing->latency_ns / 1e6);
+	calldata_set_float(&params, "encode_latency_ms",
+			   pacing->encode_latency_ns / 1e6);
+	calldata_set_int(&params, "frames_in_flight", pacing->frames_in_flight);
+	signal_handler_signal(obs_output_get_signal_handler(cso->output),
+			      "pacing", &params);
+}
+
 static void cso_get_frame(void* data, struct video_data* frame)
 {
 	struct cso_data* cso = data;
 
+	int64_t frame_number = cso->context.total_frames;
+	uint64_t stage_ns = cso_trace_begin(&cso->trace);
+
+	// Sub-frames after the first in a group ride on the group's credit
+	bool mid_group = cso->accumulator.accumulated > 0;
+
+	// OBS hands over the last frame the game presented on every tick. A
+	// repeat of one already encoded isn't what a request was for, so it
+	// doesn't take any credit.
+	uint32_t stamp_id = 0;
+	bool stamped = false;
+	if (cso->stamp.enabled) {
+		stamped = cso_stamp_read(&cso->stamp, frame, &stamp_id);
+
+		if (stamped && cso->stamp.have_last
+		    && stamp_id == cso->stamp.last_id) {
+			os_atomic_inc_long(&cso->stamp.stale);
+			cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO,
+				      "gate_stale", stage_ns, -1);
+			return;
+		}
+
+		// Without a stamp there's no telling, so it's gated as usual
+		if (!stamped) os_atomic_inc_long(&cso->stamp.unreadable);
+	}
+
 	bool quit_early = false;
 	pthread_mutex_lock(&cso->frame_request_mutex);
 
+	// Frames between takes are neither wanted nor a sign of starving the
+	// encoder, so they don't count against pacing
+	bool between_takes = cso->session && !cso->take_active;
+
 	// total_bytes check is there so that at least one frame gets written
-	if (!cso->realtime_mode && cso->total_bytes != 0) {
+	if (between_takes && !mid_group) {
+		quit_early = true;
+	} else if (!cso->realtime_mode && cso->total_bytes != 0 && !mid_group) {
 		if (cso->requested_frames > 0) {
 			cso->requested_frames--;
 		} else {
+			cso_pacing_starved(&cso->pacing, os_gettime_ns());
 			quit_early = true;
 		}
 	}
 
 	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO,
+		      quit_early ? "gate_skip" : "gate", stage_ns,
+		      quit_early ? -1 : frame_number);
 	if (quit_early) return;
 
-	AVPacket* packet = NULL;
-	int ret;
-	int got_packet;
+	if (stamped) {
+		cso->stamp.last_id = stamp_id;
+		cso->stamp.have_last = true;
+	}
+
+	ingest_frame(cso, frame);
+}
+
+// Everything past the frame request gate. Frames from a shared-memory ring
+// come straight here; the producer only writes the frames it wants recorded.
+static void ingest_frame(struct cso_data* cso, struct video_data* frame)
+{
+	int64_t frame_number = cso->context.total_frames;
+	uint64_t cost_start_ns = os_gettime_ns();
+
+	// Everything from here on, raw dumps included, only sees the crop
+	struct video_data cropped;
+	if (cso->context.config.crop_x || cso->context.config.crop_y) {
+		cropped = *frame;
+		cso_encoder_crop_frame(&cso->context.config, &cropped);
+		frame = &cropped;
+	}
+
+	if (os_atomic_load_bool(&cso->reconfig_pending)) {
+		apply_pending_settings(cso);
+		frame_number = cso->context.total_frames;
+	}
+
+	if (cso->session && !take_frame(cso)) return;
+
+	if (cso->raw_dump) {
+		uint64_t dump_ns = cso_trace_begin(&cso->trace);
+		cso_raw_writer_frame(&cso->raw, frame);
+		cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO, "raw_dump",
+			      dump_ns, frame_number);
+	}
+
+	if (cso->accumulator.count > 1) {
+		uint64_t accumulate_ns = cso_trace_begin(&cso->trace);
+		bool complete = cso_accumulator_add(&cso->accumulator, frame);
+		cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO, "accumulate",
+			      accumulate_ns, frame_number);
+
+		if (!complete) {
+			cso->frame_cost_ns += os_gettime_ns() - cost_start_ns;
+			return;
+		}
+	}
 
 	if (av_frame_make_writable(cso->context.vframe) < 0) {
 		obs_log(LOG_WARNING, "Cordyceps stalk output failed to get "
@@ -567,67 +1395,48 @@ static void cso_get_frame(void* data, struct video_data* frame)
 		return;
 	}
 
-	// Copy frame data to AVFrame
-	int h_chroma_shift;
-	int v_chroma_shift;
-	av_pix_fmt_get_chroma_sub_sample(cso->context.video_ctx->pix_fmt,
-					 &h_chroma_shift, &v_chroma_shift);
+	// Always timed, so 8-bit and 10-bit sessions can be compared from the
+	// log without turning tracing on
+	uint64_t ingest_ns = os_gettime_ns();
 
-	for (int plane = 0; plane < MAX_AV_PLANES; plane++) {
-		if (!frame->data[plane]) continue;
+	if (cso->accumulator.count > 1)
+		cso_accumulator_resolve(&cso->accumulator, cso->context.vframe);
+	else
+		cso_encoder_ingest(&cso->context, frame);
 
-		int frame_rowsize = (int) frame->linesize[plane];
-		int pic_rowsize = cso->context.vframe->linesize[plane];
-		int bytes = frame_rowsize < pic_rowsize ? frame_rowsize
-							: pic_rowsize;
-		int plane_height = cso->context.video_ctx->height
-				   >> (plane ? v_chroma_shift : 0);
+	cso->context.ingest_total_ns += os_gettime_ns() - ingest_ns;
+	cso->context.ingested_frames++;
 
-		for (int y = 0; y < plane_height; y++) {
-			int pos_frame = y * frame_rowsize;
-			int pos_pic = y * pic_rowsize;
-
-			memcpy(cso->context.vframe->data[plane] + pos_pic,
-			       frame->data[plane] + pos_frame, bytes);
-		}
-	}
-
-	packet = av_packet_alloc();
+	cso_trace_end(&cso->trace, CSO_TRACE_THREAD_VIDEO, "ingest",
+		      cso->trace.enabled ? ingest_ns : 0, frame_number);
 
 	cso->context.vframe->pts = cso->context.total_frames;
-	ret = avcodec_send_frame(cso->context.video_ctx, cso->context.vframe);
-	if (ret == 0)
-		ret = avcodec_receive_packet(cso->context.video_ctx, packet);
-
-	got_packet = (ret == 0);
+	take_keyframe_request(cso);
+	take_still_request(cso);
 
-	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ret = 0;
-
-	if (ret < 0) {
+	if (encode_frame(cso, cso->context.vframe) < 0) {
 		obs_log(LOG_WARNING, "Cordyceps stalk output encode failure!");
-		av_packet_free(&packet);
 		// Should stop here but still don't feel like it
 		return;
 	}
 
-	if (!ret && got_packet && packet->size) {
-		packet->pts = rescale_ts(packet->pts, cso->context.video_ctx,
-					 cso->context.video_stream->time_base);
-		packet->dts = rescale_ts(packet->dts, cso->context.video_ctx,
-					 cso->context.video_stream->time_base);
-		packet->duration =
-			(int) av_rescale_q(packet->duration,
-					  cso->context.video_ctx->time_base,
-					  cso->context.video_stream->time_base);
-
-		pthread_mutex_lock(&cso->write_mutex);
-		da_push_back(cso->packets, &packet);
-		packet = NULL;
-		pthread_mutex_unlock(&cso->write_mutex);
-		os_sem_post(cso->write_semaphore);
-	}
-
 	cso->context.total_frames++;
+
+	uint64_t now_ns = os_gettime_ns();
+	cso->frame_cost_ns += now_ns - cost_start_ns;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso_pacing_frame(&cso->pacing, cso->frame_cost_ns);
+	cso_pacing_encoded(&cso->pacing, cso->frame_latency_ns,
+			   cso->context.max_in_flight);
+	bool report = cso_pacing_take_report(&cso->pacing, now_ns);
+	struct cso_pacing pacing = cso->pacing;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	cso->frame_cost_ns = 0;
+	cso->frame_latency_ns = 0;
+
+	if (report) signal_pacing(cso, &pacing);
 }
 
 static void cso_update(void* data, obs_data_t* settings)
@@ -637,12 +1446,88 @@ static void cso_update(void* data, obs_data_t* settings)
 
 	obs_data_set_string(cso_settings, "dirpath",
 			    obs_data_get_string(settings, "dirpath"));
+	obs_data_set_string(cso_settings, "codec",
+			    obs_data_get_string(settings, "codec"));
+	obs_data_set_int(cso_settings, "threads",
+			 obs_data_get_int(settings, "threads"));
 	obs_data_set_int(cso_settings, "gop_size",
 			 obs_data_get_int(settings, "gop_size"));
+	obs_data_set_string(cso_settings, "rate_control",
+			    obs_data_get_string(settings, "rate_control"));
 	obs_data_set_double(cso_settings, "crf",
 			    obs_data_get_double(settings, "crf"));
+	obs_data_set_int(cso_settings, "bitrate",
+			 obs_data_get_int(settings, "bitrate"));
+	obs_data_set_int(cso_settings, "max_bitrate",
+			 obs_data_get_int(settings, "max_bitrate"));
+	obs_data_set_int(cso_settings, "buffer_size",
+			 obs_data_get_int(settings, "buffer_size"));
 	obs_data_set_string(cso_settings, "preset",
 			    obs_data_get_string(settings, "preset"));
+	obs_data_set_bool(cso_settings, "trace",
+			  obs_data_get_bool(settings, "trace"));
+	obs_data_set_int(cso_settings, "accumulate_frames",
+			 obs_data_get_int(settings, "accumulate_frames"));
+	obs_data_set_string(cso_settings, "shutter_weights",
+			    obs_data_get_string(settings, "shutter_weights"));
+	obs_data_set_int(cso_settings, "still_interval",
+			 obs_data_get_int(settings, "still_interval"));
+	obs_data_set_string(cso_settings, "still_format",
+			    obs_data_get_string(settings, "still_format"));
+	obs_data_set_bool(cso_settings, "raw_dump",
+			  obs_data_get_bool(settings, "raw_dump"));
+	obs_data_set_string(cso_settings, "ingest_source",
+			    obs_data_get_string(settings, "ingest_source"));
+	obs_data_set_string(cso_settings, "shm_name",
+			    obs_data_get_string(settings, "shm_name"));
+	obs_data_set_int(cso_settings, "crop_x",
+			 obs_data_get_int(settings, "crop_x"));
+	obs_data_set_int(cso_settings, "crop_y",
+			 obs_data_get_int(settings, "crop_y"));
+	obs_data_set_int(cso_settings, "crop_width",
+			 obs_data_get_int(settings, "crop_width"));
+	obs_data_set_int(cso_settings, "crop_height",
+			 obs_data_get_int(settings, "crop_height"));
+	obs_data_set_string(cso_settings, "sinks",
+			    obs_data_get_string(settings, "sinks"));
+	obs_data_set_int(cso_settings, "sink_buffer_mb",
+			 obs_data_get_int(settings, "sink_buffer_mb"));
+	obs_data_set_bool(cso_settings, "session_mode",
+			  obs_data_get_bool(settings, "session_mode"));
+	obs_data_set_bool(cso_settings, "low_latency",
+			  obs_data_get_bool(settings, "low_latency"));
+	obs_data_set_string(cso_settings, "encoder_affinity",
+			    obs_data_get_string(settings, "encoder_affinity"));
+	obs_data_set_string(cso_settings, "writer_affinity",
+			    obs_data_get_string(settings, "writer_affinity"));
+	obs_data_set_string(cso_settings, "ingest_affinity",
+			    obs_data_get_string(settings, "ingest_affinity"));
+	obs_data_set_int(cso_settings, "thread_nice",
+			 obs_data_get_int(settings, "thread_nice"));
+	obs_data_set_int(cso_settings, "cpu_budget",
+			 obs_data_get_int(settings, "cpu_budget"));
+	obs_data_set_string(cso_settings, "shared_encoder",
+			    obs_data_get_string(settings, "shared_encoder"));
+	obs_data_set_bool(cso_settings, "frame_stamp",
+			  obs_data_get_bool(settings, "frame_stamp"));
+	obs_data_set_int(cso_settings, "frame_stamp_cell_size",
+			 obs_data_get_int(settings, "frame_stamp_cell_size"));
+	obs_data_set_bool(cso_settings, "frame_stamp_crop",
+			  obs_data_get_bool(settings, "frame_stamp_crop"));
+	obs_data_set_int(cso_settings, "upscale",
+			 obs_data_get_int(settings, "upscale"));
+
+	// Picked up by the video thread before the next frame it encodes
+	if (os_atomic_load_bool(&cso->active)) {
+		pthread_mutex_lock(&cso->reconfig_mutex);
+		get_encoder_settings(cso_settings, &cso->pending_encoder);
+		dstr_copy(&cso->pending_dirpath,
+			  obs_data_get_string(cso_settings, "dirpath"));
+		cso->reconfig_pending = true;
+		pthread_mutex_unlock(&cso->reconfig_mutex);
+	}
+
+	obs_data_release(cso_settings);
 }
 
 static uint64_t cso_get_total_bytes(void* data)
@@ -683,7 +1568,225 @@ static void proc_request_frames(void* data, calldata_t* cd)
 
 	pthread_mutex_lock(&cso->frame_request_mutex);
 	cso->requested_frames += count;
+	if (count) cso_pacing_request(&cso->pacing, os_gettime_ns());
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	// Does nothing unless a dump is being written
+	cso_raw_writer_request(&cso->raw, count);
+}
+
+// Frames requested but not taken by the video thread yet
+static void proc_get_requested_frames(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	int64_t count = cso->requested_frames;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	calldata_set_int(cd, "count", count);
+}
+
+static void proc_get_alloc_stats(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+	struct cso_alloc_stats* stats = &cso->alloc_stats;
+
+	calldata_set_int(cd, "packet_allocs",
+			 os_atomic_load_long(&stats->packet_allocs));
+	calldata_set_int(cd, "packet_reuses",
+			 os_atomic_load_long(&stats->packet_reuses));
+	calldata_set_int(cd, "buffer_allocs",
+			 os_atomic_load_long(&stats->buffer_allocs));
+	calldata_set_int(cd, "buffer_oversize",
+			 os_atomic_load_long(&stats->buffer_oversize));
+	calldata_set_int(cd, "arena_blocks",
+			 os_atomic_load_long(&stats->arena_blocks));
+}
+
+static void proc_force_keyframe(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	const char* label = calldata_string(cd, "label");
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso->keyframe_requested = true;
+	dstr_copy(&cso->keyframe_label, label ? label : "");
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+}
+
+static void proc_begin_take(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	const char* name = calldata_string(cd, "name");
+	bool success = false;
+	int take = 0;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	if (cso->session && os_atomic_load_bool(&cso->active)) {
+		take = ++cso->take_count;
+		if (name && *name) dstr_copy(&cso->take_name, name);
+		else dstr_printf(&cso->take_name, "Take %d", take);
+
+		// Starting a take during another one just moves the boundary
+		cso->take_active = true;
+		cso->take_started = true;
+		success = true;
+	}
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	calldata_set_bool(cd, "success", success);
+	calldata_set_int(cd, "take", take);
+}
+
+static void proc_end_take(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	bool success = cso->session && cso->take_active;
+	cso->take_active = false;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	calldata_set_bool(cd, "success", success);
+}
+
+static void proc_get_take(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	calldata_set_bool(cd, "session", cso->session);
+	calldata_set_bool(cd, "active", cso->take_active);
+	calldata_set_int(cd, "take", cso->take_count);
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+}
+
+static void proc_capture_still(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(cd);
+
+	struct cso_data* cso = data;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso->still_requested = true;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+}
+
+static void proc_get_direct_ingest(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	calldata_set_bool(cd, "active",
+			  os_atomic_load_bool(&cso->direct_ingest));
+}
+
+static void proc_get_pacing(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	struct cso_pacing pacing = cso->pacing;
+	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	calldata_set_int(cd, "batch", pacing.batch);
+	calldata_set_int(cd, "window", pacing.window);
+	calldata_set_float(cd, "fps", cso_pacing_fps(&pacing));
+	calldata_set_float(cd, "latency_ms", pacing.latency_ns / 1e6);
+	calldata_set_float(cd, "encode_latency_ms",
+			   pacing.encode_latency_ns / 1e6);
+	calldata_set_int(cd, "frames_in_flight", pacing.frames_in_flight);
+}
+
+// Runs on the caller's thread and takes a few seconds at most. Refused while
+// recording, it would compete with the real encoder and measure neither.
+static void proc_calibrate(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+	struct ffmpeg_config config = {0};
+	struct cso_calibration result;
+
+	calldata_set_bool(cd, "success", false);
+
+	if (cso->starting || os_atomic_load_bool(&cso->active)) {
+		obs_log(LOG_WARNING, "Cordyceps-stalk can't calibrate while "
+				     "recording");
+		return;
+	}
+
+	video_t* video = obs_output_video(cso->output);
+	const struct video_output_info* voi = video_output_get_info(video);
+	if (!voi) return;
+
+	struct cso_crop crop;
+	obs_data_t* settings = obs_output_get_settings(cso->output);
+	get_encoder_settings(settings, &config.encoder);
+	get_crop(settings, &crop);
+	int upscale = (int) obs_data_get_int(settings, "upscale");
+	obs_data_release(settings);
+
+	config.width = (int) obs_output_get_width(cso->output);
+	config.height = (int) obs_output_get_height(cso->output);
+	cso_encoder_config_from_video(&config, voi);
+
+	if (config.pixel_format == AV_PIX_FMT_NONE) return;
+
+	cso_encoder_apply_crop(&config, &crop);
+	cso_encoder_apply_scale(&config, upscale);
+
+	if (!cso_calibrate(&config, CSO_CALIBRATE_FRAMES, &result)
+	    || result.fps <= 0.0)
+		return;
+
+	pthread_mutex_lock(&cso->frame_request_mutex);
+	cso_pacing_seed(&cso->pacing, 1000000000.0 / result.fps);
+	cso_pacing_encoded(&cso->pacing, 0, result.frames_in_flight);
+	struct cso_pacing pacing = cso->pacing;
 	pthread_mutex_unlock(&cso->frame_request_mutex);
+
+	calldata_set_bool(cd, "success", true);
+	calldata_set_int(cd, "frames", result.frames);
+	calldata_set_float(cd, "fps", result.fps);
+	calldata_set_int(cd, "batch", pacing.batch);
+	calldata_set_int(cd, "window", pacing.window);
+	calldata_set_int(cd, "frames_in_flight", result.frames_in_flight);
+}
+
+// CPU time of the current (or last) recording's threads, including encoder
+// threads that have already exited
+static void proc_get_cpu_usage(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	struct cso_cpu_usage usage;
+	cso_cpu_get_usage(&cso->cpu, &usage);
+
+	const uint64_t* ns = usage.role_ns;
+	calldata_set_int(cd, "encoder_ms",
+			 (long long) (ns[CSO_CPU_ENCODER] / 1000000));
+	calldata_set_int(cd, "writer_ms",
+			 (long long) (ns[CSO_CPU_WRITER] / 1000000));
+	calldata_set_int(cd, "ingest_ms",
+			 (long long) (ns[CSO_CPU_INGEST] / 1000000));
+	calldata_set_int(cd, "encoder_threads", usage.encoder_threads);
+	calldata_set_float(cd, "percent", usage.percent);
+}
+
+// Whether frames are gated on stamps, the last stamp encoded, and how many
+// frames were skipped as repeats or had no readable stamp
+static void proc_get_frame_stamp(void* data, calldata_t* cd)
+{
+	struct cso_data* cso = data;
+
+	long long last_id = -1;
+	if (cso->stamp.have_last) last_id = cso->stamp.last_id;
+
+	calldata_set_bool(cd, "enabled", cso->stamp.enabled);
+	calldata_set_int(cd, "last_id", last_id);
+	calldata_set_int(cd, "stale", cso->stamp.stale);
+	calldata_set_int(cd, "unreadable", cso->stamp.unreadable);
 }
 
 struct obs_output_info cordyceps_stalk_output = {
@@ -7,38 +7,40 @@
 #include <libavformat/avformat.h>
 #include <libavformat/avio.h>
 #include <libavcodec/avcodec.h>
-#include <libavutil/opt.h>
-#include <libavutil/mastering_display_metadata.h>
+#include <libavutil/mem.h>
 #include <util/threading.h>
 #include <util/dstr.h>
 
-#include "include/obs-ffmpeg-formats.h"
-
-struct ffmpeg_config {
-	const char* filepath;
-	int gop_size; // Also known as keyframe interval
-	int width;
-	int height;
-
-	enum AVPixelFormat pixel_format;
-	enum AVColorRange color_range;
-	enum AVColorPrimaries color_primaries;
-	enum AVColorTransferCharacteristic color_trc;
-	enum AVColorSpace colorspace;
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-trace.h"
+#include "cordyceps-stalk-kernels.h"
+#include "cordyceps-stalk-pool.h"
+#include "cordyceps-stalk-index.h"
+#include "cordyceps-stalk-accumulate.h"
+#include "cordyceps-stalk-still.h"
+#include "cordyceps-stalk-raw.h"
+#include "cordyceps-stalk-shm.h"
+#include "cordyceps-stalk-pacing.h"
+#include "cordyceps-stalk-sink.h"
+#include "cordyceps-stalk-cpu.h"
+#include "cordyceps-stalk-stamp.h"
+
+// Label for a keyframe forced through force_keyframe, waiting for the write
+// thread to see its packet
+struct cso_keyframe_label {
+	int segment;
+	int64_t frame;
+	char* label;
 };
 
-struct ffmpeg_context {
-	AVStream* video_stream;
-	AVCodecContext* video_ctx;
-	const AVCodec* vcodec;
-	AVFormatContext* output_ctx;
-
-	AVFrame* vframe;
-	int64_t total_frames;
-
-	struct ffmpeg_config config;
-
-	bool initialized;
+// A take in session mode, written into its file as a chapter when the file is
+// finished. Frames count from the start of the segment.
+struct cso_take {
+	int segment;
+	int64_t start;
+	int64_t end; // -1 while the take is still running
+	AVRational time_base;
+	char* title;
 };
 
 struct cso_data {
@@ -60,13 +62,103 @@ struct cso_data {
 	os_event_t* stop_event;
 	pthread_t write_thread;
 
+	// A NULL entry marks the end of a segment; the write thread finishes
+	// the current file there and switches over to next_output_ctx
 	DARRAY(AVPacket*) packets;
+	AVFormatContext* next_output_ctx;
+	AVStream* next_video_stream;
+
+	// Pushed by the video thread and consumed by the write thread, both
+	// under write_mutex. Everything else below is write thread only.
+	DARRAY(struct cso_keyframe_label) keyframe_labels;
+	DARRAY(struct cso_take) takes;
+	int write_segment;
+	struct cso_index index;
+	DARRAY(uint64_t) packet_times; // Only filled while tracing
+
+	// Get their packets from the video thread, so the write thread being
+	// slow doesn't hold them back either
+	struct cso_sinks sinks;
+
+	struct cso_trace trace;
+
+	// Video thread only. Outlives segment switches, so a group can span
+	// two files.
+	struct cso_accumulator accumulator;
+
+	// Set up before the first frame, then only touched by the video
+	// thread apart from its counters
+	struct cso_stamp stamp;
+
+	// The video thread starts the pool with the first still it takes
+	struct cso_still_pool stills;
+	enum cso_still_format still_format;
+	bool stills_unavailable; // The pool failed to start, don't retry
+	int still_interval; // 0 for stills only on request
+
+	// raw_dump is only read by the video thread; the writer takes frame
+	// requests from any thread
+	bool raw_dump;
+	struct cso_raw_writer raw;
+
+	// Set while frames come from a shared-memory ring instead of OBS. The
+	// shm thread then stands in for OBS's video thread.
+	volatile bool direct_ingest;
+	struct cso_shm_ring shm;
+	bool shm_thread_active;
+	volatile bool shm_stopping;
+	pthread_t shm_thread;
+
+	struct cso_cpu cpu;
+
+	struct cso_alloc_stats alloc_stats;
+	struct cso_packet_pool packet_pool;
+	struct cso_buffer_pool buffer_pool;
+	struct cso_arena arena; // Reset when a recording ends
+
+	pthread_mutex_t reconfig_mutex;
+	volatile bool reconfig_pending;
+	struct cso_encoder_settings pending_encoder;
+	struct dstr pending_dirpath;
 
 	volatile bool realtime_mode;
 	volatile int64_t requested_frames;
+	bool keyframe_requested;
+	struct dstr keyframe_label;
+	bool still_requested;
+	struct cso_pacing pacing;
 	pthread_mutex_t frame_request_mutex;
+
+	// Session mode keeps one recording going across many takes and only
+	// accepts frames during a take. session is fixed for the recording,
+	// the rest is under frame_request_mutex.
+	bool session;
+	bool take_active;
+	bool take_started; // Until the video thread opens the take's chapter
+	int take_count;
+	struct dstr take_name;
+
+	// Video thread only, the title of the chapter currently open
+	struct dstr open_take;
+
+	// Ingest and encode time of the frame being built, and how long the
+	// packet that came out last spent in the encoder. Video thread only.
+	uint64_t frame_cost_ns;
+	uint64_t frame_latency_ns;
 };
 
 static void proc_set_realtime_mode(void* data, calldata_t* cd);
 static void proc_request_frames(void* data, calldata_t* cd);
-static void proc_get_realtime_mode(void* data, calldata_t* cd);
\ No newline at end of file
+static void proc_get_realtime_mode(void* data, calldata_t* cd);
+static void proc_get_requested_frames(void* data, calldata_t* cd);
+static void proc_get_alloc_stats(void* data, calldata_t* cd);
+static void proc_force_keyframe(void* data, calldata_t* cd);
+static void proc_capture_still(void* data, calldata_t* cd);
+static void proc_begin_take(void* data, calldata_t* cd);
+static void proc_end_take(void* data, calldata_t* cd);
+static void proc_get_take(void* data, calldata_t* cd);
+static void proc_get_direct_ingest(void* data, calldata_t* cd);
+static void proc_get_pacing(void* data, calldata_t* cd);
+static void proc_calibrate(void* data, calldata_t* cd);
+static void proc_get_cpu_usage(void* data, calldata_t* cd);
+static void proc_get_frame_stamp(void* data, calldata_t* cd);
\ No newline at end of file
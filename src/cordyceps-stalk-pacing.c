@@ -0,0 +1,261 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-pacing.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <libavutil/pixdesc.h>
+#include <math.h>
+
+#define PACING_SMOOTHING 0.1
+
+static void update(struct cso_pacing* pacing)
+{
+	if (pacing->frame_ns <= 0.0) {
+		pacing->batch = 1;
+		pacing->window = 2;
+		return;
+	}
+
+	double interval_ns = pacing->frame_ns;
+	if (interval_ns < (double) pacing->source_interval_ns)
+		interval_ns = (double) pacing->source_interval_ns;
+
+	double latency_ns = pacing->latency_ns > 0.0
+				    ? pacing->latency_ns
+				    : (double) CSO_PACING_DEFAULT_LATENCY_NS;
+
+	// Frames the encoder gets through during one round trip
+	double in_flight = latency_ns / interval_ns;
+	double window = ceil(in_flight * 2.0) + 1.0;
+
+	if (window > CSO_PACING_MAX_WINDOW) window = CSO_PACING_MAX_WINDOW;
+	if (window < 2.0) window = 2.0;
+
+	pacing->window = (int) window;
+	pacing->batch = pacing->window / 2;
+}
+
+static double smooth(double average, double sample)
+{
+	if (average <= 0.0) return sample;
+
+	return average + (sample - average) * PACING_SMOOTHING;
+}
+
+void cso_pacing_init(struct cso_pacing* pacing)
+{
+	memset(pacing, 0, sizeof(struct cso_pacing));
+	update(pacing);
+}
+
+void cso_pacing_frame(struct cso_pacing* pacing, uint64_t cost_ns)
+{
+	pacing->frame_ns = smooth(pacing->frame_ns, (double) cost_ns);
+	update(pacing);
+}
+
+void cso_pacing_seed(struct cso_pacing* pacing, double frame_ns)
+{
+	pacing->frame_ns = frame_ns;
+	update(pacing);
+}
+
+void cso_pacing_starved(struct cso_pacing* pacing, uint64_t now_ns)
+{
+	if (!pacing->starved_ns) pacing->starved_ns = now_ns;
+}
+
+void cso_pacing_request(struct cso_pacing* pacing, uint64_t now_ns)
+{
+	if (!pacing->starved_ns) return;
+
+	uint64_t latency_ns = now_ns - pacing->starved_ns;
+	pacing->starved_ns = 0;
+
+	if (latency_ns > CSO_PACING_MAX_LATENCY_NS) return;
+
+	pacing->latency_ns = smooth(pacing->latency_ns, (double) latency_ns);
+	update(pacing);
+}
+
+void cso_pacing_encoded(struct cso_pacing* pacing, uint64_t latency_ns,
+			int frames_in_flight)
+{
+	if (latency_ns)
+		pacing->encode_latency_ns =
+			smooth(pacing->encode_latency_ns, (double) latency_ns);
+
+	pacing->frames_in_flight = frames_in_flight;
+}
+
+void cso_pacing_set_source_interval(struct cso_pacing* pacing,
+				    uint64_t interval_ns)
+{
+	pacing->source_interval_ns = interval_ns;
+	pacing->starved_ns = 0;
+	update(pacing);
+}
+
+double cso_pacing_fps(const struct cso_pacing* pacing)
+{
+	return pacing->frame_ns > 0.0 ? 1000000000.0 / pacing->frame_ns : 0.0;
+}
+
+bool cso_pacing_take_report(struct cso_pacing* pacing, uint64_t now_ns)
+{
+	if (pacing->batch == pacing->reported_batch
+	    && pacing->window == pacing->reported_window)
+		return false;
+
+	if (pacing->reported_ns
+	    && now_ns - pacing->reported_ns < CSO_PACING_REPORT_INTERVAL_NS)
+		return false;
+
+	pacing->reported_batch = pacing->batch;
+	pacing->reported_window = pacing->window;
+	pacing->reported_ns = now_ns;
+
+	return true;
+}
+
+// Gradient that moves every frame plus noise, so the encoder can't get away
+// with skipping most of the picture
+static void fill_pattern(AVFrame* frame, int index, uint32_t* seed)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+	int depth = desc->comp[0].depth;
+	int max = (1 << depth) - 1;
+
+	for (int plane = 0; plane < AV_NUM_DATA_POINTERS && frame->data[plane];
+	     plane++) {
+		bool chroma = plane == 1 || plane == 2;
+		int width = AV_CEIL_RSHIFT(frame->width,
+					   chroma ? desc->log2_chroma_w : 0);
+		int height = AV_CEIL_RSHIFT(frame->height,
+					    chroma ? desc->log2_chroma_h : 0);
+
+		// Packed formats carry every component in plane 0
+		if (!chroma && !(desc->flags & AV_PIX_FMT_FLAG_PLANAR))
+			width *= desc->nb_components;
+
+		for (int y = 0; y < height; y++) {
+			uint8_t* row = frame->data[plane]
+				       + (size_t) y * frame->linesize[plane];
+
+			for (int x = 0; x < width; x++) {
+				*seed = *seed * 1664525u + 1013904223u;
+				int value = ((x + y + index * 4) & max)
+					    ^ (int) ((*seed >> 24) & 15);
+
+				if (depth > 8)
+					((uint16_t*) row)[x] =
+						(uint16_t) (value & max);
+				else
+					row[x] = (uint8_t) value;
+			}
+		}
+	}
+}
+
+static int drain_packets(struct ffmpeg_context* context, AVFrame* frame,
+			 AVPacket* packet)
+{
+	int ret = avcodec_send_frame(context->video_ctx, frame);
+	if (ret == 0 && frame)
+		cso_encoder_frame_sent(context, frame->pts, os_gettime_ns());
+
+	while (ret == 0) {
+		ret = avcodec_receive_packet(context->video_ctx, packet);
+		if (ret == 0) {
+			cso_encoder_packet_received(context, packet,
+						    os_gettime_ns());
+			av_packet_unref(packet);
+		}
+	}
+
+	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ret = 0;
+
+	return ret;
+}
+
+bool cso_calibrate(const struct ffmpeg_config* config, int frames,
+		   struct cso_calibration* out)
+{
+	struct ffmpeg_context context = {0};
+	AVPacket* packet = av_packet_alloc();
+	uint32_t seed = 1;
+	bool success = false;
+
+	memset(out, 0, sizeof(struct cso_calibration));
+
+	context.config = *config;
+	context.config.buffer_pool = NULL;
+	if (!context.config.output_format)
+		context.config.output_format =
+			av_guess_format("mp4", NULL, NULL);
+
+	if (!packet || !cso_encoder_open(&context)) goto cleanup;
+
+	uint64_t start_ns = os_gettime_ns();
+	int encoded = 0;
+
+	// Pattern generation isn't part of the encoder's cost, so it happens
+	// outside the timed part
+	uint64_t pattern_ns = 0;
+
+	while (encoded < frames
+	       && os_gettime_ns() - start_ns < CSO_CALIBRATE_MAX_NS) {
+		if (av_frame_make_writable(context.vframe) < 0) goto cleanup;
+
+		uint64_t fill_ns = os_gettime_ns();
+		fill_pattern(context.vframe, encoded, &seed);
+		pattern_ns += os_gettime_ns() - fill_ns;
+
+		context.vframe->pts = encoded++;
+		if (drain_packets(&context, context.vframe, packet) < 0)
+			goto cleanup;
+	}
+
+	// Frames still in the lookahead count towards the time too
+	if (drain_packets(&context, NULL, packet) < 0) goto cleanup;
+
+	uint64_t elapsed_ns = os_gettime_ns() - start_ns - pattern_ns;
+
+	out->frames = encoded;
+	out->seconds = (double) elapsed_ns / 1000000000.0;
+	out->fps = out->seconds > 0.0 ? (double) encoded / out->seconds : 0.0;
+	// Latency is meaningless here, frames are queued as fast as they go
+	// in, but how many the encoder holds onto isn't
+	out->frames_in_flight = context.max_in_flight;
+
+	obs_log(LOG_INFO, "Cordyceps-stalk calibration: %d frames of %dx%d "
+			  "in %.2f s (%.1f fps, preset %s, %d frames in "
+			  "flight)",
+		out->frames, config->width, config->height, out->seconds,
+		out->fps, config->encoder.preset, out->frames_in_flight);
+
+	success = encoded > 0;
+
+cleanup:
+	avcodec_free_context(&context.video_ctx);
+	av_frame_free(&context.vframe);
+	av_packet_free(&packet);
+
+	return success;
+}
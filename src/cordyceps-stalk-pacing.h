@@ -0,0 +1,93 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Sizing for the mod's request_frames loop. The mod should keep up to
+// `window` frames requested but not yet encoded, and ask for `batch` more
+// whenever the outstanding count drops to window - batch or below. The window
+// covers two request round trips at the measured encode rate, so the encoder
+// never waits on the mod, without queueing up much more than that.
+//
+// Encode cost comes from recordings, or from cso_calibrate() before the first
+// one. Round trip time is measured from the first frame the gate turns away
+// for lack of credit to the next request_frames call.
+//
+// Encode latency is how long a frame spends inside the encoder before its
+// packet comes out, and frames in flight is how many frames the encoder holds
+// to produce one (1 for no delay at all). Neither changes the window; they're
+// there so a loop that waits on its frames can be tuned with low_latency.
+
+#pragma once
+
+#include <obs-module.h>
+
+#include "cordyceps-stalk-encoder.h"
+
+#define CSO_PACING_MAX_WINDOW 600
+#define CSO_PACING_DEFAULT_LATENCY_NS 20000000ULL
+// Longer waits are the mod being paused, not its round trip
+#define CSO_PACING_MAX_LATENCY_NS 1000000000ULL
+#define CSO_PACING_REPORT_INTERVAL_NS 1000000000ULL
+
+#define CSO_CALIBRATE_FRAMES 120
+#define CSO_CALIBRATE_MAX_NS 5000000000ULL
+
+// Not thread safe; the output updates it under frame_request_mutex
+struct cso_pacing {
+	double frame_ns;   // Moving average, 0 until measured
+	double latency_ns; // Moving average, 0 until measured
+	double encode_latency_ns; // Moving average, 0 until measured
+	int frames_in_flight;
+	uint64_t source_interval_ns; // Frames can't come faster than this
+	uint64_t starved_ns;         // When the gate first ran out of credit
+
+	int batch;
+	int window;
+
+	int reported_batch;
+	int reported_window;
+	uint64_t reported_ns;
+};
+
+struct cso_calibration {
+	int frames;
+	double seconds;
+	double fps;
+	int frames_in_flight;
+};
+
+void cso_pacing_init(struct cso_pacing* pacing);
+void cso_pacing_frame(struct cso_pacing* pacing, uint64_t cost_ns);
+// Sets the encode cost outright, for calibration results
+void cso_pacing_seed(struct cso_pacing* pacing, double frame_ns);
+void cso_pacing_starved(struct cso_pacing* pacing, uint64_t now_ns);
+void cso_pacing_request(struct cso_pacing* pacing, uint64_t now_ns);
+// latency_ns of 0 only updates the frames in flight
+void cso_pacing_encoded(struct cso_pacing* pacing, uint64_t latency_ns,
+			int frames_in_flight);
+void cso_pacing_set_source_interval(struct cso_pacing* pacing,
+				    uint64_t interval_ns);
+double cso_pacing_fps(const struct cso_pacing* pacing);
+// True if the recommendation changed since it was last reported and the last
+// report was long enough ago. Marks it reported.
+bool cso_pacing_take_report(struct cso_pacing* pacing, uint64_t now_ns);
+
+// Encodes a moving test pattern with config's encoder settings and size,
+// throwing the packets away. Stops after `frames` frames or
+// CSO_CALIBRATE_MAX_NS, whichever comes first.
+bool cso_calibrate(const struct ffmpeg_config* config, int frames,
+		   struct cso_calibration* out);
@@ -0,0 +1,202 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-pool.h"
+
+#define CSO_ARENA_BLOCK_SIZE 4096
+#define CSO_ARENA_ALIGN 16
+#define CSO_ARENA_HEADER_SIZE                                              \
+	((sizeof(struct cso_arena_block) + CSO_ARENA_ALIGN - 1)            \
+	 & ~(size_t) (CSO_ARENA_ALIGN - 1))
+
+void cso_packet_pool_init(struct cso_packet_pool* pool,
+			  struct cso_alloc_stats* stats)
+{
+	pthread_mutex_init(&pool->mutex, NULL);
+	da_init(pool->packets);
+	pool->stats = stats;
+}
+
+void cso_packet_pool_free(struct cso_packet_pool* pool)
+{
+	for (size_t i = 0; i < pool->packets.num; i++)
+		av_packet_free(pool->packets.array + i);
+	da_free(pool->packets);
+
+	pthread_mutex_destroy(&pool->mutex);
+}
+
+AVPacket* cso_packet_pool_get(struct cso_packet_pool* pool)
+{
+	AVPacket* packet = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->packets.num) {
+		packet = pool->packets.array[pool->packets.num - 1];
+		da_pop_back(pool->packets);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (packet) {
+		os_atomic_inc_long(&pool->stats->packet_reuses);
+	} else {
+		packet = av_packet_alloc();
+		os_atomic_inc_long(&pool->stats->packet_allocs);
+	}
+
+	return packet;
+}
+
+void cso_packet_pool_put(struct cso_packet_pool* pool, AVPacket* packet)
+{
+	if (!packet) return;
+
+	// Drops the data reference, which sends pooled data buffers back to
+	// their own pool
+	av_packet_unref(packet);
+
+	pthread_mutex_lock(&pool->mutex);
+	da_push_back(pool->packets, &packet);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static AVBufferRef* buffer_pool_alloc(void* opaque, size_t size)
+{
+	struct cso_buffer_pool* pool = opaque;
+
+	os_atomic_inc_long(&pool->stats->buffer_allocs);
+	return av_buffer_alloc(size);
+}
+
+static int get_encode_buffer(AVCodecContext* video_ctx, AVPacket* packet,
+			     int flags)
+{
+	struct cso_buffer_pool* pool = video_ctx->opaque;
+
+	size_t size = (size_t) packet->size + AV_INPUT_BUFFER_PADDING_SIZE;
+	size_t class_size = CSO_BUFFER_CLASS_MIN_SIZE;
+	int class_index = 0;
+
+	while (class_size < size && class_index < CSO_BUFFER_CLASS_COUNT) {
+		class_size <<= 1;
+		class_index++;
+	}
+
+	if (class_index == CSO_BUFFER_CLASS_COUNT) {
+		os_atomic_inc_long(&pool->stats->buffer_oversize);
+		return avcodec_default_get_encode_buffer(video_ctx, packet,
+							 flags);
+	}
+
+	// Only the encoding thread gets here, so creating classes lazily
+	// doesn't race
+	if (!pool->classes[class_index])
+		pool->classes[class_index] = av_buffer_pool_init2(
+			class_size, pool, buffer_pool_alloc, NULL);
+
+	packet->buf = av_buffer_pool_get(pool->classes[class_index]);
+	if (!packet->buf) return AVERROR(ENOMEM);
+
+	packet->data = packet->buf->data;
+	memset(packet->data + packet->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	return 0;
+}
+
+void cso_buffer_pool_attach(struct cso_buffer_pool* pool,
+			    AVCodecContext* video_ctx)
+{
+	// Only used by encoders with AV_CODEC_CAP_DR1, which libx264 and
+	// libx265 both have
+	video_ctx->opaque = pool;
+	video_ctx->get_encode_buffer = get_encode_buffer;
+}
+
+void cso_buffer_pool_free(struct cso_buffer_pool* pool)
+{
+	// Buffers still held by packets keep their pool alive until they're
+	// released
+	for (int i = 0; i < CSO_BUFFER_CLASS_COUNT; i++)
+		av_buffer_pool_uninit(&pool->classes[i]);
+}
+
+void* cso_arena_alloc(struct cso_arena* arena, size_t size)
+{
+	size = (size + CSO_ARENA_ALIGN - 1) & ~(size_t) (CSO_ARENA_ALIGN - 1);
+
+	struct cso_arena_block* block = arena->blocks;
+
+	if (!block || block->size - block->used < size) {
+		size_t block_size = size > CSO_ARENA_BLOCK_SIZE
+					    ? size
+					    : CSO_ARENA_BLOCK_SIZE;
+
+		block = bmalloc(CSO_ARENA_HEADER_SIZE + block_size);
+		block->next = arena->blocks;
+		block->size = block_size;
+		block->used = 0;
+		arena->blocks = block;
+
+		os_atomic_inc_long(&arena->stats->arena_blocks);
+	}
+
+	void* ptr = (uint8_t*) block + CSO_ARENA_HEADER_SIZE + block->used;
+	block->used += size;
+
+	return ptr;
+}
+
+char* cso_arena_strdup(struct cso_arena* arena, const char* str)
+{
+	if (!str) return NULL;
+
+	size_t len = strlen(str);
+	char* copy = cso_arena_alloc(arena, len + 1);
+	memcpy(copy, str, len + 1);
+
+	return copy;
+}
+
+void cso_arena_reset(struct cso_arena* arena)
+{
+	struct cso_arena_block* block = arena->blocks;
+	if (!block) return;
+
+	// Newest blocks come first, the first one ever allocated is last
+	while (block->next) {
+		struct cso_arena_block* next = block->next;
+		bfree(block);
+		block = next;
+	}
+
+	block->used = 0;
+	arena->blocks = block;
+}
+
+void cso_arena_free(struct cso_arena* arena)
+{
+	struct cso_arena_block* block = arena->blocks;
+
+	while (block) {
+		struct cso_arena_block* next = block->next;
+		bfree(block);
+		block = next;
+	}
+
+	arena->blocks = NULL;
+}
@@ -0,0 +1,80 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Recycling for everything the output would otherwise allocate per frame, plus
+// a small arena for per-recording allocations. The counters say how often each
+// of these actually had to go to the heap; after warm-up they should stop
+// moving.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/threading.h>
+#include <libavcodec/avcodec.h>
+
+// Packet data size classes go from 4 KiB up to 4 KiB << (count - 1)
+#define CSO_BUFFER_CLASS_COUNT 12
+#define CSO_BUFFER_CLASS_MIN_SIZE 4096
+
+struct cso_alloc_stats {
+	volatile long packet_allocs;
+	volatile long packet_reuses;
+	volatile long buffer_allocs;
+	volatile long buffer_oversize; // Packets too large for any pool
+	volatile long arena_blocks;
+};
+
+struct cso_packet_pool {
+	pthread_mutex_t mutex;
+	DARRAY(AVPacket*) packets;
+	struct cso_alloc_stats* stats;
+};
+
+struct cso_buffer_pool {
+	AVBufferPool* classes[CSO_BUFFER_CLASS_COUNT];
+	struct cso_alloc_stats* stats;
+};
+
+struct cso_arena_block {
+	struct cso_arena_block* next;
+	size_t size;
+	size_t used;
+};
+
+struct cso_arena {
+	struct cso_arena_block* blocks;
+	struct cso_alloc_stats* stats;
+};
+
+void cso_packet_pool_init(struct cso_packet_pool* pool,
+			  struct cso_alloc_stats* stats);
+void cso_packet_pool_free(struct cso_packet_pool* pool);
+AVPacket* cso_packet_pool_get(struct cso_packet_pool* pool);
+void cso_packet_pool_put(struct cso_packet_pool* pool, AVPacket* packet);
+
+// Installs the pool as the encoder's packet buffer allocator. The pool has to
+// outlive the codec context, but packets may outlive the pool.
+void cso_buffer_pool_attach(struct cso_buffer_pool* pool,
+			    AVCodecContext* video_ctx);
+void cso_buffer_pool_free(struct cso_buffer_pool* pool);
+
+void* cso_arena_alloc(struct cso_arena* arena, size_t size);
+char* cso_arena_strdup(struct cso_arena* arena, const char* str);
+// Keeps the first block around, so a new recording doesn't need to allocate
+void cso_arena_reset(struct cso_arena* arena);
+void cso_arena_free(struct cso_arena* arena);
@@ -0,0 +1,491 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-raw.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+void cso_write_le(FILE* file, uint64_t value, int bytes)
+{
+	uint8_t buf[8];
+
+	for (int i = 0; i < bytes; i++) buf[i] = (uint8_t) (value >> (i * 8));
+
+	fwrite(buf, 1, bytes, file);
+}
+
+static bool read_le(FILE* file, uint64_t* value, int bytes)
+{
+	uint8_t buf[8];
+
+	if (fread(buf, 1, bytes, file) != (size_t) bytes) return false;
+
+	*value = 0;
+	for (int i = 0; i < bytes; i++) *value |= (uint64_t) buf[i] << (i * 8);
+
+	return true;
+}
+
+bool cso_raw_info_init(struct cso_raw_info* info)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(info->format);
+	int linesizes[4];
+
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL)) return false;
+	if (av_image_fill_linesizes(linesizes, info->format, info->width) < 0)
+		return false;
+
+	info->planes = av_pix_fmt_count_planes(info->format);
+	info->frame_size = 0;
+
+	for (int plane = 0; plane < info->planes; plane++) {
+		bool chroma = plane == 1 || plane == 2;
+		int shift = chroma ? desc->log2_chroma_h : 0;
+
+		info->row_bytes[plane] = linesizes[plane];
+		info->heights[plane] = AV_CEIL_RSHIFT(info->height, shift);
+		info->frame_size += (size_t) info->row_bytes[plane]
+				    * info->heights[plane];
+	}
+
+	return true;
+}
+
+static void write_record(struct cso_raw_writer* writer,
+			 const struct cso_raw_record* record)
+{
+	if (record->type == CSO_RAW_FRAME) {
+		uint64_t offset = (uint64_t) os_ftelli64(writer->file);
+		da_push_back(writer->index, &offset);
+		writer->frames_written++;
+	}
+
+	cso_write_le(writer->file, record->type, 1);
+	cso_write_le(writer->file, record->time_ns, 8);
+	cso_write_le(writer->file, (uint64_t) record->value, 8);
+
+	if (record->data)
+		fwrite(record->data, 1, writer->info.frame_size, writer->file);
+}
+
+static void* raw_thread(void* data)
+{
+	struct cso_raw_writer* writer = data;
+
+	for (;;) {
+		os_sem_wait(writer->semaphore);
+
+		struct cso_raw_record record = {0};
+		bool stop = false;
+
+		pthread_mutex_lock(&writer->mutex);
+		if (writer->queue.num) {
+			record = writer->queue.array[0];
+			da_erase(writer->queue, 0);
+			if (record.data) writer->queued_frames--;
+		} else {
+			stop = writer->stopping;
+		}
+		pthread_mutex_unlock(&writer->mutex);
+
+		if (stop) break;
+		if (!record.type) continue;
+
+		write_record(writer, &record);
+
+		if (record.data) {
+			pthread_mutex_lock(&writer->mutex);
+			da_push_back(writer->spare_frames, &record.data);
+			pthread_mutex_unlock(&writer->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+void cso_raw_writer_init(struct cso_raw_writer* writer)
+{
+	memset(writer, 0, sizeof(struct cso_raw_writer));
+
+	pthread_mutex_init(&writer->mutex, NULL);
+	os_sem_init(&writer->semaphore, 0);
+}
+
+void cso_raw_writer_free(struct cso_raw_writer* writer)
+{
+	cso_raw_writer_close(writer);
+
+	pthread_mutex_destroy(&writer->mutex);
+	os_sem_destroy(writer->semaphore);
+}
+
+bool cso_raw_writer_open(struct cso_raw_writer* writer, const char* path,
+			 const struct cso_raw_info* info)
+{
+	writer->file = os_fopen(path, "wb");
+	if (!writer->file) {
+		obs_log(LOG_WARNING, "Failed to open raw dump \"%s\"", path);
+		return false;
+	}
+
+	writer->info = *info;
+	writer->start_ns = os_gettime_ns();
+	writer->stopping = false;
+	writer->pending_drops = 0;
+	writer->frames_written = 0;
+	writer->frames_dropped = 0;
+
+	const char* format_name = av_get_pix_fmt_name(info->format);
+	size_t name_len = strlen(format_name);
+
+	fwrite("CSRW", 1, 4, writer->file);
+	cso_write_le(writer->file, CSO_RAW_VERSION, 4);
+	cso_write_le(writer->file, (uint32_t) info->width, 4);
+	cso_write_le(writer->file, (uint32_t) info->height, 4);
+	cso_write_le(writer->file, (uint32_t) info->fps_num, 4);
+	cso_write_le(writer->file, (uint32_t) info->fps_den, 4);
+	cso_write_le(writer->file, (uint32_t) info->color_range, 4);
+	cso_write_le(writer->file, (uint32_t) info->color_primaries, 4);
+	cso_write_le(writer->file, (uint32_t) info->color_trc, 4);
+	cso_write_le(writer->file, (uint32_t) info->colorspace, 4);
+	cso_write_le(writer->file, name_len, 1);
+	fwrite(format_name, 1, name_len, writer->file);
+	cso_write_le(writer->file, (uint32_t) info->planes, 4);
+
+	for (int plane = 0; plane < info->planes; plane++) {
+		cso_write_le(writer->file, (uint32_t) info->row_bytes[plane],
+			     4);
+		cso_write_le(writer->file, (uint32_t) info->heights[plane],
+			     4);
+	}
+
+	if (pthread_create(&writer->thread, NULL, raw_thread, writer) != 0) {
+		obs_log(LOG_WARNING, "Failed to create raw dump thread");
+		fclose(writer->file);
+		writer->file = NULL;
+		return false;
+	}
+
+	pthread_mutex_lock(&writer->mutex);
+	writer->active = true;
+	pthread_mutex_unlock(&writer->mutex);
+
+	return true;
+}
+
+void cso_raw_writer_close(struct cso_raw_writer* writer)
+{
+	pthread_mutex_lock(&writer->mutex);
+	bool active = writer->active;
+	writer->active = false;
+	writer->stopping = true;
+	pthread_mutex_unlock(&writer->mutex);
+
+	if (!active) return;
+
+	// The thread writes out the whole queue before it looks at stopping
+	os_sem_post(writer->semaphore);
+	pthread_join(writer->thread, NULL);
+
+	uint64_t index_offset = (uint64_t) os_ftelli64(writer->file);
+
+	fwrite("CSRI", 1, 4, writer->file);
+	cso_write_le(writer->file, writer->index.num, 8);
+	for (size_t i = 0; i < writer->index.num; i++)
+		cso_write_le(writer->file, writer->index.array[i], 8);
+
+	cso_write_le(writer->file, index_offset, 8);
+	fwrite("CSRE", 1, 4, writer->file);
+
+	fclose(writer->file);
+	writer->file = NULL;
+
+	obs_log(LOG_INFO, "Cordyceps-stalk raw dump wrote %lld frames (%ld "
+			  "dropped)",
+		(long long) writer->frames_written, writer->frames_dropped);
+
+	for (size_t i = 0; i < writer->spare_frames.num; i++)
+		bfree(writer->spare_frames.array[i]);
+	da_free(writer->spare_frames);
+	da_free(writer->queue);
+	da_free(writer->index);
+	writer->queued_frames = 0;
+}
+
+static void push_record(struct cso_raw_writer* writer,
+			const struct cso_raw_record* record)
+{
+	da_push_back(writer->queue, record);
+	os_sem_post(writer->semaphore);
+}
+
+void cso_raw_writer_frame(struct cso_raw_writer* writer,
+			  const struct video_data* frame)
+{
+	uint8_t* data = NULL;
+
+	pthread_mutex_lock(&writer->mutex);
+	bool accept = writer->active
+		      && writer->queued_frames < CSO_RAW_MAX_QUEUED;
+
+	if (!accept && writer->active) {
+		writer->pending_drops++;
+		writer->frames_dropped++;
+	} else if (accept && writer->spare_frames.num) {
+		data = writer->spare_frames.array[writer->spare_frames.num - 1];
+		da_pop_back(writer->spare_frames);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+
+	if (!accept) return;
+
+	// Copy outside the lock so the dump thread is never held up by it
+	if (!data) data = bmalloc(writer->info.frame_size);
+
+	uint8_t* out = data;
+	for (int plane = 0; plane < writer->info.planes; plane++) {
+		int row_bytes = writer->info.row_bytes[plane];
+		const uint8_t* in = frame->data[plane];
+
+		for (int y = 0; y < writer->info.heights[plane]; y++) {
+			memcpy(out, in + y * frame->linesize[plane], row_bytes);
+			out += row_bytes;
+		}
+	}
+
+	uint64_t time_ns = os_gettime_ns() - writer->start_ns;
+
+	pthread_mutex_lock(&writer->mutex);
+	if (!writer->active) {
+		pthread_mutex_unlock(&writer->mutex);
+		bfree(data);
+		return;
+	}
+
+	if (writer->pending_drops) {
+		struct cso_raw_record drop = {
+			.type = CSO_RAW_DROP,
+			.time_ns = time_ns,
+			.value = (int64_t) writer->pending_drops,
+		};
+		push_record(writer, &drop);
+		writer->pending_drops = 0;
+	}
+
+	struct cso_raw_record record = {
+		.type = CSO_RAW_FRAME,
+		.time_ns = time_ns,
+		.value = (int64_t) frame->timestamp,
+		.data = data,
+	};
+	push_record(writer, &record);
+	writer->queued_frames++;
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+void cso_raw_writer_request(struct cso_raw_writer* writer, int64_t count)
+{
+	pthread_mutex_lock(&writer->mutex);
+	if (writer->active) {
+		struct cso_raw_record record = {
+			.type = CSO_RAW_REQUEST,
+			.time_ns = os_gettime_ns() - writer->start_ns,
+			.value = count,
+		};
+		push_record(writer, &record);
+	}
+	pthread_mutex_unlock(&writer->mutex);
+}
+
+static bool read_header(struct cso_raw_reader* reader)
+{
+	FILE* file = reader->file;
+	struct cso_raw_info* info = &reader->info;
+	char magic[4];
+	char format_name[256];
+	uint64_t value[10];
+
+	if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "CSRW", 4) != 0)
+		return false;
+
+	for (int i = 0; i < 9; i++)
+		if (!read_le(file, &value[i], 4)) return false;
+
+	if (value[0] != CSO_RAW_VERSION) return false;
+
+	info->width = (int) value[1];
+	info->height = (int) value[2];
+	info->fps_num = (int) value[3];
+	info->fps_den = (int) value[4];
+	info->color_range = (enum AVColorRange) value[5];
+	info->color_primaries = (enum AVColorPrimaries) value[6];
+	info->color_trc = (enum AVColorTransferCharacteristic) value[7];
+	info->colorspace = (enum AVColorSpace) value[8];
+
+	if (!read_le(file, &value[9], 1)
+	    || fread(format_name, 1, value[9], file) != value[9])
+		return false;
+	format_name[value[9]] = 0;
+
+	info->format = av_get_pix_fmt(format_name);
+	if (!cso_raw_info_init(info)) return false;
+
+	// The layout is derived again rather than trusted, so a mismatch means
+	// this FFmpeg disagrees with the one that wrote the dump
+	uint64_t planes;
+	if (!read_le(file, &planes, 4) || planes != (uint64_t) info->planes)
+		return false;
+
+	for (int plane = 0; plane < info->planes; plane++) {
+		uint64_t row_bytes;
+		uint64_t rows;
+
+		if (!read_le(file, &row_bytes, 4) || !read_le(file, &rows, 4)
+		    || row_bytes != (uint64_t) info->row_bytes[plane]
+		    || rows != (uint64_t) info->heights[plane])
+			return false;
+	}
+
+	return true;
+}
+
+static void read_index(struct cso_raw_reader* reader)
+{
+	FILE* file = reader->file;
+	int64_t data_start = os_ftelli64(file);
+	uint64_t index_offset;
+	uint64_t frame_count;
+	char magic[4];
+
+	reader->frame_count = -1;
+	reader->data_end = -1;
+
+	if (os_fseeki64(file, -12, SEEK_END) == 0
+	    && read_le(file, &index_offset, 8) && fread(magic, 1, 4, file) == 4
+	    && memcmp(magic, "CSRE", 4) == 0
+	    && os_fseeki64(file, (int64_t) index_offset, SEEK_SET) == 0
+	    && fread(magic, 1, 4, file) == 4 && memcmp(magic, "CSRI", 4) == 0
+	    && read_le(file, &frame_count, 8)) {
+		reader->frame_count = (int64_t) frame_count;
+		reader->data_end = (int64_t) index_offset;
+	}
+
+	os_fseeki64(file, data_start, SEEK_SET);
+}
+
+bool cso_raw_reader_open(struct cso_raw_reader* reader, const char* path)
+{
+	memset(reader, 0, sizeof(struct cso_raw_reader));
+
+	reader->file = os_fopen(path, "rb");
+	if (!reader->file) {
+		obs_log(LOG_WARNING, "Failed to open raw dump \"%s\"", path);
+		return false;
+	}
+
+	if (!read_header(reader)) {
+		obs_log(LOG_WARNING, "\"%s\" is not a raw dump this build can "
+				     "read",
+			path);
+		cso_raw_reader_close(reader);
+		return false;
+	}
+
+	read_index(reader);
+	reader->frame = bmalloc(reader->info.frame_size);
+
+	return true;
+}
+
+void cso_raw_reader_close(struct cso_raw_reader* reader)
+{
+	if (reader->file) fclose(reader->file);
+	bfree(reader->frame);
+
+	memset(reader, 0, sizeof(struct cso_raw_reader));
+}
+
+bool cso_raw_reader_next(struct cso_raw_reader* reader,
+			 struct cso_raw_record* record)
+{
+	FILE* file = reader->file;
+	uint64_t type;
+	uint64_t value;
+
+	if (reader->data_end >= 0 && os_ftelli64(file) >= reader->data_end)
+		return false;
+
+	if (!read_le(file, &type, 1) || !read_le(file, &record->time_ns, 8)
+	    || !read_le(file, &value, 8))
+		return false;
+
+	record->type = (enum cso_raw_record_type) type;
+	record->value = (int64_t) value;
+	record->data = NULL;
+
+	switch (record->type) {
+	case CSO_RAW_FRAME:
+		// A truncated last frame is just the end of the dump
+		if (fread(reader->frame, 1, reader->info.frame_size, file)
+		    != reader->info.frame_size)
+			return false;
+		record->data = reader->frame;
+		return true;
+	case CSO_RAW_REQUEST:
+	case CSO_RAW_DROP:
+		return true;
+	}
+
+	obs_log(LOG_WARNING, "Unknown raw dump record type %d, stopping",
+		(int) type);
+	return false;
+}
+
+void cso_raw_reader_get_frame(const struct cso_raw_reader* reader,
+			      struct video_data* frame)
+{
+	uint8_t* data = reader->frame;
+
+	memset(frame, 0, sizeof(struct video_data));
+
+	for (int plane = 0; plane < reader->info.planes; plane++) {
+		int row_bytes = reader->info.row_bytes[plane];
+
+		frame->data[plane] = data;
+		frame->linesize[plane] = (uint32_t) row_bytes;
+		data += (size_t) row_bytes * reader->info.heights[plane];
+	}
+}
+
+bool cso_raw_reader_seek_frame(struct cso_raw_reader* reader, int64_t frame)
+{
+	FILE* file = reader->file;
+	uint64_t offset;
+
+	if (reader->frame_count < 0 || frame < 0
+	    || frame >= reader->frame_count)
+		return false;
+
+	// Index entries follow "CSRI" and the frame count
+	return os_fseeki64(file, reader->data_end + 12 + frame * 8, SEEK_SET)
+		       == 0
+	       && read_le(file, &offset, 8)
+	       && os_fseeki64(file, (int64_t) offset, SEEK_SET) == 0;
+}
@@ -0,0 +1,143 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Raw frame dumps, for replaying a session's exact input through the encoder
+// offline. The output writes "<file>.csraw" when the raw_dump setting is on;
+// tools/cordyceps-stalk-replay.c and tools/cordyceps-stalk-chunks.c read it
+// back.
+//
+// All integers are little-endian.
+//   Header:  "CSRW", u32 version, u32 width, u32 height, u32 fps num,
+//            u32 fps den, u32 colour range, u32 primaries, u32 transfer,
+//            u32 colour space, u8 pixel format name length, name bytes,
+//            u32 plane count, then u32 row bytes and u32 rows per plane
+//   Records: u8 type, u64 ns since the dump started, u64 value, then for
+//            FRAME records every plane's rows back to back. The value is
+//            FRAME:   the frame's OBS timestamp
+//            REQUEST: the frame count passed to request_frames
+//            DROP:    frames skipped because the dump fell behind
+//   Index:   "CSRI", u64 frame count, u64 file offset of each FRAME record
+//   Trailer: u64 offset of the index, "CSRE"
+//
+// Pixel formats are stored by FFmpeg name since the enum values aren't stable
+// between FFmpeg versions. Only frames that made it past the frame request
+// gate are dumped. A dump cut short by a crash has no index, but is still
+// readable front to back.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <libavutil/pixfmt.h>
+
+#define CSO_RAW_VERSION 1
+
+// Frames waiting for the dump thread; more than this and frames get dropped
+#define CSO_RAW_MAX_QUEUED 16
+
+enum cso_raw_record_type {
+	CSO_RAW_FRAME = 1,
+	CSO_RAW_REQUEST = 2,
+	CSO_RAW_DROP = 3,
+};
+
+struct cso_raw_info {
+	enum AVPixelFormat format;
+	int width;
+	int height;
+	int fps_num;
+	int fps_den;
+	enum AVColorRange color_range;
+	enum AVColorPrimaries color_primaries;
+	enum AVColorTransferCharacteristic color_trc;
+	enum AVColorSpace colorspace;
+
+	// Derived from the above
+	int planes;
+	int row_bytes[MAX_AV_PLANES];
+	int heights[MAX_AV_PLANES];
+	size_t frame_size;
+};
+
+struct cso_raw_record {
+	enum cso_raw_record_type type;
+	uint64_t time_ns;
+	int64_t value; // OBS timestamp, request count or drop count
+	uint8_t* data; // Packed planes, FRAME only
+};
+
+struct cso_raw_writer {
+	FILE* file;
+	struct cso_raw_info info;
+	uint64_t start_ns;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	os_sem_t* semaphore;
+	bool active; // Under mutex
+	bool stopping;
+
+	DARRAY(struct cso_raw_record) queue;
+	DARRAY(uint8_t*) spare_frames;
+	int queued_frames;
+	uint64_t pending_drops;
+
+	DARRAY(uint64_t) index; // Dump thread only
+	int64_t frames_written;
+	long frames_dropped;
+};
+
+struct cso_raw_reader {
+	FILE* file;
+	struct cso_raw_info info;
+	int64_t frame_count; // -1 without an index
+	int64_t data_end;    // Where the index starts, -1 without one
+	uint8_t* frame;      // Planes of the last FRAME record read
+};
+
+// Fills in the derived fields of info, false for unsupported formats
+bool cso_raw_info_init(struct cso_raw_info* info);
+
+// Writes the low bytes of value, least significant first. Shared with the
+// seek index.
+void cso_write_le(FILE* file, uint64_t value, int bytes);
+
+// The writer's lock lives as long as the output, so requests coming in from
+// other threads are safe while a dump is opened and closed
+void cso_raw_writer_init(struct cso_raw_writer* writer);
+void cso_raw_writer_free(struct cso_raw_writer* writer);
+bool cso_raw_writer_open(struct cso_raw_writer* writer, const char* path,
+			 const struct cso_raw_info* info);
+// Writes out everything queued, then the index
+void cso_raw_writer_close(struct cso_raw_writer* writer);
+void cso_raw_writer_frame(struct cso_raw_writer* writer,
+			  const struct video_data* frame);
+void cso_raw_writer_request(struct cso_raw_writer* writer, int64_t count);
+
+bool cso_raw_reader_open(struct cso_raw_reader* reader, const char* path);
+void cso_raw_reader_close(struct cso_raw_reader* reader);
+// Returns false at the end of the dump. FRAME records leave their planes in
+// reader->frame, see cso_raw_reader_get_frame().
+bool cso_raw_reader_next(struct cso_raw_reader* reader,
+			 struct cso_raw_record* record);
+void cso_raw_reader_get_frame(const struct cso_raw_reader* reader,
+			      struct video_data* frame);
+// Moves to the FRAME record with the given index, so the next call to
+// cso_raw_reader_next() returns it. Needs the dump's index.
+bool cso_raw_reader_seek_frame(struct cso_raw_reader* reader, int64_t frame);
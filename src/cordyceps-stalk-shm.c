@@ -0,0 +1,349 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-shm.h"
+#include "cordyceps-stalk-raw.h"
+#include "include/obs-ffmpeg-formats.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <assert.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(struct cso_shm_header) == 256,
+	      "shared memory header layout changed");
+static_assert(sizeof(struct cso_shm_slot) == CSO_SHM_SLOT_HEADER_SIZE,
+	      "shared memory slot layout changed");
+
+static uint32_t load_acquire(volatile uint32_t* ptr)
+{
+#ifdef _MSC_VER
+	return (uint32_t) InterlockedCompareExchange((volatile LONG*) ptr, 0,
+						     0);
+#else
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void store_release(volatile uint32_t* ptr, uint32_t value)
+{
+#ifdef _MSC_VER
+	InterlockedExchange((volatile LONG*) ptr, (LONG) value);
+#else
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+#endif
+}
+
+static bool map_ring(struct cso_shm_ring* ring, const char* name, size_t size)
+{
+#ifdef _WIN32
+	wchar_t* wname = NULL;
+	if (!os_utf8_to_wcs_ptr(name, 0, &wname)) return false;
+
+	HANDLE handle;
+	if (size)
+		handle = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL,
+					    PAGE_READWRITE,
+					    (DWORD) ((uint64_t) size >> 32),
+					    (DWORD) size, wname);
+	else
+		handle = OpenFileMappingW(FILE_MAP_ALL_ACCESS, FALSE, wname);
+	bfree(wname);
+
+	if (!handle) return false;
+
+	void* view = MapViewOfFile(handle, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (!view) {
+		CloseHandle(handle);
+		return false;
+	}
+
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(view, &info, sizeof(info));
+
+	ring->handle = handle;
+	ring->header = view;
+	ring->size = size ? size : info.RegionSize;
+#else
+	struct dstr path;
+	dstr_init_copy(&path, "/");
+	dstr_cat(&path, name);
+
+	int fd;
+	if (size) {
+		// Left behind by a producer that crashed
+		shm_unlink(path.array);
+		fd = shm_open(path.array, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0 && ftruncate(fd, (off_t) size) != 0) {
+			close(fd);
+			shm_unlink(path.array);
+			fd = -1;
+		}
+	} else {
+		fd = shm_open(path.array, O_RDWR, 0);
+
+		struct stat st;
+		if (fd >= 0 && fstat(fd, &st) == 0) size = (size_t) st.st_size;
+	}
+
+	if (fd < 0 || size < sizeof(struct cso_shm_header)) {
+		if (fd >= 0) close(fd);
+		dstr_free(&path);
+		return false;
+	}
+
+	void* view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			  0);
+	close(fd);
+
+	if (view == MAP_FAILED) {
+		dstr_free(&path);
+		return false;
+	}
+
+	ring->header = view;
+	ring->size = size;
+	ring->name = bstrdup(path.array);
+	dstr_free(&path);
+#endif
+
+	return true;
+}
+
+static uint8_t* get_slot(const struct cso_shm_ring* ring, uint32_t index)
+{
+	const struct cso_shm_header* header = ring->header;
+
+	return (uint8_t*) header + header->header_size
+	       + (size_t) (index % header->slot_count) * header->slot_size;
+}
+
+static void fill_frame(const struct cso_shm_ring* ring, uint8_t* slot,
+		       struct video_data* frame)
+{
+	const struct cso_shm_header* header = ring->header;
+	uint8_t* data = slot + CSO_SHM_SLOT_HEADER_SIZE;
+
+	memset(frame, 0, sizeof(*frame));
+
+	for (uint32_t plane = 0; plane < header->planes; plane++) {
+		frame->data[plane] = data;
+		frame->linesize[plane] = header->row_bytes[plane];
+		data += (size_t) header->row_bytes[plane]
+			* header->heights[plane];
+	}
+
+	frame->timestamp = ((struct cso_shm_slot*) slot)->timestamp;
+}
+
+bool cso_shm_create(struct cso_shm_ring* ring, const char* name,
+		    const struct video_output_info* voi, uint32_t slot_count)
+{
+	struct cso_raw_info info = {
+		.format = obs_to_ffmpeg_video_format(voi->format),
+		.width = (int) voi->width,
+		.height = (int) voi->height,
+	};
+
+	memset(ring, 0, sizeof(*ring));
+
+	if (!slot_count || !cso_raw_info_init(&info) || info.planes > 4) {
+		obs_log(LOG_WARNING, "Shared memory frames aren't supported "
+				     "for this video format");
+		return false;
+	}
+
+	// Keeps every slot's planes cache line aligned
+	uint64_t slot_size = (CSO_SHM_SLOT_HEADER_SIZE + info.frame_size + 63)
+			     & ~(uint64_t) 63;
+	size_t size = CSO_SHM_HEADER_SIZE + (size_t) (slot_size * slot_count);
+
+	if (!map_ring(ring, name, size)) {
+		obs_log(LOG_WARNING, "Failed to create shared memory \"%s\"",
+			name);
+		return false;
+	}
+
+	struct cso_shm_header* header = ring->header;
+	memset(header, 0, sizeof(*header));
+
+	header->version = CSO_SHM_VERSION;
+	header->header_size = CSO_SHM_HEADER_SIZE;
+	header->slot_count = slot_count;
+	header->slot_size = slot_size;
+	header->format = voi->format;
+	header->width = voi->width;
+	header->height = voi->height;
+	header->fps_num = voi->fps_num;
+	header->fps_den = voi->fps_den;
+	header->colorspace = voi->colorspace;
+	header->range = voi->range;
+	header->planes = (uint32_t) info.planes;
+
+	for (int plane = 0; plane < info.planes; plane++) {
+		header->row_bytes[plane] = (uint32_t) info.row_bytes[plane];
+		header->heights[plane] = (uint32_t) info.heights[plane];
+	}
+
+	// Written last, a consumer that sees the magic sees everything above
+	store_release((volatile uint32_t*) header->magic,
+		      (uint32_t) 'C' | (uint32_t) 'S' << 8
+			      | (uint32_t) 'H' << 16 | (uint32_t) 'M' << 24);
+
+	ring->owner = true;
+	return true;
+}
+
+bool cso_shm_begin_write(struct cso_shm_ring* ring, struct video_data* frame)
+{
+	struct cso_shm_header* header = ring->header;
+	uint32_t write_index = header->write_index;
+
+	if (write_index - load_acquire(&header->read_index)
+	    >= header->slot_count)
+		return false;
+
+	fill_frame(ring, get_slot(ring, write_index), frame);
+	return true;
+}
+
+void cso_shm_end_write(struct cso_shm_ring* ring, uint64_t timestamp)
+{
+	struct cso_shm_header* header = ring->header;
+	uint32_t write_index = header->write_index;
+
+	struct cso_shm_slot* slot =
+		(struct cso_shm_slot*) get_slot(ring, write_index);
+	slot->timestamp = timestamp;
+
+	store_release(&header->write_index, write_index + 1);
+}
+
+bool cso_shm_open(struct cso_shm_ring* ring, const char* name)
+{
+	memset(ring, 0, sizeof(*ring));
+
+	if (!map_ring(ring, name, 0)) {
+		obs_log(LOG_WARNING, "Failed to open shared memory \"%s\"; "
+				     "is the producer running?",
+			name);
+		return false;
+	}
+
+	struct cso_shm_header* header = ring->header;
+	bool valid = load_acquire((volatile uint32_t*) header->magic) != 0
+		     && memcmp(header->magic, "CSHM", 4) == 0
+		     && header->version == CSO_SHM_VERSION
+		     && header->header_size >= sizeof(*header)
+		     && header->slot_count && header->planes
+		     && header->planes <= 4;
+
+	// Frames are read at the size the format says, so the planes have to
+	// be exactly that; smaller ones would have reads run past the slot
+	struct cso_raw_info info = {
+		.format = obs_to_ffmpeg_video_format(
+			(enum video_format) header->format),
+		.width = (int) header->width,
+		.height = (int) header->height,
+	};
+
+	valid = valid && info.width > 0 && info.height > 0
+		&& cso_raw_info_init(&info)
+		&& (uint32_t) info.planes == header->planes;
+
+	for (uint32_t plane = 0; valid && plane < header->planes; plane++)
+		valid = header->row_bytes[plane]
+				== (uint32_t) info.row_bytes[plane]
+			&& header->heights[plane]
+				   == (uint32_t) info.heights[plane];
+
+	uint64_t frame_size = valid ? info.frame_size : 0;
+
+	valid = valid
+		&& header->slot_size >= CSO_SHM_SLOT_HEADER_SIZE + frame_size
+		&& header->header_size
+				   + header->slot_size * header->slot_count
+			   <= ring->size;
+
+	if (!valid) {
+		obs_log(LOG_WARNING, "Shared memory \"%s\" isn't a version %d "
+				     "frame ring",
+			name, CSO_SHM_VERSION);
+		cso_shm_close(ring);
+		return false;
+	}
+
+	return true;
+}
+
+void cso_shm_get_info(const struct cso_shm_ring* ring,
+		      struct video_output_info* voi)
+{
+	const struct cso_shm_header* header = ring->header;
+
+	voi->format = (enum video_format) header->format;
+	voi->width = header->width;
+	voi->height = header->height;
+	voi->fps_num = header->fps_num;
+	voi->fps_den = header->fps_den;
+	voi->colorspace = (enum video_colorspace) header->colorspace;
+	voi->range = (enum video_range_type) header->range;
+}
+
+bool cso_shm_acquire(struct cso_shm_ring* ring, struct video_data* frame)
+{
+	struct cso_shm_header* header = ring->header;
+	uint32_t read_index = header->read_index;
+
+	if (load_acquire(&header->write_index) == read_index) return false;
+
+	fill_frame(ring, get_slot(ring, read_index), frame);
+	return true;
+}
+
+void cso_shm_release(struct cso_shm_ring* ring)
+{
+	struct cso_shm_header* header = ring->header;
+
+	store_release(&header->read_index, header->read_index + 1);
+}
+
+void cso_shm_close(struct cso_shm_ring* ring)
+{
+	if (!ring->header) return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(ring->header);
+	CloseHandle(ring->handle);
+#else
+	munmap(ring->header, ring->size);
+	if (ring->owner) shm_unlink(ring->name);
+	bfree(ring->name);
+#endif
+
+	memset(ring, 0, sizeof(*ring));
+}
@@ -0,0 +1,109 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Shared-memory frame ring, so a game can hand finished frames straight to the
+// output without going through OBS's compositor and GPU readback. The game (or
+// tools/cordyceps-stalk-shm-producer.c) creates the ring and writes frames into
+// it, the output opens it by name and encodes frames as fast as they arrive.
+//
+// The mapping starts with struct cso_shm_header, followed by slot_count slots
+// of slot_size bytes at header_size. Each slot starts with struct
+// cso_shm_slot, then the frame's planes back to back, every row exactly
+// row_bytes long. The layout is the same as a FRAME record in a raw dump.
+//
+// There's exactly one producer and one consumer. write_index and read_index
+// count frames from the start and wrap around at 2^32; the slot for a frame is
+// its index modulo slot_count. The producer only writes write_index, the
+// consumer only read_index, and each is published with release semantics after
+// the slot it covers has been written or read. The ring is full when the two
+// differ by slot_count, which is how the producer gets held back to the
+// encoder's pace. Neither side blocks, both poll.
+//
+// On POSIX the name is passed to shm_open() with a leading slash, on Windows
+// it names a pagefile-backed file mapping.
+
+#pragma once
+
+#include <obs-module.h>
+
+#define CSO_SHM_VERSION 1
+#define CSO_SHM_HEADER_SIZE 4096
+#define CSO_SHM_SLOT_HEADER_SIZE 64
+#define CSO_SHM_DEFAULT_SLOTS 4
+#define CSO_SHM_DEFAULT_NAME "cordyceps-stalk"
+
+// Fixed layout, shared with code that isn't built against this header
+struct cso_shm_header {
+	char magic[4]; // "CSHM"
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t slot_count;
+	uint64_t slot_size;
+
+	uint32_t format;     // enum video_format
+	uint32_t width;
+	uint32_t height;
+	uint32_t fps_num;
+	uint32_t fps_den;
+	uint32_t colorspace; // enum video_colorspace
+	uint32_t range;      // enum video_range_type
+
+	uint32_t planes;
+	uint32_t row_bytes[4];
+	uint32_t heights[4];
+	uint8_t reserved[40];
+
+	// Each on its own cache line so the two sides don't contend
+	volatile uint32_t write_index;
+	uint8_t write_padding[60];
+	volatile uint32_t read_index;
+	uint8_t read_padding[60];
+};
+
+struct cso_shm_slot {
+	uint64_t timestamp; // Nanoseconds, only used for ordering and pacing
+	uint8_t reserved[CSO_SHM_SLOT_HEADER_SIZE - 8];
+};
+
+struct cso_shm_ring {
+	struct cso_shm_header* header;
+	size_t size;
+	bool owner;
+	char* name; // As passed to shm_open(), the producer unlinks it
+	void* handle;
+};
+
+// Producer side. Returns false if the format has no fixed plane layout.
+bool cso_shm_create(struct cso_shm_ring* ring, const char* name,
+		    const struct video_output_info* voi, uint32_t slot_count);
+// Returns false while the ring is full, otherwise points frame at the next
+// free slot
+bool cso_shm_begin_write(struct cso_shm_ring* ring, struct video_data* frame);
+void cso_shm_end_write(struct cso_shm_ring* ring, uint64_t timestamp);
+
+// Consumer side. Fails if nothing has created the ring yet.
+bool cso_shm_open(struct cso_shm_ring* ring, const char* name);
+// Fills in the fields of voi the output cares about
+void cso_shm_get_info(const struct cso_shm_ring* ring,
+		      struct video_output_info* voi);
+// Returns false while the ring is empty. The frame stays valid until
+// cso_shm_release().
+bool cso_shm_acquire(struct cso_shm_ring* ring, struct video_data* frame);
+void cso_shm_release(struct cso_shm_ring* ring);
+
+void cso_shm_close(struct cso_shm_ring* ring);
@@ -0,0 +1,500 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-sink.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <util/bmem.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#define CSO_SINK_IO_BUFFER_SIZE 65536
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define CSO_AVIO_WRITE_CONST const
+#else
+#define CSO_AVIO_WRITE_CONST
+#endif
+
+static const char* const sink_schemes[] = {
+	[CSO_SINK_DIR] = "dir:",
+	[CSO_SINK_PIPE] = "pipe:",
+	[CSO_SINK_UNIX] = "unix:",
+	[CSO_SINK_EXEC] = "exec:",
+};
+
+static bool sink_stopping(struct cso_sink* sink)
+{
+	pthread_mutex_lock(&sink->mutex);
+	bool stopping = sink->stopping;
+	pthread_mutex_unlock(&sink->mutex);
+
+	return stopping;
+}
+
+static int exec_write(void* opaque, CSO_AVIO_WRITE_CONST uint8_t* buf,
+		      int size)
+{
+	struct cso_sink* sink = opaque;
+
+	size_t written = os_process_pipe_write(sink->process, buf,
+					       (size_t) size);
+	return written == (size_t) size ? size : AVERROR(EPIPE);
+}
+
+#ifndef _WIN32
+// Opening a FIFO for writing blocks until there's a reader, which would keep
+// the recording from ever stopping if nobody shows up
+static bool open_fifo(struct cso_sink* sink, struct dstr* url)
+{
+	while ((sink->fd = open(sink->target, O_WRONLY | O_NONBLOCK)) < 0) {
+		if (errno != ENXIO || sink_stopping(sink)) return false;
+		os_sleep_ms(100);
+	}
+
+	// Writes should wait for a slow reader like they would for a file
+	fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_NONBLOCK);
+
+	dstr_printf(url, "pipe:%d", sink->fd);
+	return true;
+}
+#endif
+
+// The command inherits this thread's signal mask, and it should still die of
+// SIGPIPE when its own reader goes away
+static os_process_pipe_t* create_process(const char* cmd)
+{
+#ifndef _WIN32
+	sigset_t sigpipe, pending, old;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+
+	// Left over from a write to a reader that went away; unblocking
+	// would deliver it to OBS
+	if (sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE)) {
+		int sig;
+		sigwait(&sigpipe, &sig);
+	}
+
+	pthread_sigmask(SIG_UNBLOCK, &sigpipe, &old);
+	os_process_pipe_t* process = os_process_pipe_create(cmd, "w");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return process;
+#else
+	return os_process_pipe_create(cmd, "w");
+#endif
+}
+
+static bool open_io(struct cso_sink* sink, const char* filename)
+{
+	AVFormatContext* ctx = sink->output_ctx;
+	struct dstr url;
+	bool success = false;
+
+	dstr_init(&url);
+
+	switch (sink->type) {
+	case CSO_SINK_DIR: {
+		size_t len = strlen(sink->target);
+		dstr_copy(&url, sink->target);
+		if (len && sink->target[len - 1] != '/'
+		    && sink->target[len - 1] != '\\')
+			dstr_cat_ch(&url, '/');
+		dstr_cat(&url, filename);
+		break;
+	}
+	case CSO_SINK_PIPE:
+#ifdef _WIN32
+		dstr_copy(&url, sink->target);
+#else
+		if (!open_fifo(sink, &url)) goto done;
+#endif
+		break;
+	case CSO_SINK_UNIX:
+		dstr_printf(&url, "unix:%s", sink->target);
+		break;
+	case CSO_SINK_EXEC: {
+		sink->process = create_process(sink->target);
+		if (!sink->process) goto done;
+
+		uint8_t* buffer = av_malloc(CSO_SINK_IO_BUFFER_SIZE);
+		ctx->pb = avio_alloc_context(buffer, CSO_SINK_IO_BUFFER_SIZE,
+					     1, sink, NULL, exec_write, NULL);
+		success = ctx->pb != NULL;
+		if (!success) av_free(buffer);
+		goto done;
+	}
+	}
+
+	success = avio_open2(&ctx->pb, url.array, AVIO_FLAG_WRITE, NULL,
+			     NULL)
+		  >= 0;
+
+done:
+	dstr_free(&url);
+	return success;
+}
+
+static void close_stream(struct cso_sink* sink, bool write_trailer)
+{
+	AVFormatContext* ctx = sink->output_ctx;
+
+	if (ctx) {
+		if (write_trailer) av_write_trailer(ctx);
+
+		if (sink->type == CSO_SINK_EXEC && ctx->pb) {
+			avio_flush(ctx->pb);
+			av_freep(&ctx->pb->buffer);
+			avio_context_free(&ctx->pb);
+		} else {
+			avio_closep(&ctx->pb);
+		}
+
+		avformat_free_context(ctx);
+		sink->output_ctx = NULL;
+	}
+
+	// Waits for the process to exit, now that its input is closed
+	if (sink->process) {
+		os_process_pipe_destroy(sink->process);
+		sink->process = NULL;
+	}
+
+#ifndef _WIN32
+	if (sink->fd >= 0) {
+		close(sink->fd);
+		sink->fd = -1;
+	}
+#endif
+}
+
+static bool open_stream(struct cso_sink* sink,
+			const struct cso_sink_segment* segment)
+{
+	AVDictionary* options = NULL;
+
+	avformat_alloc_output_context2(&sink->output_ctx, segment->format,
+				       NULL, segment->filename);
+	if (!sink->output_ctx) return false;
+
+	AVStream* stream = avformat_new_stream(sink->output_ctx, NULL);
+	if (!stream
+	    || avcodec_parameters_copy(stream->codecpar, segment->params) < 0)
+		goto fail;
+
+	stream->time_base = segment->stream_time_base;
+
+	if (!open_io(sink, segment->filename)) goto fail;
+
+	// Readers on the other end want each fragment as soon as it's done,
+	// not once the IO buffer fills up
+	if (sink->type != CSO_SINK_DIR) {
+		av_dict_set(&options, "movflags",
+			    "frag_keyframe+empty_moov+default_base_moof", 0);
+		av_dict_set(&options, "flush_packets", "1", 0);
+	}
+
+	if (avformat_write_header(sink->output_ctx, &options) < 0) goto fail;
+
+	av_dict_free(&options);
+	sink->time_base = segment->time_base;
+	return true;
+
+fail:
+	av_dict_free(&options);
+	close_stream(sink, false);
+	return false;
+}
+
+static void write_packet(struct cso_sink* sink, AVPacket* packet)
+{
+	AVFormatContext* ctx = sink->output_ctx;
+
+	if (!ctx) {
+		os_atomic_inc_long(&sink->dropped);
+		return;
+	}
+
+	AVRational stream_time_base = ctx->streams[0]->time_base;
+	int size = packet->size;
+
+	av_packet_rescale_ts(packet, sink->time_base, stream_time_base);
+
+	int ret = av_write_frame(ctx, packet);
+	if (ret < 0) {
+		obs_log(LOG_WARNING, "Cordyceps-stalk sink \"%s\" failed: %s; "
+				     "dropping it until the next segment",
+			sink->target, av_err2str(ret));
+		os_atomic_set_bool(&sink->failed, true);
+		close_stream(sink, false);
+		return;
+	}
+
+	sink->written_bytes += (uint64_t) size;
+}
+
+static void free_segment(struct cso_sink_segment* segment)
+{
+	avcodec_parameters_free(&segment->params);
+	bfree(segment->filename);
+	bfree(segment);
+}
+
+static void* sink_thread(void* data)
+{
+	struct cso_sink* sink = data;
+	struct cso_sinks* sinks = sink->owner;
+
+#ifndef _WIN32
+	// A reader going away mid-write would otherwise take OBS down with
+	// it, instead of just failing the write. All of the sink's writes
+	// happen on this thread, so the rest of OBS keeps its handling.
+	sigset_t sigpipe;
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+#endif
+
+	cso_cpu_enter(sinks->cpu, CSO_CPU_WRITER);
+
+	for (;;) {
+		os_sem_wait(sink->semaphore);
+
+		struct cso_sink_entry entry = {0};
+		bool stop = false;
+
+		pthread_mutex_lock(&sink->mutex);
+		if (sink->entries.num) {
+			entry = sink->entries.array[0];
+			da_erase(sink->entries, 0);
+			if (entry.packet)
+				sink->queued_bytes -=
+					(size_t) entry.packet->size;
+		} else {
+			stop = sink->stopping;
+		}
+		pthread_mutex_unlock(&sink->mutex);
+
+		if (stop) break;
+
+		if (entry.segment) {
+			close_stream(sink, true);
+
+			if (!open_stream(sink, entry.segment)) {
+				obs_log(LOG_WARNING,
+					"Failed to open cordyceps stalk sink "
+					"\"%s\"; dropping it until the next "
+					"segment",
+					sink->target);
+				os_atomic_set_bool(&sink->failed, true);
+			}
+
+			free_segment(entry.segment);
+		} else if (entry.packet) {
+			write_packet(sink, entry.packet);
+			cso_packet_pool_put(sinks->packet_pool, entry.packet);
+		}
+	}
+
+	close_stream(sink, true);
+
+	cso_cpu_leave(sinks->cpu);
+	return NULL;
+}
+
+static struct cso_sink* parse_sink(const char* spec)
+{
+	for (size_t i = 0; i < sizeof(sink_schemes) / sizeof(*sink_schemes);
+	     i++) {
+		size_t len = strlen(sink_schemes[i]);
+		if (strncmp(spec, sink_schemes[i], len) != 0 || !spec[len])
+			continue;
+
+		struct cso_sink* sink = bzalloc(sizeof(struct cso_sink));
+		sink->type = (enum cso_sink_type) i;
+		sink->target = bstrdup(spec + len);
+		sink->fd = -1;
+		return sink;
+	}
+
+	obs_log(LOG_WARNING, "Ignoring cordyceps stalk sink \"%s\"; expected "
+			     "dir:, pipe:, unix: or exec:",
+		spec);
+	return NULL;
+}
+
+void cso_sinks_start(struct cso_sinks* sinks, const char* spec,
+		     int buffer_mb, struct cso_packet_pool* packet_pool,
+		     struct cso_cpu* cpu)
+{
+	da_init(sinks->sinks);
+	sinks->packet_pool = packet_pool;
+	sinks->cpu = cpu;
+	sinks->max_queued_bytes =
+		(size_t) (buffer_mb > 0 ? buffer_mb
+					: CSO_SINK_DEFAULT_BUFFER_MB)
+		* 1024 * 1024;
+
+	if (!spec || !*spec) return;
+
+	char** entries = strlist_split(spec, ';', false);
+
+	for (char** entry = entries; *entry; entry++) {
+		struct dstr trimmed;
+		dstr_init_copy(&trimmed, *entry);
+		dstr_depad(&trimmed);
+
+		struct cso_sink* sink =
+			trimmed.len ? parse_sink(trimmed.array) : NULL;
+		dstr_free(&trimmed);
+		if (!sink) continue;
+
+		sink->owner = sinks;
+		pthread_mutex_init(&sink->mutex, NULL);
+		os_sem_init(&sink->semaphore, 0);
+		da_init(sink->entries);
+
+		if (pthread_create(&sink->thread, NULL, sink_thread, sink)
+		    != 0) {
+			obs_log(LOG_WARNING, "Failed to create thread for "
+					     "cordyceps stalk sink \"%s\"",
+				sink->target);
+			os_sem_destroy(sink->semaphore);
+			pthread_mutex_destroy(&sink->mutex);
+			bfree(sink->target);
+			bfree(sink);
+			continue;
+		}
+
+		obs_log(LOG_INFO, "Cordyceps-stalk sink \"%s%s\" started",
+			sink_schemes[sink->type], sink->target);
+		da_push_back(sinks->sinks, &sink);
+	}
+
+	strlist_free(entries);
+}
+
+void cso_sinks_stop(struct cso_sinks* sinks)
+{
+	for (size_t i = 0; i < sinks->sinks.num; i++) {
+		struct cso_sink* sink = sinks->sinks.array[i];
+
+		pthread_mutex_lock(&sink->mutex);
+		sink->stopping = true;
+		pthread_mutex_unlock(&sink->mutex);
+
+		os_sem_post(sink->semaphore);
+		pthread_join(sink->thread, NULL);
+
+		obs_log(LOG_INFO, "Cordyceps-stalk sink \"%s%s\" wrote %llu "
+				  "bytes, dropped %ld packets",
+			sink_schemes[sink->type], sink->target,
+			(unsigned long long) sink->written_bytes,
+			sink->dropped);
+
+		da_free(sink->entries);
+		os_sem_destroy(sink->semaphore);
+		pthread_mutex_destroy(&sink->mutex);
+		bfree(sink->target);
+		bfree(sink);
+	}
+
+	da_free(sinks->sinks);
+}
+
+static void push_entry(struct cso_sink* sink, struct cso_sink_entry* entry)
+{
+	pthread_mutex_lock(&sink->mutex);
+	da_push_back(sink->entries, entry);
+	if (entry->packet) sink->queued_bytes += (size_t) entry->packet->size;
+	pthread_mutex_unlock(&sink->mutex);
+
+	os_sem_post(sink->semaphore);
+}
+
+void cso_sinks_begin_segment(struct cso_sinks* sinks,
+			     const struct ffmpeg_context* context)
+{
+	const char* path = context->config.filepath;
+	const char* filename = path;
+
+	for (const char* c = path; *c; c++)
+		if (*c == '/' || *c == '\\') filename = c + 1;
+
+	for (size_t i = 0; i < sinks->sinks.num; i++) {
+		struct cso_sink* sink = sinks->sinks.array[i];
+		struct cso_sink_segment* segment =
+			bzalloc(sizeof(struct cso_sink_segment));
+
+		segment->params = avcodec_parameters_alloc();
+		avcodec_parameters_copy(segment->params,
+					context->video_stream->codecpar);
+		segment->time_base = context->time_base;
+		segment->stream_time_base = context->video_stream->time_base;
+		segment->format = context->config.output_format;
+		segment->filename = bstrdup(filename);
+
+		// New encoder, so it starts on a keyframe and the sink gets
+		// another chance
+		sink->resync = false;
+		os_atomic_set_bool(&sink->failed, false);
+
+		struct cso_sink_entry entry = {.segment = segment};
+		push_entry(sink, &entry);
+	}
+}
+
+void cso_sinks_push(struct cso_sinks* sinks, const AVPacket* packet)
+{
+	bool keyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+
+	for (size_t i = 0; i < sinks->sinks.num; i++) {
+		struct cso_sink* sink = sinks->sinks.array[i];
+
+		pthread_mutex_lock(&sink->mutex);
+		bool full = sink->queued_bytes + (size_t) packet->size
+			    > sinks->max_queued_bytes;
+		pthread_mutex_unlock(&sink->mutex);
+
+		if (os_atomic_load_bool(&sink->failed) || full
+		    || (sink->resync && !keyframe)) {
+			os_atomic_inc_long(&sink->dropped);
+			sink->resync = true;
+			continue;
+		}
+
+		AVPacket* ref = cso_packet_pool_get(sinks->packet_pool);
+		if (av_packet_ref(ref, packet) < 0) {
+			cso_packet_pool_put(sinks->packet_pool, ref);
+			os_atomic_inc_long(&sink->dropped);
+			sink->resync = true;
+			continue;
+		}
+
+		sink->resync = false;
+
+		struct cso_sink_entry entry = {.packet = ref};
+		push_entry(sink, &entry);
+	}
+}
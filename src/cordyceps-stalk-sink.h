@@ -0,0 +1,120 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Extra destinations that get a copy of every encoded packet, on top of the
+// recording file itself. Each sink muxes on its own thread from its own queue,
+// so a slow or stuck sink only ever loses its own packets.
+//
+// The "sinks" setting lists them separated by ';':
+//   dir:<directory>  Same file name as the recording, in another directory
+//   pipe:<path>      Named pipe or FIFO, waits for a reader to connect
+//   unix:<path>      Unix domain socket, needs FFmpeg's unix protocol
+//   exec:<command>   Standard input of a process started for the recording
+//
+// Everything but dir sinks is written as fragmented MP4, which doesn't need
+// to seek back for its header. Each keyframe starts a fragment, and readers
+// get every fragment as soon as it's complete. Sinks finish their stream at
+// every segment switch and start a new one, so a reader sees one complete
+// stream per file.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/pipe.h>
+#include <libavformat/avformat.h>
+
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-pool.h"
+#include "cordyceps-stalk-cpu.h"
+
+#define CSO_SINK_DEFAULT_BUFFER_MB 64
+
+enum cso_sink_type {
+	CSO_SINK_DIR,
+	CSO_SINK_PIPE,
+	CSO_SINK_UNIX,
+	CSO_SINK_EXEC,
+};
+
+// What a sink needs to start a stream; owned by the entry carrying it
+struct cso_sink_segment {
+	AVCodecParameters* params;
+	AVRational time_base; // Of the packets, which count frames
+	AVRational stream_time_base;
+	const AVOutputFormat* format;
+	char* filename;
+};
+
+// Exactly one of the two is set
+struct cso_sink_entry {
+	AVPacket* packet;
+	struct cso_sink_segment* segment;
+};
+
+struct cso_sinks;
+
+struct cso_sink {
+	struct cso_sinks* owner;
+	enum cso_sink_type type;
+	char* target;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	os_sem_t* semaphore;
+	DARRAY(struct cso_sink_entry) entries;
+	size_t queued_bytes;
+	bool stopping;
+
+	// Video thread only. Set once something was dropped, so the sink skips
+	// ahead to the next keyframe instead of muxing a broken GOP.
+	bool resync;
+
+	// Sink thread only
+	AVFormatContext* output_ctx;
+	AVRational time_base;
+	os_process_pipe_t* process;
+	int fd;
+
+	volatile bool failed; // Until the next segment
+	volatile long dropped;
+	uint64_t written_bytes;
+};
+
+struct cso_sinks {
+	DARRAY(struct cso_sink*) sinks;
+	size_t max_queued_bytes; // Per sink
+	struct cso_packet_pool* packet_pool;
+	struct cso_cpu* cpu; // Sink threads count as writers
+};
+
+// Starts a thread for every sink in spec. Sinks that fail to parse are
+// skipped with a warning.
+void cso_sinks_start(struct cso_sinks* sinks, const char* spec,
+		     int buffer_mb, struct cso_packet_pool* packet_pool,
+		     struct cso_cpu* cpu);
+// Writes out everything still queued before returning
+void cso_sinks_stop(struct cso_sinks* sinks);
+
+// Has every sink finish its current stream and start one for context's file.
+// Call after cso_muxer_open, it copies the stream's parameters.
+void cso_sinks_begin_segment(struct cso_sinks* sinks,
+			     const struct ffmpeg_context* context);
+// Queues a new reference to packet, still in the encoder's time base
+void cso_sinks_push(struct cso_sinks* sinks, const AVPacket* packet);
@@ -0,0 +1,100 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-stamp.h"
+#include "cordyceps-stalk-kernels.h"
+#include <plugin-support.h>
+#include <libavutil/pixdesc.h>
+
+bool cso_stamp_init(struct cso_stamp* stamp, int cell_size,
+		    enum AVPixelFormat format, int width, int height)
+{
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(format);
+
+	*stamp = (struct cso_stamp) {0};
+
+	if (!desc || (desc->flags & AV_PIX_FMT_FLAG_RGB)
+	    || desc->comp[0].plane != 0 || desc->comp[0].offset != 0
+	    || desc->comp[0].step != (desc->comp[0].depth > 8 ? 2 : 1)) {
+		obs_log(LOG_WARNING, "Frame stamps aren't supported for this "
+				     "video format");
+		return false;
+	}
+
+	if (cell_size < 1 || cell_size > CSO_STAMP_MAX_CELL_SIZE
+	    || cell_size * CSO_STAMP_CELLS > width || cell_size > height) {
+		obs_log(LOG_WARNING, "Frame stamp cell size %d doesn't fit "
+				     "the %dx%d frame",
+			cell_size, width, height);
+		return false;
+	}
+
+	stamp->enabled = true;
+	stamp->cell_size = cell_size;
+	stamp->depth = desc->comp[0].depth;
+	stamp->shift = desc->comp[0].shift;
+
+	return true;
+}
+
+int cso_stamp_height(const struct cso_stamp* stamp)
+{
+	return stamp->enabled ? (stamp->cell_size + 1) & ~1 : 0;
+}
+
+// Same as cso_cell_bits for 10-bit samples, which are rare enough to not need
+// a vector version
+static uint32_t cell_bits_16(const struct cso_stamp* stamp,
+			     const uint16_t* src)
+{
+	uint32_t threshold = (uint32_t) stamp->cell_size
+			     << (stamp->depth - 1);
+	uint32_t bits = 0;
+
+	for (int cell = 0; cell < CSO_STAMP_CELLS; cell++) {
+		const uint16_t* run = src + cell * stamp->cell_size;
+		uint32_t sum = 0;
+
+		for (int x = 0; x < stamp->cell_size; x++)
+			sum += run[x] >> stamp->shift;
+
+		if (sum >= threshold) bits |= 1u << cell;
+	}
+
+	return bits;
+}
+
+bool cso_stamp_read(const struct cso_stamp* stamp,
+		    const struct video_data* frame, uint32_t* id)
+{
+	const uint8_t* row = frame->data[0]
+			     + (size_t) (stamp->cell_size / 2)
+				       * frame->linesize[0];
+
+	uint32_t bits = stamp->depth > 8
+				? cell_bits_16(stamp, (const uint16_t*) row)
+				: cso_cell_bits(row, stamp->cell_size,
+						CSO_STAMP_CELLS);
+
+	uint16_t value = (uint16_t) bits;
+	uint16_t check = (uint16_t) (bits >> 16);
+	if ((value ^ check) != 0xFFFF) return false;
+
+	*id = value;
+	return true;
+}
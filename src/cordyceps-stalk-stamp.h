@@ -0,0 +1,68 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Frame ID stamps, for matching encoded frames to the mod's frame requests
+// exactly. The mod draws a row of CSO_STAMP_CELLS square cells, cell_size
+// pixels each, into the top-left corner of every frame it presents: black for
+// a 0 bit, white for a 1 bit, least significant bit leftmost. The low 16 bits
+// are a frame counter that changes with every presented frame, the high 16
+// bits its complement, which tells a stamp apart from whatever the game drew
+// there.
+//
+// A frame whose stamp matches the last one encoded is a repeat of it, which
+// is skipped without using up a requested frame, in realtime mode too. Frames
+// without a valid stamp are gated as if stamps were off.
+//
+// Only luma is read, along the middle row of the cells, so the stamp survives
+// chroma subsampling and a bit of scaling. Planar and semi-planar YUV formats
+// are supported, not RGB or packed YUV.
+
+#pragma once
+
+#include <obs-module.h>
+#include <libavutil/pixfmt.h>
+
+#define CSO_STAMP_CELLS 32
+#define CSO_STAMP_DEFAULT_CELL_SIZE 8
+#define CSO_STAMP_MAX_CELL_SIZE 256
+
+struct cso_stamp {
+	bool enabled;
+	int cell_size;
+	int depth; // Luma bits per sample
+	int shift; // Where those bits sit in a 16-bit sample
+
+	// Video thread only
+	bool have_last;
+	uint32_t last_id;
+
+	volatile long stale;
+	volatile long unreadable;
+};
+
+// Enables reading stamps if the format and frame size allow them
+bool cso_stamp_init(struct cso_stamp* stamp, int cell_size,
+		    enum AVPixelFormat format, int width, int height);
+
+// Rows at the top of the frame the stamp covers, rounded up to whole chroma
+// rows so it can be cropped away
+int cso_stamp_height(const struct cso_stamp* stamp);
+
+// Returns false if the frame has no valid stamp
+bool cso_stamp_read(const struct cso_stamp* stamp,
+		    const struct video_data* frame, uint32_t* id);
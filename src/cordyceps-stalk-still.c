@@ -0,0 +1,282 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-still.h"
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+
+enum cso_still_format cso_still_format_from_string(const char* name)
+{
+	if (name && strcmp(name, "webp") == 0) return CSO_STILL_WEBP;
+
+	return CSO_STILL_PNG;
+}
+
+static const AVCodec* find_still_encoder(enum cso_still_format format)
+{
+	if (format == CSO_STILL_WEBP)
+		return avcodec_find_encoder_by_name("libwebp");
+
+	return avcodec_find_encoder(AV_CODEC_ID_PNG);
+}
+
+static enum AVPixelFormat still_pix_fmt(enum cso_still_format format,
+					const AVFrame* frame)
+{
+	if (format == CSO_STILL_WEBP) return AV_PIX_FMT_RGB32;
+
+	// Keep the extra precision of HDR recordings
+	const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+	if (desc && desc->comp[0].depth > 8) return AV_PIX_FMT_RGB48BE;
+
+	return AV_PIX_FMT_RGB24;
+}
+
+static int sws_colorspace(enum AVColorSpace colorspace)
+{
+	switch (colorspace) {
+	case AVCOL_SPC_BT709:
+		return SWS_CS_ITU709;
+	case AVCOL_SPC_BT2020_NCL:
+		return SWS_CS_BT2020;
+	default:
+		return SWS_CS_ITU601;
+	}
+}
+
+static AVFrame* convert_to_rgb(struct SwsContext** sws, const AVFrame* frame,
+			       enum AVPixelFormat format)
+{
+	*sws = sws_getCachedContext(*sws, frame->width, frame->height,
+				    frame->format, frame->width, frame->height,
+				    format,
+				    SWS_BICUBIC | SWS_FULL_CHR_H_INT
+					    | SWS_ACCURATE_RND,
+				    NULL, NULL, NULL);
+	if (!*sws) return NULL;
+
+	if (frame->colorspace != AVCOL_SPC_RGB) {
+		const int* coefficients =
+			sws_getCoefficients(sws_colorspace(frame->colorspace));
+
+		sws_setColorspaceDetails(*sws, coefficients,
+					 frame->color_range == AVCOL_RANGE_JPEG,
+					 coefficients, 1, 0, 1 << 16, 1 << 16);
+	}
+
+	AVFrame* rgb = av_frame_alloc();
+	rgb->format = format;
+	rgb->width = frame->width;
+	rgb->height = frame->height;
+
+	if (av_frame_get_buffer(rgb, 0) < 0) {
+		av_frame_free(&rgb);
+		return NULL;
+	}
+
+	sws_scale(*sws, (const uint8_t* const*) frame->data, frame->linesize, 0,
+		  frame->height, rgb->data, rgb->linesize);
+
+	return rgb;
+}
+
+static bool write_still(struct cso_still_pool* pool, struct SwsContext** sws,
+			const AVFrame* frame, const char* path)
+{
+	const AVCodec* codec = find_still_encoder(pool->format);
+	AVCodecContext* ctx = NULL;
+	AVPacket* packet = NULL;
+	FILE* file = NULL;
+	bool success = false;
+
+	AVFrame* rgb = convert_to_rgb(sws, frame,
+				      still_pix_fmt(pool->format, frame));
+	if (!rgb) goto fail;
+
+	ctx = avcodec_alloc_context3(codec);
+	ctx->width = rgb->width;
+	ctx->height = rgb->height;
+	ctx->pix_fmt = rgb->format;
+	ctx->time_base = (AVRational){1, 1};
+
+	if (pool->format == CSO_STILL_WEBP)
+		av_opt_set_int(ctx->priv_data, "lossless", 1, 0);
+
+	if (avcodec_open2(ctx, codec, NULL) < 0) goto fail;
+
+	packet = av_packet_alloc();
+	if (avcodec_send_frame(ctx, rgb) < 0
+	    || avcodec_receive_packet(ctx, packet) < 0)
+		goto fail;
+
+	file = os_fopen(path, "wb");
+	if (!file) goto fail;
+
+	success = fwrite(packet->data, 1, packet->size, file)
+		  == (size_t) packet->size;
+
+fail:
+	if (file) fclose(file);
+	av_packet_free(&packet);
+	avcodec_free_context(&ctx);
+	av_frame_free(&rgb);
+
+	return success;
+}
+
+static void* still_thread(void* data)
+{
+	struct cso_still_pool* pool = data;
+	struct SwsContext* sws = NULL;
+
+	for (;;) {
+		os_sem_wait(pool->semaphore);
+
+		struct cso_still_job job = {0};
+		bool stop = false;
+
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->jobs.num) {
+			job = pool->jobs.array[0];
+			da_erase(pool->jobs, 0);
+		} else {
+			stop = pool->stopping;
+		}
+		pthread_mutex_unlock(&pool->mutex);
+
+		if (stop) break;
+		if (!job.frame) continue;
+
+		if (write_still(pool, &sws, job.frame, job.path)) {
+			os_atomic_inc_long(&pool->written);
+		} else {
+			obs_log(LOG_WARNING, "Failed to write still \"%s\"",
+				job.path);
+			os_atomic_inc_long(&pool->failed);
+		}
+
+		av_frame_free(&job.frame);
+		bfree(job.path);
+	}
+
+	sws_freeContext(sws);
+	return NULL;
+}
+
+bool cso_still_pool_start(struct cso_still_pool* pool,
+			  enum cso_still_format format)
+{
+	memset(pool, 0, sizeof(struct cso_still_pool));
+
+	if (!find_still_encoder(format)) {
+		obs_log(LOG_WARNING, "No encoder for the requested still "
+				     "format, writing PNG instead");
+		format = CSO_STILL_PNG;
+	}
+
+	pool->format = format;
+	pthread_mutex_init(&pool->mutex, NULL);
+	os_sem_init(&pool->semaphore, 0);
+	da_init(pool->jobs);
+
+	for (int i = 0; i < CSO_STILL_THREADS; i++) {
+		if (pthread_create(&pool->threads[i], NULL, still_thread, pool)
+		    != 0)
+			break;
+		pool->thread_count++;
+	}
+
+	if (!pool->thread_count) {
+		obs_log(LOG_WARNING, "Failed to create still threads; stills "
+				     "are disabled");
+		cso_still_pool_stop(pool);
+		return false;
+	}
+
+	return true;
+}
+
+void cso_still_pool_stop(struct cso_still_pool* pool)
+{
+	if (!pool->semaphore) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stopping = true;
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (int i = 0; i < pool->thread_count; i++)
+		os_sem_post(pool->semaphore);
+	for (int i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	// Only left over if no thread could be started
+	for (size_t i = 0; i < pool->jobs.num; i++) {
+		av_frame_free(&pool->jobs.array[i].frame);
+		bfree(pool->jobs.array[i].path);
+	}
+	da_free(pool->jobs);
+
+	os_sem_destroy(pool->semaphore);
+	pthread_mutex_destroy(&pool->mutex);
+
+	pool->semaphore = NULL;
+	pool->thread_count = 0;
+}
+
+bool cso_still_pool_submit(struct cso_still_pool* pool, const AVFrame* frame,
+			   const char* media_path, int64_t frame_number)
+{
+	if (!pool->thread_count) return false;
+
+	pthread_mutex_lock(&pool->mutex);
+	bool full = pool->jobs.num >= CSO_STILL_MAX_QUEUED;
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (full) {
+		os_atomic_inc_long(&pool->dropped);
+		return false;
+	}
+
+	struct dstr path;
+	dstr_init(&path);
+	dstr_printf(&path, "%s.%06lld.%s", media_path, (long long) frame_number,
+		    pool->format == CSO_STILL_WEBP ? "webp" : "png");
+
+	struct cso_still_job job = {
+		.frame = av_frame_clone(frame),
+		.path = path.array,
+	};
+
+	if (!job.frame) {
+		dstr_free(&path);
+		os_atomic_inc_long(&pool->dropped);
+		return false;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	da_push_back(pool->jobs, &job);
+	pthread_mutex_unlock(&pool->mutex);
+
+	os_sem_post(pool->semaphore);
+	return true;
+}
@@ -0,0 +1,73 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Lossless still export. The video thread only takes a reference to the frame
+// it's about to encode; colour conversion, compression and the file write all
+// happen on a small pool of worker threads. Stills are written next to the
+// recording as "<file>.<frame>.png" (or .webp), with the same frame numbering
+// as the seek index.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <libavutil/frame.h>
+
+#define CSO_STILL_THREADS 2
+
+// Stills past this many waiting are dropped instead of piling up frames
+#define CSO_STILL_MAX_QUEUED 8
+
+enum cso_still_format {
+	CSO_STILL_PNG,
+	CSO_STILL_WEBP, // Lossless, needs FFmpeg built with libwebp
+};
+
+struct cso_still_job {
+	AVFrame* frame;
+	char* path;
+};
+
+struct cso_still_pool {
+	pthread_t threads[CSO_STILL_THREADS];
+	int thread_count;
+
+	pthread_mutex_t mutex;
+	os_sem_t* semaphore;
+	DARRAY(struct cso_still_job) jobs;
+	bool stopping;
+
+	enum cso_still_format format;
+
+	volatile long written;
+	volatile long dropped;
+	volatile long failed;
+};
+
+enum cso_still_format cso_still_format_from_string(const char* name);
+
+bool cso_still_pool_start(struct cso_still_pool* pool,
+			  enum cso_still_format format);
+// Writes out everything still queued before returning
+void cso_still_pool_stop(struct cso_still_pool* pool);
+
+// Takes a new reference to frame, so the caller can keep using it. Copying
+// only happens if the caller writes to the frame while the still is pending.
+bool cso_still_pool_submit(struct cso_still_pool* pool, const AVFrame* frame,
+			   const char* media_path, int64_t frame_number);
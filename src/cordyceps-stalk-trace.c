@@ -0,0 +1,138 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#include "cordyceps-stalk-trace.h"
+#include <plugin-support.h>
+
+static const char* thread_names[CSO_TRACE_THREAD_COUNT] = {
+	"video",
+	"write",
+};
+
+void cso_trace_start(struct cso_trace* trace)
+{
+	cso_trace_free(trace);
+
+	trace->start_ns = os_gettime_ns();
+	trace->enabled = true;
+}
+
+void cso_trace_free(struct cso_trace* trace)
+{
+	for (int i = 0; i < CSO_TRACE_THREAD_COUNT; i++) {
+		struct cso_trace_chunk* chunk = trace->buffers[i].head;
+
+		while (chunk) {
+			struct cso_trace_chunk* next = chunk->next;
+			bfree(chunk);
+			chunk = next;
+		}
+	}
+
+	memset(trace, 0, sizeof(struct cso_trace));
+}
+
+void cso_trace_record(struct cso_trace* trace, enum cso_trace_thread thread,
+		      const char* name, uint64_t begin_ns, int64_t frame)
+{
+	struct cso_trace_buffer* buffer = &trace->buffers[thread];
+	struct cso_trace_chunk* chunk = buffer->tail;
+
+	// Chunks are only ever appended by the owning thread, so growing the
+	// buffer doesn't need to synchronize with anyone
+	if (!chunk || chunk->count == CSO_TRACE_CHUNK_EVENTS) {
+		struct cso_trace_chunk* new_chunk =
+			bmalloc(sizeof(struct cso_trace_chunk));
+		new_chunk->next = NULL;
+		new_chunk->count = 0;
+
+		if (chunk) chunk->next = new_chunk;
+		else buffer->head = new_chunk;
+
+		buffer->tail = chunk = new_chunk;
+	}
+
+	struct cso_trace_event* event = &chunk->events[chunk->count++];
+	event->name = name;
+	event->begin_ns = begin_ns;
+	event->end_ns = os_gettime_ns();
+	event->frame = frame;
+}
+
+// Writes the recorded events in the Chrome trace event format, which both
+// chrome://tracing and Perfetto can open directly.
+bool cso_trace_write(struct cso_trace* trace, const char* path)
+{
+	if (!trace->enabled) return true;
+
+	FILE* file = os_fopen(path, "wb");
+	if (!file) {
+		obs_log(LOG_WARNING, "Failed to open trace file \"%s\"", path);
+		return false;
+	}
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (int i = 0; i < CSO_TRACE_THREAD_COUNT; i++) {
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+			      "\"pid\":1,\"tid\":%d,"
+			      "\"args\":{\"name\":\"%s\"}}",
+			i ? ",\n" : "", i + 1, thread_names[i]);
+	}
+
+	size_t total_events = 0;
+
+	for (int i = 0; i < CSO_TRACE_THREAD_COUNT; i++) {
+		struct cso_trace_chunk* chunk = trace->buffers[i].head;
+
+		for (; chunk; chunk = chunk->next) {
+			for (size_t e = 0; e < chunk->count; e++) {
+				struct cso_trace_event* event =
+					&chunk->events[e];
+
+				double ts = (double) (event->begin_ns
+						      - trace->start_ns)
+					    / 1000.0;
+				double dur = (double) (event->end_ns
+						       - event->begin_ns)
+					     / 1000.0;
+
+				fprintf(file, ",\n{\"name\":\"%s\","
+					      "\"cat\":\"cso\",\"ph\":\"X\","
+					      "\"ts\":%.3f,\"dur\":%.3f,"
+					      "\"pid\":1,\"tid\":%d,"
+					      "\"args\":{\"frame\":%lld}}",
+					event->name, ts, dur, i + 1,
+					(long long) event->frame);
+			}
+
+			total_events += chunk->count;
+		}
+	}
+
+	fprintf(file, "\n]}\n");
+
+	bool success = ferror(file) == 0;
+	fclose(file);
+
+	if (success) obs_log(LOG_INFO, "Wrote %zu trace events to \"%s\"",
+			     total_events, path);
+	else obs_log(LOG_WARNING, "Failed to write trace file \"%s\"", path);
+
+	return success;
+}
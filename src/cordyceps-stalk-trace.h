@@ -0,0 +1,80 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Opt-in per-frame pipeline tracing. Every thread that records events owns
+// exactly one buffer, so recording needs no locks or atomics; buffers are only
+// read back once all of their writers have stopped.
+
+#pragma once
+
+#include <obs-module.h>
+#include <util/platform.h>
+
+#define CSO_TRACE_CHUNK_EVENTS 4096
+
+// One slot per pipeline thread. Each slot must only ever be written from the
+// thread it is named after.
+enum cso_trace_thread {
+	CSO_TRACE_THREAD_VIDEO,
+	CSO_TRACE_THREAD_WRITE,
+	CSO_TRACE_THREAD_COUNT
+};
+
+struct cso_trace_event {
+	const char* name; // Must be a string literal, it is not copied
+	uint64_t begin_ns;
+	uint64_t end_ns;
+	int64_t frame;
+};
+
+struct cso_trace_chunk {
+	struct cso_trace_chunk* next;
+	size_t count;
+	struct cso_trace_event events[CSO_TRACE_CHUNK_EVENTS];
+};
+
+struct cso_trace_buffer {
+	struct cso_trace_chunk* head;
+	struct cso_trace_chunk* tail;
+};
+
+struct cso_trace {
+	bool enabled;
+	uint64_t start_ns;
+	struct cso_trace_buffer buffers[CSO_TRACE_THREAD_COUNT];
+};
+
+void cso_trace_start(struct cso_trace* trace);
+void cso_trace_free(struct cso_trace* trace);
+bool cso_trace_write(struct cso_trace* trace, const char* path);
+void cso_trace_record(struct cso_trace* trace, enum cso_trace_thread thread,
+		      const char* name, uint64_t begin_ns, int64_t frame);
+
+// Returns 0 when tracing is disabled, which cso_trace_end() treats as "don't
+// record", so a disabled trace costs one branch per stage.
+static inline uint64_t cso_trace_begin(const struct cso_trace* trace)
+{
+	return trace->enabled ? os_gettime_ns() : 0;
+}
+
+static inline void cso_trace_end(struct cso_trace* trace,
+				 enum cso_trace_thread thread, const char* name,
+				 uint64_t begin_ns, int64_t frame)
+{
+	if (begin_ns) cso_trace_record(trace, thread, name, begin_ns, frame);
+}
@@ -19,24 +19,31 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 // Acronym notes:
 // csv = "cordyceps stalk vendor"
 // cso = "cordyceps stalk output"
+// cse = "cordyceps stalk encoded (output)"
 // csvr = "cordyceps stalk vendor request"
 // csvc = "cordyceps stalk vendor callback"
 
 #include <obs-module.h>
 #include <plugin-support.h>
 #include "include/obs-websocket-api.h"
+#include "cordyceps-stalk-shm.h"
+#include "cordyceps-stalk-sink.h"
+#include "cordyceps-stalk-stamp.h"
 
 OBS_DECLARE_MODULE()
 OBS_MODULE_USE_DEFAULT_LOCALE(PLUGIN_NAME, "en-US")
 
 obs_websocket_vendor csv;
 obs_output_t* cso;
+obs_output_t* cse;
 
 extern struct obs_output_info cordyceps_stalk_output;
+extern struct obs_output_info cordyceps_stalk_encoded_output;
 
 bool obs_module_load()
 {
 	obs_register_output(&cordyceps_stalk_output);
+	obs_register_output(&cordyceps_stalk_encoded_output);
 
 	obs_log(LOG_INFO, "plugin loaded successfully (version %s)",
 		PLUGIN_VERSION);
@@ -45,6 +52,7 @@ bool obs_module_load()
 
 void csvc_record_start_success(void* data, calldata_t* cd);
 void csvc_record_start_fail(void* data, calldata_t* cd);
+void csvc_pacing_update(void* data, calldata_t* cd);
 void csvr_status(obs_data_t* request, obs_data_t* response, void* priv);
 void csvr_update_settings(obs_data_t* request, obs_data_t* response,
 			  void* priv);
@@ -56,23 +64,89 @@ void csvr_set_realtime_mode(obs_data_t* request, obs_data_t* response,
 			    void* priv);
 void csvr_request_frames(obs_data_t* request, obs_data_t* response,
 			 void* priv);
+void csvr_force_keyframe(obs_data_t* request, obs_data_t* response,
+			 void* priv);
+void csvr_capture_still(obs_data_t* request, obs_data_t* response,
+			void* priv);
+void csvr_calibrate(obs_data_t* request, obs_data_t* response, void* priv);
+void csvr_begin_take(obs_data_t* request, obs_data_t* response, void* priv);
+void csvr_end_take(obs_data_t* request, obs_data_t* response, void* priv);
 
 void obs_module_post_load()
 {
 	obs_data_t* cso_settings = obs_data_create();
 	obs_data_set_string(cso_settings, "dirpath", "C:/cordyceps/");
+	// "h264", "hevc", "av1" or "vp9"
+	obs_data_set_string(cso_settings, "codec", "h264");
+	obs_data_set_int(cso_settings, "threads", 0);
 	obs_data_set_int(cso_settings, "gop_size", 120);
+	obs_data_set_string(cso_settings, "rate_control", "crf");
 	obs_data_set_double(cso_settings, "crf", 23.0);
+	obs_data_set_int(cso_settings, "bitrate", 25000);
+	obs_data_set_int(cso_settings, "max_bitrate", 0);
+	obs_data_set_int(cso_settings, "buffer_size", 0);
 	obs_data_set_string(cso_settings, "preset", "veryfast");
+	// Trades compression for packets coming out as soon as frames go in,
+	// for request_frames loops that wait on their frames
+	obs_data_set_bool(cso_settings, "low_latency", false);
+	obs_data_set_bool(cso_settings, "trace", false);
+	// Applied when a recording starts, not to one already running
+	obs_data_set_int(cso_settings, "accumulate_frames", 1);
+	obs_data_set_string(cso_settings, "shutter_weights", "");
+	obs_data_set_int(cso_settings, "still_interval", 0);
+	obs_data_set_string(cso_settings, "still_format", "png");
+	obs_data_set_bool(cso_settings, "raw_dump", false);
+	// "obs" or "shm", see cordyceps-stalk-shm.h
+	obs_data_set_string(cso_settings, "ingest_source", "obs");
+	obs_data_set_string(cso_settings, "shm_name", CSO_SHM_DEFAULT_NAME);
+	// Encoded area of the canvas; a zero size means up to the edge
+	obs_data_set_int(cso_settings, "crop_x", 0);
+	obs_data_set_int(cso_settings, "crop_y", 0);
+	obs_data_set_int(cso_settings, "crop_width", 0);
+	obs_data_set_int(cso_settings, "crop_height", 0);
+	// Nearest-neighbour upscale of that area by a whole factor up to 4,
+	// done while ingesting so OBS can run at the game's native size
+	obs_data_set_int(cso_settings, "upscale", 1);
+	// Extra destinations for the encoded video, see cordyceps-stalk-sink.h
+	obs_data_set_string(cso_settings, "sinks", "");
+	// Only accept frames between begin_take and end_take
+	obs_data_set_bool(cso_settings, "session_mode", false);
+	obs_data_set_int(cso_settings, "sink_buffer_mb",
+			 CSO_SINK_DEFAULT_BUFFER_MB);
+	// CPU lists like "0-3,8" for each group of threads, empty to leave
+	// them wherever the OS puts them. cpu_budget caps encoder threads at a
+	// percentage of the machine's CPUs, 0 for no cap.
+	obs_data_set_string(cso_settings, "encoder_affinity", "");
+	obs_data_set_string(cso_settings, "writer_affinity", "");
+	obs_data_set_string(cso_settings, "ingest_affinity", "");
+	obs_data_set_int(cso_settings, "thread_nice", 0);
+	obs_data_set_int(cso_settings, "cpu_budget", 0);
+	// Name of an OBS video encoder to record from instead of encoding
+	// here, see cordyceps-stalk-encoded.h. The encoder settings above
+	// don't apply then.
+	obs_data_set_string(cso_settings, "shared_encoder", "");
+	// Only encode frames with a new ID stamped in by the mod, see
+	// cordyceps-stalk-stamp.h
+	obs_data_set_bool(cso_settings, "frame_stamp", false);
+	obs_data_set_int(cso_settings, "frame_stamp_cell_size",
+			 CSO_STAMP_DEFAULT_CELL_SIZE);
+	obs_data_set_bool(cso_settings, "frame_stamp_crop", true);
 
 	cso = obs_output_create("cordyceps-stalk-output",
 				"cordyceps_stalk_main", cso_settings, NULL);
+	cse = obs_output_create("cordyceps-stalk-encoded-output",
+				"cordyceps_stalk_encoded", NULL, NULL);
 
 	csv = obs_websocket_register_vendor("cordyceps_stalk");
 
 	signal_handler_t* sh = obs_output_get_signal_handler(cso);
 	signal_handler_connect(sh, "activate", csvc_record_start_success, &csv);
 	signal_handler_connect(sh, "stop", csvc_record_start_fail, &csv);
+	signal_handler_connect(sh, "pacing", csvc_pacing_update, &csv);
+
+	sh = obs_output_get_signal_handler(cse);
+	signal_handler_connect(sh, "activate", csvc_record_start_success, &csv);
+	signal_handler_connect(sh, "stop", csvc_record_start_fail, &csv);
 
 	obs_websocket_vendor_register_request(csv, "update_settings",
 					      csvr_update_settings, cso);
@@ -84,8 +158,18 @@ void obs_module_post_load()
 					      csvr_set_realtime_mode, cso);
 	obs_websocket_vendor_register_request(csv, "request_frames",
 					      csvr_request_frames, cso);
-
-	obs_websocket_vendor_register_request(csv, "status", csvr_status, NULL);
+	obs_websocket_vendor_register_request(csv, "force_keyframe",
+					      csvr_force_keyframe, cso);
+	obs_websocket_vendor_register_request(csv, "capture_still",
+					      csvr_capture_still, cso);
+	obs_websocket_vendor_register_request(csv, "calibrate", csvr_calibrate,
+					      cso);
+	obs_websocket_vendor_register_request(csv, "begin_take",
+					      csvr_begin_take, cso);
+	obs_websocket_vendor_register_request(csv, "end_take", csvr_end_take,
+					      cso);
+
+	obs_websocket_vendor_register_request(csv, "status", csvr_status, cso);
 }
 
 void csvc_record_start_success(void* data, calldata_t* cd)
@@ -112,14 +196,135 @@ void csvc_record_start_fail(void* data, calldata_t* cd)
 	}
 }
 
+static void set_pacing(obs_data_t* pacing, calldata_t* cd)
+{
+	obs_data_set_int(pacing, "batch", calldata_int(cd, "batch"));
+	obs_data_set_int(pacing, "window", calldata_int(cd, "window"));
+	obs_data_set_double(pacing, "encode_fps", calldata_float(cd, "fps"));
+	obs_data_set_double(pacing, "latency_ms",
+			    calldata_float(cd, "latency_ms"));
+	obs_data_set_double(pacing, "encode_latency_ms",
+			    calldata_float(cd, "encode_latency_ms"));
+	obs_data_set_int(pacing, "frames_in_flight",
+			 calldata_int(cd, "frames_in_flight"));
+}
+
+// Sent from the video thread, at most once a second, when the recommended
+// request_frames sizing changes
+void csvc_pacing_update(void* data, calldata_t* cd)
+{
+	obs_websocket_vendor* vendor = data;
+
+	obs_data_t* event = obs_data_create();
+	set_pacing(event, cd);
+	obs_websocket_vendor_emit_event(*vendor, "pacing_update", event);
+	obs_data_release(event);
+}
+
+static bool uses_shared_encoder(obs_output_t* output)
+{
+	obs_data_t* settings = obs_output_get_settings(output);
+	const char* name = obs_data_get_string(settings, "shared_encoder");
+	bool shared = name && *name;
+	obs_data_release(settings);
+
+	return shared;
+}
+
+// The output that's recording, or the one start_recording would start. Frame
+// requests and stops go to it.
+static obs_output_t* recording_output(obs_output_t* output)
+{
+	if (obs_output_active(cse)) return cse;
+	if (obs_output_active(output)) return output;
+
+	return uses_shared_encoder(output) ? cse : output;
+}
+
 void csvr_status(obs_data_t* request, obs_data_t* response, void* priv)
 {
 	UNUSED_PARAMETER(request);
-	UNUSED_PARAMETER(priv);
+
+	obs_output_t* output = priv;
 
 	obs_log(LOG_INFO, "Cordyceps-stalk status requested");
 
 	obs_data_set_bool(response, "active", true);
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+
+	proc_handler_call(ph, "get_direct_ingest", cd);
+	bool direct = calldata_bool(cd, "active");
+
+	bool shared = obs_output_active(cse);
+
+	obs_data_set_bool(response, "recording",
+			  obs_output_active(output) || direct || shared);
+	obs_data_set_bool(response, "shared_encoder", shared);
+	obs_data_set_string(response, "ingest_source", direct ? "shm" : "obs");
+
+	// Heap allocation counters for the current (or last) recording. Once
+	// warmed up, none of these should keep growing.
+	proc_handler_call(ph, "get_alloc_stats", cd);
+
+	obs_data_t* allocations = obs_data_create();
+	obs_data_set_int(allocations, "packet_allocs",
+			 calldata_int(cd, "packet_allocs"));
+	obs_data_set_int(allocations, "packet_reuses",
+			 calldata_int(cd, "packet_reuses"));
+	obs_data_set_int(allocations, "buffer_allocs",
+			 calldata_int(cd, "buffer_allocs"));
+	obs_data_set_int(allocations, "buffer_oversize",
+			 calldata_int(cd, "buffer_oversize"));
+	obs_data_set_int(allocations, "arena_blocks",
+			 calldata_int(cd, "arena_blocks"));
+	obs_data_set_obj(response, "allocations", allocations);
+	obs_data_release(allocations);
+
+	// How many frames the mod should ask for at a time, and how many it
+	// should keep outstanding
+	proc_handler_call(ph, "get_pacing", cd);
+
+	obs_data_t* pacing = obs_data_create();
+	set_pacing(pacing, cd);
+	obs_data_set_obj(response, "pacing", pacing);
+	obs_data_release(pacing);
+
+	proc_handler_call(ph, "get_take", cd);
+
+	obs_data_t* take = obs_data_create();
+	obs_data_set_bool(take, "session", calldata_bool(cd, "session"));
+	obs_data_set_bool(take, "active", calldata_bool(cd, "active"));
+	obs_data_set_int(take, "take", calldata_int(cd, "take"));
+	obs_data_set_obj(response, "take", take);
+	obs_data_release(take);
+
+	// CPU time used by the recording's threads, to check it stays within
+	// its placement and budget
+	proc_handler_call(ph, "get_cpu_usage", cd);
+
+	obs_data_t* cpu = obs_data_create();
+	obs_data_set_int(cpu, "encoder_ms", calldata_int(cd, "encoder_ms"));
+	obs_data_set_int(cpu, "writer_ms", calldata_int(cd, "writer_ms"));
+	obs_data_set_int(cpu, "ingest_ms", calldata_int(cd, "ingest_ms"));
+	obs_data_set_int(cpu, "encoder_threads",
+			 calldata_int(cd, "encoder_threads"));
+	obs_data_set_double(cpu, "percent", calldata_float(cd, "percent"));
+	obs_data_set_obj(response, "cpu", cpu);
+	obs_data_release(cpu);
+
+	// Frames skipped because the game hadn't presented a new one yet
+	proc_handler_call(ph, "get_frame_stamp", cd);
+
+	obs_data_t* stamp = obs_data_create();
+	obs_data_set_bool(stamp, "enabled", calldata_bool(cd, "enabled"));
+	obs_data_set_int(stamp, "last_id", calldata_int(cd, "last_id"));
+	obs_data_set_int(stamp, "stale", calldata_int(cd, "stale"));
+	obs_data_set_int(stamp, "unreadable", calldata_int(cd, "unreadable"));
+	obs_data_set_obj(response, "frame_stamp", stamp);
+	obs_data_release(stamp);
+
+	calldata_destroy(cd);
 }
 
 void csvr_update_settings(obs_data_t* request, obs_data_t* response,
@@ -130,17 +335,59 @@ void csvr_update_settings(obs_data_t* request, obs_data_t* response,
 	obs_output_t* output = priv;
 
 	const char* dirpath = obs_data_get_string(request, "dirpath");
+	const char* codec = obs_data_get_string(request, "codec");
 	int gop_size = (int) obs_data_get_int(request, "gop_size");
+	const char* rate_control = obs_data_get_string(request,
+						       "rate_control");
 	double crf = obs_data_get_double(request, "crf");
+	int bitrate = (int) obs_data_get_int(request, "bitrate");
 	const char* preset = obs_data_get_string(request, "preset");
+	int accumulate_frames = (int) obs_data_get_int(request,
+						       "accumulate_frames");
+	const char* shutter_weights = obs_data_get_string(request,
+							  "shutter_weights");
 
 	obs_log(LOG_INFO, "Got settings update request: dirpath = \"%s\", "
-			  "gop_size = %d, crf = %f, preset = \"%s\"",
-		dirpath, gop_size, crf, preset);
-
+			  "codec = \"%s\", gop_size = %d, "
+			  "rate_control = \"%s\", crf = %f, "
+			  "bitrate = %d, preset = \"%s\", "
+			  "accumulate_frames = %d, shutter_weights = \"%s\"",
+		dirpath, codec, gop_size, rate_control, crf, bitrate, preset,
+		accumulate_frames, shutter_weights);
+
+	// If recording, the output applies this to the running encoder when
+	// it can and switches to a new file when it can't
 	obs_output_update(output, request);
 }
 
+// Attaches the encoded output to the OBS encoder named in shared_encoder and
+// starts it. Unlike the regular output, it's running once this returns true.
+static bool start_shared(obs_output_t* output)
+{
+	if (obs_output_active(output)) return false;
+
+	obs_data_t* settings = obs_output_get_settings(output);
+	const char* name = obs_data_get_string(settings, "shared_encoder");
+
+	obs_encoder_t* encoder = obs_get_encoder_by_name(name);
+	if (!encoder || obs_encoder_get_type(encoder) != OBS_ENCODER_VIDEO) {
+		obs_log(LOG_WARNING, "Cordyceps-stalk can't share encoder "
+				     "\"%s\"; no video encoder by that name",
+			name);
+		obs_encoder_release(encoder);
+		obs_data_release(settings);
+		return false;
+	}
+
+	// Only dirpath matters to it
+	obs_output_update(cse, settings);
+	obs_output_set_video_encoder(cse, encoder);
+	obs_encoder_release(encoder);
+	obs_data_release(settings);
+
+	return obs_output_start(cse);
+}
+
 // Note that a 'true' return from obs_output_start() does NOT actually mean
 // that the output started successfully in this case, since the Cordyceps-stalk
 // output initializes in a thread. A 'true' return just means the thread was
@@ -155,7 +402,8 @@ void csvr_start_recording(obs_data_t* request, obs_data_t* response,
 
 	obs_log(LOG_INFO, "Cordyceps-stalk received record start request");
 
-	bool success = obs_output_start(output);
+	bool success = uses_shared_encoder(output) ? start_shared(output)
+						   : obs_output_start(output);
 
 	obs_data_set_bool(response, "success", success);
 }
@@ -168,7 +416,21 @@ void csvr_stop_recording(obs_data_t* request, obs_data_t* response,
 
 	obs_output_t* output = priv;
 
-	obs_output_stop(output);
+	if (obs_output_active(cse)) {
+		obs_output_stop(cse);
+		return;
+	}
+
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	proc_handler_call(ph, "get_direct_ingest", cd);
+	bool direct = calldata_bool(cd, "active");
+	calldata_destroy(cd);
+
+	// OBS doesn't consider a recording from shared memory active, so a
+	// regular stop would be ignored
+	if (direct) obs_output_force_stop(output);
+	else obs_output_stop(output);
 }
 
 void csvr_set_realtime_mode(obs_data_t* request, obs_data_t* response,
@@ -176,7 +438,7 @@ void csvr_set_realtime_mode(obs_data_t* request, obs_data_t* response,
 {
 	UNUSED_PARAMETER(response);
 
-	obs_output_t* output = priv;
+	obs_output_t* output = recording_output(priv);
 	proc_handler_t* ph = obs_output_get_proc_handler(output);
 	calldata_t* cd = calldata_create();
 	calldata_set_bool(cd, "value", obs_data_get_bool(request, "value"));
@@ -189,7 +451,7 @@ void csvr_request_frames(obs_data_t* request, obs_data_t* response,
 {
 	UNUSED_PARAMETER(response);
 
-	obs_output_t* output = priv;
+	obs_output_t* output = recording_output(priv);
 	proc_handler_t* ph = obs_output_get_proc_handler(output);
 	calldata_t* cd = calldata_create();
 	calldata_set_int(cd, "count", obs_data_get_int(request, "count"));
@@ -197,7 +459,95 @@ void csvr_request_frames(obs_data_t* request, obs_data_t* response,
 	calldata_destroy(cd);
 }
 
+// Makes the next encoded frame an IDR frame. The optional label (e.g. the game
+// event that caused it) ends up next to that keyframe in the seek index.
+void csvr_force_keyframe(obs_data_t* request, obs_data_t* response,
+			 void* priv)
+{
+	UNUSED_PARAMETER(response);
+
+	obs_output_t* output = priv;
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	calldata_set_string(cd, "label", obs_data_get_string(request, "label"));
+	proc_handler_call(ph, "force_keyframe", cd);
+	calldata_destroy(cd);
+}
+
+// The still is taken from the next frame that gets encoded, so in
+// non-realtime mode it needs a frame request to go with it
+void csvr_capture_still(obs_data_t* request, obs_data_t* response,
+			void* priv)
+{
+	UNUSED_PARAMETER(request);
+	UNUSED_PARAMETER(response);
+
+	obs_output_t* output = priv;
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	proc_handler_call(ph, "capture_still", cd);
+	calldata_destroy(cd);
+}
+
+// Blocks for up to a few seconds while a test pattern is encoded with the
+// current settings. Fails while recording.
+void csvr_calibrate(obs_data_t* request, obs_data_t* response, void* priv)
+{
+	UNUSED_PARAMETER(request);
+
+	obs_output_t* output = priv;
+
+	obs_log(LOG_INFO, "Cordyceps-stalk calibration requested");
+
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	proc_handler_call(ph, "calibrate", cd);
+
+	obs_data_set_bool(response, "success", calldata_bool(cd, "success"));
+	obs_data_set_int(response, "frames", calldata_int(cd, "frames"));
+	obs_data_set_double(response, "encode_fps", calldata_float(cd, "fps"));
+	obs_data_set_int(response, "batch", calldata_int(cd, "batch"));
+	obs_data_set_int(response, "window", calldata_int(cd, "window"));
+	obs_data_set_int(response, "frames_in_flight",
+			 calldata_int(cd, "frames_in_flight"));
+
+	calldata_destroy(cd);
+}
+
+// Starts a take in a session mode recording, or moves straight on to the next
+// one if a take is running. The take's first frame is an IDR frame, and the
+// take becomes a chapter of the file, named after the optional "name".
+void csvr_begin_take(obs_data_t* request, obs_data_t* response, void* priv)
+{
+	obs_output_t* output = priv;
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	calldata_set_string(cd, "name", obs_data_get_string(request, "name"));
+	proc_handler_call(ph, "begin_take", cd);
+
+	obs_data_set_bool(response, "success", calldata_bool(cd, "success"));
+	obs_data_set_int(response, "take", calldata_int(cd, "take"));
+
+	calldata_destroy(cd);
+}
+
+// Stops accepting frames until the next take. The encoder and file stay open.
+void csvr_end_take(obs_data_t* request, obs_data_t* response, void* priv)
+{
+	UNUSED_PARAMETER(request);
+
+	obs_output_t* output = priv;
+	proc_handler_t* ph = obs_output_get_proc_handler(output);
+	calldata_t* cd = calldata_create();
+	proc_handler_call(ph, "end_take", cd);
+
+	obs_data_set_bool(response, "success", calldata_bool(cd, "success"));
+
+	calldata_destroy(cd);
+}
+
 void obs_module_unload()
 {
+	obs_output_release(cse);
 	obs_output_release(cso);
 }
@@ -0,0 +1,960 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Encodes a raw dump (see cordyceps-stalk-raw.h) in independent chunks spread
+// over several worker processes, then joins the chunks into one file without
+// re-encoding them. Each chunk is its own encoder session, so it starts with
+// an IDR frame and no frame in it references another chunk.
+//
+// Usage: cordyceps-stalk-chunks [options] <dump.csraw>
+//   -o <file>            Output file, defaults to "<dump>.chunked.mp4"
+//   --spool <dir>        Job directory, defaults to "<dump>.chunks"
+//   --chunk-frames <n>   Frames per chunk, defaults to 8 keyframe intervals
+//   --workers <count>    Local workers to start, defaults to 2. Use 0 when
+//                        only workers on other machines should take jobs.
+//   --retries <count>    Attempts per chunk after the first, defaults to 3
+//   --timeout <seconds>  Requeue a chunk whose worker has been silent this
+//                        long, defaults to 60. Also gives up when no worker
+//                        has made any progress for this long, killing the
+//                        local workers and failing the jobs still running.
+//   --codec, --threads, --preset, --crf, --bitrate, --gop as for
+//                        cordyceps-stalk-replay
+//
+//        cordyceps-stalk-chunks --worker <spool dir>
+//   Takes jobs from a spool directory until the dispatcher is done with it.
+//   Workers on other machines need the spool directory and the dump at the
+//   same paths, e.g. on a network share.
+//
+// The job protocol is plain files in the spool directory:
+//   job-NNNNN.json   What to encode: dump path, first frame, frame count and
+//                    the encoder settings, with the same keys as the output's
+//   job-NNNNN.todo   Waiting for a worker. A worker claims it by renaming it
+//                    to job-NNNNN.run, which only one worker can win.
+//   job-NNNNN.run    Being encoded. The worker rewrites it about once a
+//                    second, starting with its ID; if it stops changing,
+//                    the dispatcher requeues the job. A worker only touches
+//                    the file while its ID is still in there.
+//   job-NNNNN.failed The worker gave up on it, the dispatcher requeues it.
+//                    Jobs still running when the dispatcher gives up are
+//                    left like this too.
+//   chunk-NNNNN.mp4  The finished chunk, renamed into place once complete
+//   finished         Written by the dispatcher; workers exit when they see it
+//
+// Chunks already in the spool directory are kept, so running the dispatcher
+// again after a failure only encodes what's missing.
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-pool.h"
+#include "cordyceps-stalk-raw.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+
+#define POLL_INTERVAL_MS 500
+// How long idle local workers get to notice the run is finished
+#define WORKER_EXIT_GRACE_MS 5000
+#define HEARTBEAT_INTERVAL_NS 1000000000ULL
+
+struct chunk_job {
+	int64_t start;
+	int64_t count;
+	int attempts;
+	bool done;
+
+	// Last heartbeat seen from the worker, and when it changed
+	char* beat;
+	uint64_t beat_ns;
+};
+
+static void spool_path(struct dstr* path, const char* spool,
+		       const char* name, int job)
+{
+	dstr_copy(path, spool);
+	dstr_cat_ch(path, '/');
+	if (job >= 0) dstr_catf(path, name, job);
+	else dstr_cat(path, name);
+}
+
+static bool touch(const char* path, const char* contents)
+{
+	return os_quick_write_utf8_file(path, contents, strlen(contents),
+					false);
+}
+
+// Worker side
+
+struct chunk_worker {
+	const char* spool;
+	char id[64];
+	int job;
+
+	struct cso_alloc_stats alloc_stats;
+	struct cso_buffer_pool buffer_pool;
+
+	uint64_t beat_ns;
+	int beats;
+};
+
+// Whether the job's .run file is still this worker's. After a requeue it's
+// either gone or belongs to whoever claimed the job next.
+static bool owns_job(const struct chunk_worker* worker, const char* run_path)
+{
+	char* beat = os_quick_read_utf8_file(run_path);
+	size_t id_len = strlen(worker->id);
+	bool owned = beat && strncmp(beat, worker->id, id_len) == 0
+		     && beat[id_len] == ' ';
+
+	bfree(beat);
+	return owned;
+}
+
+static void heartbeat(struct chunk_worker* worker, int64_t frames,
+		      int64_t count, bool claiming)
+{
+	uint64_t now_ns = os_gettime_ns();
+	if (now_ns - worker->beat_ns < HEARTBEAT_INTERVAL_NS) return;
+
+	worker->beat_ns = now_ns;
+
+	struct dstr path = {0};
+	struct dstr beat = {0};
+	spool_path(&path, worker->spool, "job-%05d.run", worker->job);
+	dstr_printf(&beat, "%s %lld/%lld %d\n", worker->id, (long long) frames,
+		    (long long) count, ++worker->beats);
+
+	// Requeued by the dispatcher in the meantime; keep going anyway, the
+	// chunk is still good if this worker finishes first
+	if (claiming || owns_job(worker, path.array))
+		touch(path.array, beat.array);
+
+	dstr_free(&beat);
+	dstr_free(&path);
+}
+
+static int write_packets(struct ffmpeg_context* context, AVFrame* frame,
+			 AVPacket* packet, uint64_t* total_bytes)
+{
+	int ret = avcodec_send_frame(context->video_ctx, frame);
+
+	while (ret == 0) {
+		ret = avcodec_receive_packet(context->video_ctx, packet);
+		if (ret != 0) break;
+
+		av_packet_rescale_ts(packet, context->time_base,
+				     context->video_stream->time_base);
+		*total_bytes += packet->size;
+
+		ret = av_write_frame(context->output_ctx, packet);
+		av_packet_unref(packet);
+	}
+
+	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ret = 0;
+
+	return ret;
+}
+
+static bool encode_chunk(struct chunk_worker* worker)
+{
+	struct dstr path = {0};
+	struct dstr part_path = {0};
+	struct dstr chunk_path = {0};
+	struct cso_raw_reader reader = {0};
+	struct ffmpeg_context context = {0};
+	AVPacket* packet = av_packet_alloc();
+	uint64_t total_bytes = 0;
+	bool success = false;
+
+	spool_path(&path, worker->spool, "job-%05d.json", worker->job);
+	obs_data_t* job = obs_data_create_from_json_file(path.array);
+	if (!job) {
+		printf("Can't read %s\n", path.array);
+		goto cleanup;
+	}
+
+	int64_t start = obs_data_get_int(job, "start");
+	int64_t count = obs_data_get_int(job, "count");
+	const char* dump_path = obs_data_get_string(job, "dump");
+
+	if (!cso_raw_reader_open(&reader, dump_path)
+	    || !cso_raw_reader_seek_frame(&reader, start)) {
+		printf("Can't read frame %lld of %s\n", (long long) start,
+		       dump_path);
+		goto cleanup;
+	}
+
+	spool_path(&chunk_path, worker->spool, "chunk-%05d.mp4", worker->job);
+	dstr_copy_dstr(&part_path, &chunk_path);
+	dstr_catf(&part_path, ".%s.part", worker->id);
+
+	const struct cso_raw_info* info = &reader.info;
+
+	context.config.filepath = part_path.array;
+	context.config.output_format = av_guess_format("mp4", NULL, NULL);
+	context.config.buffer_pool = &worker->buffer_pool;
+	cso_encoder_get_settings(job, &context.config.encoder);
+	context.config.width = info->width;
+	context.config.height = info->height;
+	context.config.fps_num = info->fps_num;
+	context.config.fps_den = info->fps_den;
+	context.config.hdr_nominal_peak_level = 1000;
+	context.config.pixel_format = info->format;
+	context.config.color_range = info->color_range;
+	context.config.color_primaries = info->color_primaries;
+	context.config.color_trc = info->color_trc;
+	context.config.colorspace = info->colorspace;
+
+	if (!context.config.output_format || !cso_encoder_open(&context)
+	    || !cso_muxer_open(&context))
+		goto cleanup;
+
+	uint64_t start_ns = os_gettime_ns();
+	struct cso_raw_record record;
+	int errors = 0;
+
+	while (context.total_frames < count
+	       && cso_raw_reader_next(&reader, &record)) {
+		if (record.type != CSO_RAW_FRAME) continue;
+
+		struct video_data frame;
+		cso_raw_reader_get_frame(&reader, &frame);
+
+		if (av_frame_make_writable(context.vframe) < 0) {
+			errors++;
+			break;
+		}
+
+		cso_encoder_ingest(&context, &frame);
+		context.vframe->pts = context.total_frames++;
+
+		if (write_packets(&context, context.vframe, packet,
+				  &total_bytes)
+		    < 0)
+			errors++;
+
+		heartbeat(worker, context.total_frames, count, false);
+	}
+
+	if (write_packets(&context, NULL, packet, &total_bytes) < 0) errors++;
+
+	if (errors || context.total_frames != count) {
+		printf("Chunk %d: %d errors, %lld of %lld frames\n",
+		       worker->job, errors, (long long) context.total_frames,
+		       (long long) count);
+		goto cleanup;
+	}
+
+	if (av_write_trailer(context.output_ctx) < 0) goto cleanup;
+
+	cso_muxer_close(context.output_ctx, false);
+	context.output_ctx = NULL;
+
+	if (os_rename(part_path.array, chunk_path.array) != 0) goto cleanup;
+
+	double seconds = (double) (os_gettime_ns() - start_ns) / 1000000000.0;
+	printf("Chunk %d: %lld frames in %.2f s (%.1f fps), %llu bytes\n",
+	       worker->job, (long long) count, seconds,
+	       seconds > 0.0 ? (double) count / seconds : 0.0,
+	       (unsigned long long) total_bytes);
+
+	success = true;
+
+cleanup:
+	avcodec_free_context(&context.video_ctx);
+	av_frame_free(&context.vframe);
+	if (context.output_ctx) {
+		cso_muxer_close(context.output_ctx, false);
+		os_unlink(part_path.array);
+	}
+	cso_buffer_pool_free(&worker->buffer_pool);
+	av_packet_free(&packet);
+
+	cso_raw_reader_close(&reader);
+	obs_data_release(job);
+	dstr_free(&path);
+	dstr_free(&part_path);
+	dstr_free(&chunk_path);
+
+	return success;
+}
+
+// Claims the lowest numbered job waiting in the spool directory
+static bool claim_job(struct chunk_worker* worker)
+{
+	os_dir_t* dir = os_opendir(worker->spool);
+	if (!dir) return false;
+
+	int best = -1;
+	struct os_dirent* entry;
+
+	while ((entry = os_readdir(dir)) != NULL) {
+		int job;
+		char suffix[8];
+
+		if (sscanf(entry->d_name, "job-%d.%7s", &job, suffix) == 2
+		    && strcmp(suffix, "todo") == 0 && (best < 0 || job < best))
+			best = job;
+	}
+
+	os_closedir(dir);
+
+	if (best < 0) return false;
+
+	struct dstr todo_path = {0};
+	struct dstr run_path = {0};
+	spool_path(&todo_path, worker->spool, "job-%05d.todo", best);
+	spool_path(&run_path, worker->spool, "job-%05d.run", best);
+
+	// Only one worker's rename can find the file still there
+	bool claimed = os_rename(todo_path.array, run_path.array) == 0;
+
+	dstr_free(&todo_path);
+	dstr_free(&run_path);
+
+	if (claimed) {
+		worker->job = best;
+		worker->beat_ns = 0;
+		heartbeat(worker, 0, 0, true);
+	}
+
+	return claimed;
+}
+
+static int run_worker(const char* spool)
+{
+	struct chunk_worker worker = {0};
+	struct dstr finished_path = {0};
+
+	worker.spool = spool;
+	worker.buffer_pool.stats = &worker.alloc_stats;
+	snprintf(worker.id, sizeof(worker.id), "%d-%08x", (int) getpid(),
+		 (unsigned int) os_gettime_ns());
+
+	spool_path(&finished_path, spool, "finished", -1);
+
+	while (!os_file_exists(finished_path.array)) {
+		if (!claim_job(&worker)) {
+			os_sleep_ms(POLL_INTERVAL_MS);
+			continue;
+		}
+
+		struct dstr run_path = {0};
+		struct dstr failed_path = {0};
+		spool_path(&run_path, spool, "job-%05d.run", worker.job);
+		spool_path(&failed_path, spool, "job-%05d.failed", worker.job);
+
+		// The chunk itself is fine either way, but a requeued job's
+		// file is someone else's to finish or fail
+		bool success = encode_chunk(&worker);
+		if (owns_job(&worker, run_path.array)) {
+			if (success) os_unlink(run_path.array);
+			else os_rename(run_path.array, failed_path.array);
+		}
+
+		dstr_free(&run_path);
+		dstr_free(&failed_path);
+	}
+
+	dstr_free(&finished_path);
+	return 0;
+}
+
+// Dispatcher side
+
+static bool same_stream(const AVCodecParameters* a,
+			const AVCodecParameters* b)
+{
+	return a->codec_id == b->codec_id && a->width == b->width
+	       && a->height == b->height && a->format == b->format
+	       && a->extradata_size == b->extradata_size
+	       && (!a->extradata_size
+		   || memcmp(a->extradata, b->extradata, a->extradata_size)
+			      == 0);
+}
+
+// Copies every chunk's packets into one file. Chunk timestamps all start at
+// zero, so each chunk is shifted to where its first frame sits in the dump.
+static bool stitch_chunks(const char* spool, const struct chunk_job* jobs,
+			  int job_count, AVRational frame_time_base,
+			  const char* output_path)
+{
+	AVFormatContext* output_ctx = NULL;
+	AVStream* output_stream = NULL;
+	AVPacket* packet = av_packet_alloc();
+	struct dstr path = {0};
+	int64_t last_dts = INT64_MIN;
+	bool success = false;
+
+	for (int i = 0; i < job_count; i++) {
+		AVFormatContext* input_ctx = NULL;
+
+		spool_path(&path, spool, "chunk-%05d.mp4", i);
+
+		if (avformat_open_input(&input_ctx, path.array, NULL, NULL) < 0
+		    || input_ctx->nb_streams != 1) {
+			printf("Can't read chunk %s\n", path.array);
+			avformat_close_input(&input_ctx);
+			goto cleanup;
+		}
+
+		AVStream* input_stream = input_ctx->streams[0];
+
+		if (!output_ctx) {
+			avformat_alloc_output_context2(&output_ctx, NULL, "mp4",
+						       output_path);
+			if (output_ctx)
+				output_stream =
+					avformat_new_stream(output_ctx, NULL);
+
+			if (!output_stream
+			    || avcodec_parameters_copy(output_stream->codecpar,
+						       input_stream->codecpar)
+				       < 0) {
+				avformat_close_input(&input_ctx);
+				goto cleanup;
+			}
+
+			output_stream->codecpar->codec_tag = 0;
+			output_stream->time_base = input_stream->time_base;
+			output_stream->avg_frame_rate =
+				input_stream->avg_frame_rate;
+
+			if (avio_open(&output_ctx->pb, output_path,
+				      AVIO_FLAG_WRITE)
+				    < 0
+			    || avformat_write_header(output_ctx, NULL) < 0) {
+				printf("Can't create %s\n", output_path);
+				avformat_close_input(&input_ctx);
+				goto cleanup;
+			}
+		} else if (!same_stream(output_stream->codecpar,
+					input_stream->codecpar)) {
+			printf("Chunk %d was encoded with different stream "
+			       "parameters and can't be joined without "
+			       "re-encoding\n",
+			       i);
+			avformat_close_input(&input_ctx);
+			goto cleanup;
+		}
+
+		// The muxer may have picked its own time base in write_header
+		int64_t chunk_start = av_rescale_q(jobs[i].start,
+						   frame_time_base,
+						   output_stream->time_base);
+		int64_t offset = AV_NOPTS_VALUE;
+		int ret;
+
+		while ((ret = av_read_frame(input_ctx, packet)) >= 0) {
+			av_packet_rescale_ts(packet, input_stream->time_base,
+					     output_stream->time_base);
+
+			// The first packet is the chunk's IDR frame, which is
+			// also the first one shown
+			if (offset == AV_NOPTS_VALUE)
+				offset = chunk_start - packet->pts;
+
+			packet->pts += offset;
+			packet->dts += offset;
+			packet->stream_index = 0;
+			packet->pos = -1;
+
+			if (packet->dts <= last_dts) {
+				printf("Chunk %d overlaps the one before it\n",
+				       i);
+				ret = AVERROR_INVALIDDATA;
+				break;
+			}
+
+			last_dts = packet->dts;
+			ret = av_write_frame(output_ctx, packet);
+			av_packet_unref(packet);
+
+			if (ret < 0) break;
+		}
+
+		avformat_close_input(&input_ctx);
+		av_packet_unref(packet);
+
+		if (ret != AVERROR_EOF) goto cleanup;
+	}
+
+	success = output_ctx && av_write_trailer(output_ctx) >= 0;
+
+cleanup:
+	if (output_ctx) cso_muxer_close(output_ctx, false);
+	av_packet_free(&packet);
+	dstr_free(&path);
+
+	return success;
+}
+
+static bool write_job(const char* spool, int index, const char* dump_path,
+		      const struct chunk_job* job,
+		      const struct cso_encoder_settings* settings)
+{
+	struct dstr path = {0};
+	obs_data_t* data = obs_data_create();
+
+	obs_data_set_string(data, "dump", dump_path);
+	obs_data_set_int(data, "start", job->start);
+	obs_data_set_int(data, "count", job->count);
+	obs_data_set_string(data, "codec",
+			    cso_codec_to_string(settings->codec));
+	obs_data_set_int(data, "threads", settings->threads);
+	obs_data_set_int(data, "gop_size", settings->gop_size);
+	obs_data_set_string(data, "rate_control",
+			    settings->rate_control == CSO_RATE_CONTROL_ABR
+				    ? "abr"
+				    : "crf");
+	obs_data_set_double(data, "crf", settings->crf);
+	obs_data_set_int(data, "bitrate", settings->bitrate);
+	obs_data_set_int(data, "max_bitrate", settings->max_bitrate);
+	obs_data_set_int(data, "buffer_size", settings->buffer_size);
+	obs_data_set_string(data, "preset", settings->preset);
+
+	// Left over from an earlier run that didn't finish
+	spool_path(&path, spool, "job-%05d.run", index);
+	os_unlink(path.array);
+	spool_path(&path, spool, "job-%05d.failed", index);
+	os_unlink(path.array);
+
+	spool_path(&path, spool, "job-%05d.json", index);
+	bool success = obs_data_save_json(data, path.array);
+
+	// The description has to be in place before a worker can claim it
+	spool_path(&path, spool, "job-%05d.todo", index);
+	success = success && touch(path.array, "");
+
+	obs_data_release(data);
+	dstr_free(&path);
+
+	return success;
+}
+
+// Returns false once a chunk has used up its retries
+static bool requeue(const char* spool, struct chunk_job* jobs, int index,
+		    const char* from, const char* reason, int retries)
+{
+	struct chunk_job* job = &jobs[index];
+	struct dstr from_path = {0};
+	struct dstr todo_path = {0};
+
+	if (++job->attempts > retries) {
+		printf("Chunk %d %s, giving up after %d attempts\n", index,
+		       reason, job->attempts);
+		return false;
+	}
+
+	spool_path(&from_path, spool, from, index);
+	spool_path(&todo_path, spool, "job-%05d.todo", index);
+	os_rename(from_path.array, todo_path.array);
+
+	printf("Chunk %d %s, retrying (%d of %d)\n", index, reason,
+	       job->attempts, retries);
+
+	bfree(job->beat);
+	job->beat = NULL;
+
+	dstr_free(&from_path);
+	dstr_free(&todo_path);
+
+	return true;
+}
+
+// Returns the number of finished chunks, or -1 if one can't be finished.
+// progress_ns is moved up whenever a chunk finishes or a worker beats.
+static int poll_jobs(const char* spool, struct chunk_job* jobs, int job_count,
+		     int retries, uint64_t timeout_ns, uint64_t* progress_ns)
+{
+	struct dstr path = {0};
+	int done = 0;
+
+	for (int i = 0; i < job_count; i++) {
+		struct chunk_job* job = &jobs[i];
+
+		if (!job->done) {
+			spool_path(&path, spool, "chunk-%05d.mp4", i);
+			job->done = os_file_exists(path.array);
+			if (job->done) *progress_ns = os_gettime_ns();
+		}
+
+		if (job->done) {
+			done++;
+			continue;
+		}
+
+		spool_path(&path, spool, "job-%05d.failed", i);
+		if (os_file_exists(path.array)) {
+			if (!requeue(spool, jobs, i, "job-%05d.failed",
+				     "failed", retries))
+				goto fail;
+			continue;
+		}
+
+		spool_path(&path, spool, "job-%05d.run", i);
+		char* beat = os_quick_read_utf8_file(path.array);
+		if (!beat) continue;
+
+		uint64_t now_ns = os_gettime_ns();
+
+		if (!job->beat || strcmp(job->beat, beat) != 0) {
+			bfree(job->beat);
+			job->beat = beat;
+			job->beat_ns = now_ns;
+			*progress_ns = now_ns;
+		} else {
+			bfree(beat);
+
+			if (now_ns - job->beat_ns > timeout_ns
+			    && !requeue(spool, jobs, i, "job-%05d.run",
+					"stalled", retries))
+				goto fail;
+		}
+	}
+
+	dstr_free(&path);
+	return done;
+
+fail:
+	dstr_free(&path);
+	return -1;
+}
+
+// Local workers are spawned directly rather than through a pipe, so one that
+// hangs can be killed instead of waited on forever
+struct local_worker {
+#ifdef _WIN32
+	intptr_t handle;
+#else
+	pid_t pid;
+#endif
+};
+
+static bool start_worker(const char* self, const char* spool,
+			 struct local_worker* worker)
+{
+#ifdef _WIN32
+	// _spawnv joins the arguments into one command line, so paths with
+	// spaces need quotes
+	struct dstr quoted_self = {0};
+	struct dstr quoted_spool = {0};
+	dstr_printf(&quoted_self, "\"%s\"", self);
+	dstr_printf(&quoted_spool, "\"%s\"", spool);
+
+	const char* args[] = {quoted_self.array, "--worker",
+			      quoted_spool.array, NULL};
+	worker->handle = _spawnv(_P_NOWAIT, self, args);
+
+	dstr_free(&quoted_self);
+	dstr_free(&quoted_spool);
+	return worker->handle != -1;
+#else
+	char* args[] = {(char*) self, (char*) "--worker", (char*) spool, NULL};
+	return posix_spawnp(&worker->pid, self, NULL, NULL, args, environ)
+	       == 0;
+#endif
+}
+
+// Waits up to grace_ms for the worker to exit, then kills it
+static void stop_worker(struct local_worker* worker, uint32_t grace_ms)
+{
+#ifdef _WIN32
+	HANDLE process = (HANDLE) worker->handle;
+
+	if (WaitForSingleObject(process, grace_ms) == WAIT_TIMEOUT) {
+		TerminateProcess(process, 1);
+		WaitForSingleObject(process, INFINITE);
+	}
+	CloseHandle(process);
+#else
+	uint64_t deadline_ns = os_gettime_ns() + grace_ms * 1000000ULL;
+
+	while (waitpid(worker->pid, NULL, WNOHANG) == 0) {
+		if (os_gettime_ns() >= deadline_ns) {
+			kill(worker->pid, SIGKILL);
+			waitpid(worker->pid, NULL, 0);
+			break;
+		}
+		os_sleep_ms(50);
+	}
+#endif
+}
+
+// After giving up, so a worker elsewhere that's still encoding one of these
+// sees it no longer owns the job
+static void fail_running_jobs(const char* spool, const struct chunk_job* jobs,
+			      int job_count)
+{
+	struct dstr run_path = {0};
+	struct dstr failed_path = {0};
+
+	for (int i = 0; i < job_count; i++) {
+		if (jobs[i].done) continue;
+
+		spool_path(&run_path, spool, "job-%05d.run", i);
+		spool_path(&failed_path, spool, "job-%05d.failed", i);
+		if (os_file_exists(run_path.array))
+			os_rename(run_path.array, failed_path.array);
+	}
+
+	dstr_free(&run_path);
+	dstr_free(&failed_path);
+}
+
+static void print_usage(const char* name)
+{
+	printf("Usage: %s [-o output.mp4] [--spool dir] [--chunk-frames n] "
+	       "[--workers count] [--retries count] [--timeout seconds] "
+	       "[--codec name] [--threads count] [--preset name] "
+	       "[--crf value] [--bitrate kbps] "
+	       "[--gop frames] <dump.csraw>\n"
+	       "       %s --worker <spool dir>\n",
+	       name, name);
+}
+
+int main(int argc, char** argv)
+{
+	struct cso_encoder_settings settings = {
+		.gop_size = 120,
+		.rate_control = CSO_RATE_CONTROL_CRF,
+		.crf = 23.0,
+		.bitrate = 25000,
+	};
+	snprintf(settings.preset, sizeof(settings.preset), "veryfast");
+
+	const char* dump_arg = NULL;
+	const char* output_path = NULL;
+	const char* spool_arg = NULL;
+	int64_t chunk_frames = 0;
+	int worker_count = 2;
+	int retries = 3;
+	int timeout = 60;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--worker") == 0 && has_value) {
+			return run_worker(argv[++i]);
+		} else if (strcmp(arg, "-o") == 0 && has_value) {
+			output_path = argv[++i];
+		} else if (strcmp(arg, "--spool") == 0 && has_value) {
+			spool_arg = argv[++i];
+		} else if (strcmp(arg, "--chunk-frames") == 0 && has_value) {
+			chunk_frames = atoll(argv[++i]);
+		} else if (strcmp(arg, "--workers") == 0 && has_value) {
+			worker_count = atoi(argv[++i]);
+		} else if (strcmp(arg, "--retries") == 0 && has_value) {
+			retries = atoi(argv[++i]);
+		} else if (strcmp(arg, "--timeout") == 0 && has_value) {
+			timeout = atoi(argv[++i]);
+		} else if (strcmp(arg, "--codec") == 0 && has_value) {
+			settings.codec = cso_codec_from_string(argv[++i]);
+		} else if (strcmp(arg, "--threads") == 0 && has_value) {
+			settings.threads = atoi(argv[++i]);
+		} else if (strcmp(arg, "--preset") == 0 && has_value) {
+			snprintf(settings.preset, sizeof(settings.preset), "%s",
+				 argv[++i]);
+		} else if (strcmp(arg, "--crf") == 0 && has_value) {
+			settings.crf = atof(argv[++i]);
+		} else if (strcmp(arg, "--bitrate") == 0 && has_value) {
+			settings.rate_control = CSO_RATE_CONTROL_ABR;
+			settings.bitrate = atoi(argv[++i]);
+		} else if (strcmp(arg, "--gop") == 0 && has_value) {
+			settings.gop_size = atoi(argv[++i]);
+		} else if (arg[0] != '-' && !dump_arg) {
+			dump_arg = arg;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!dump_arg || worker_count < 0 || retries < 0 || timeout <= 0
+	    || settings.gop_size <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	struct cso_raw_reader reader;
+	if (!cso_raw_reader_open(&reader, dump_arg)) return 1;
+
+	int64_t frame_count = reader.frame_count;
+	AVRational frame_time_base = {reader.info.fps_den,
+				      reader.info.fps_num};
+	cso_raw_reader_close(&reader);
+
+	// Workers seek straight to their first frame
+	if (frame_count < 0) {
+		printf("%s has no index; chunks can only be cut from a dump "
+		       "that was closed properly\n",
+		       dump_arg);
+		return 1;
+	}
+
+	if (chunk_frames <= 0) chunk_frames = (int64_t) settings.gop_size * 8;
+
+	// Workers elsewhere would resolve relative paths against their own
+	// directory
+	char* dump_path = os_get_abs_path_ptr(dump_arg);
+	if (!dump_path) dump_path = bstrdup(dump_arg);
+
+	struct dstr spool = {0};
+	struct dstr default_output = {0};
+	struct dstr path = {0};
+
+	if (spool_arg) {
+		dstr_copy(&spool, spool_arg);
+	} else {
+		dstr_copy(&spool, dump_path);
+		dstr_cat(&spool, ".chunks");
+	}
+
+	os_mkdirs(spool.array);
+
+	char* spool_abs = os_get_abs_path_ptr(spool.array);
+	if (spool_abs) dstr_copy(&spool, spool_abs);
+	bfree(spool_abs);
+
+	dstr_copy(&default_output, dump_path);
+	dstr_cat(&default_output, ".chunked.mp4");
+	if (!output_path) output_path = default_output.array;
+
+	int job_count = (int) ((frame_count + chunk_frames - 1) / chunk_frames);
+	struct chunk_job* jobs = bzalloc(sizeof(struct chunk_job)
+					 * (job_count ? job_count : 1));
+	DARRAY(struct local_worker) workers;
+	da_init(workers);
+	int ret = 1;
+
+	spool_path(&path, spool.array, "finished", -1);
+	os_unlink(path.array);
+
+	int resumed = 0;
+
+	for (int i = 0; i < job_count; i++) {
+		jobs[i].start = i * chunk_frames;
+		jobs[i].count = frame_count - jobs[i].start < chunk_frames
+					? frame_count - jobs[i].start
+					: chunk_frames;
+
+		spool_path(&path, spool.array, "chunk-%05d.mp4", i);
+		if (os_file_exists(path.array)) {
+			resumed++;
+			continue;
+		}
+
+		if (!write_job(spool.array, i, dump_path, &jobs[i],
+			       &settings)) {
+			printf("Can't write jobs to %s\n", spool.array);
+			goto cleanup;
+		}
+	}
+
+	printf("Encoding %lld frames from %s in %d chunks of %lld frames "
+	       "(%d already done), jobs in %s\n",
+	       (long long) frame_count, dump_path, job_count,
+	       (long long) chunk_frames, resumed, spool.array);
+
+	// Workers share this console, so their output shows up as it happens
+	for (int i = 0; i < worker_count && resumed < job_count; i++) {
+		struct local_worker worker;
+		if (start_worker(argv[0], spool.array, &worker))
+			da_push_back(workers, &worker);
+		else printf("Failed to start a local worker\n");
+	}
+
+	uint64_t start_ns = os_gettime_ns();
+	uint64_t timeout_ns = (uint64_t) timeout * 1000000000ULL;
+	uint64_t progress_ns = start_ns;
+	int done = 0;
+
+	// Nothing may ever claim the jobs: no local workers, all of them
+	// gone, or remote ones that never showed up
+	while ((done = poll_jobs(spool.array, jobs, job_count, retries,
+				 timeout_ns, &progress_ns))
+	       >= 0) {
+		if (done == job_count) break;
+
+		if (os_gettime_ns() - progress_ns > timeout_ns) {
+			printf("No worker made progress in %d s, giving up\n",
+			       timeout);
+			break;
+		}
+
+		os_sleep_ms(POLL_INTERVAL_MS);
+	}
+
+	// Sends every worker home, whether the chunks are all done or not
+	spool_path(&path, spool.array, "finished", -1);
+	touch(path.array, done == job_count ? "done\n" : "failed\n");
+
+	// Workers still busy after giving up may be the ones that hung
+	bool finished = done == job_count;
+	for (size_t i = 0; i < workers.num; i++)
+		stop_worker(&workers.array[i],
+			    finished ? WORKER_EXIT_GRACE_MS : 0);
+
+	if (!finished) {
+		fail_running_jobs(spool.array, jobs, job_count);
+		goto cleanup;
+	}
+
+	double seconds = (double) (os_gettime_ns() - start_ns) / 1000000000.0;
+	int attempts = 0;
+	for (int i = 0; i < job_count; i++) attempts += jobs[i].attempts;
+
+	printf("Encoded %d chunks in %.2f s (%.1f fps), %d retries\n",
+	       job_count - resumed, seconds,
+	       seconds > 0.0 ? (double) frame_count / seconds : 0.0, attempts);
+
+	if (!stitch_chunks(spool.array, jobs, job_count, frame_time_base,
+			   output_path)) {
+		printf("Failed to join the chunks into %s\n", output_path);
+		goto cleanup;
+	}
+
+	printf("Joined %d chunks into %s\n", job_count, output_path);
+	ret = 0;
+
+cleanup:
+	for (int i = 0; i < job_count; i++) bfree(jobs[i].beat);
+	bfree(jobs);
+	da_free(workers);
+	bfree(dump_path);
+	dstr_free(&spool);
+	dstr_free(&default_output);
+	dstr_free(&path);
+
+	return ret;
+}
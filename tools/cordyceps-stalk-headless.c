@@ -0,0 +1,969 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Loads the built plugin without OBS and drives it through a script of vendor
+// requests, the way the game's websocket client would, to time the control
+// path: how long start_recording takes to confirm, how long request_frames
+// takes until the output has taken every requested frame, how long
+// stop_recording takes to finish the file, and so on. Linux only.
+//
+// The parts of libobs the plugin needs that don't work without a running OBS
+// (outputs, the video output, the global proc handler) are stubbed here and
+// exported from the executable, so they take precedence over libobs' own
+// when the plugin is loaded. obs-websocket is stubbed the same way, through
+// the proc handler its API header looks up. Running outputs get a synthetic
+// NV12 frame every video tick.
+//
+// Usage: cordyceps-stalk-headless --plugin <path> --script <path> [options]
+//   --size <WxH>      Video size, defaults to 1280x720
+//   --fps <num/den>   Video frame rate, defaults to 60/1
+//   --timeout <ms>    How long to wait on a request, defaults to 10000
+//   --quiet           Only show warnings and errors from the plugin
+//   --verbose         Print every response and event
+//
+// Scripts have one vendor request per line, optionally followed by its JSON
+// request data. Blank lines and lines starting with # are skipped, and
+// "sleep <ms>" and "repeat <count>" ... "end" are understood as well:
+//
+//   update_settings {"dirpath": "/tmp/cordyceps/", "low_latency": true}
+//   start_recording
+//   repeat 100
+//   request_frames {"count": 2}
+//   end
+//   stop_recording
+//
+// Requests are timed until start_recording's result event arrives, until
+// request_frames' frames have all been taken, or otherwise until the request
+// returns. The exit code is 1 if any request failed or timed out.
+
+#include <obs-module.h>
+#include <util/base.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#define DEFAULT_TIMEOUT_MS 10000
+
+// Same layout as obs-websocket's, see include/obs-websocket-api.h
+struct request_callback {
+	void (*callback)(obs_data_t* request, obs_data_t* response,
+			 void* priv);
+	void* priv;
+};
+
+struct vendor_request {
+	char* type;
+	struct request_callback callback;
+};
+
+struct vendor_event {
+	char* type;
+	uint64_t time_ns;
+};
+
+struct request_stats {
+	char* type;
+	DARRAY(uint64_t) samples;
+	int failed;
+};
+
+struct video_output {
+	struct video_output_info info;
+};
+
+struct obs_output {
+	struct obs_output_info info;
+	char* name;
+	void* data;
+	obs_data_t* settings;
+	proc_handler_t* proc_handler;
+	signal_handler_t* signal_handler;
+	obs_encoder_t* video_encoder;
+
+	volatile bool active;
+	int stop_code;
+
+	pthread_t video_thread;
+	bool video_thread_active;
+	volatile bool video_stopping;
+};
+
+static struct {
+	struct video_output video;
+	uint8_t* frame_buffer;
+	struct video_data frame;
+
+	DARRAY(struct obs_output_info) output_types;
+	DARRAY(obs_output_t*) outputs;
+
+	proc_handler_t* obs_ph;
+	proc_handler_t* websocket_ph;
+	char* vendor_name;
+	DARRAY(struct vendor_request) requests;
+
+	// Events and request_frames completion, signalled from whichever
+	// thread the plugin calls back on
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	DARRAY(struct vendor_event) events;
+	obs_output_t* credit_output;
+	uint64_t credit_done_ns;
+
+	DARRAY(struct request_stats) stats;
+	uint64_t timeout_ns;
+	bool verbose;
+} runner;
+
+static void fill_pattern(int64_t index)
+{
+	const struct video_output_info* voi = &runner.video.info;
+	struct video_data* frame = &runner.frame;
+	uint32_t bar = (uint32_t) (index * 8 % voi->width);
+
+	for (uint32_t y = 0; y < voi->height; y++) {
+		uint8_t* row = frame->data[0] + y * frame->linesize[0];
+
+		for (uint32_t x = 0; x < voi->width; x++)
+			row[x] = x - bar < 8 ? 235 : (uint8_t) (x + y + index);
+	}
+}
+
+static int64_t requested_frames(obs_output_t* output)
+{
+	calldata_t cd = {0};
+	int64_t count = 0;
+
+	if (proc_handler_call(output->proc_handler, "get_requested_frames",
+			      &cd))
+		count = calldata_int(&cd, "count");
+
+	calldata_free(&cd);
+	return count;
+}
+
+// Marks a request_frames wait done once the frame that used up the last of
+// the credit is through the output
+static void check_credit(obs_output_t* output)
+{
+	pthread_mutex_lock(&runner.mutex);
+	bool waiting = runner.credit_output == output && !runner.credit_done_ns;
+	pthread_mutex_unlock(&runner.mutex);
+
+	if (!waiting || requested_frames(output) > 0) return;
+
+	pthread_mutex_lock(&runner.mutex);
+	if (runner.credit_output == output && !runner.credit_done_ns) {
+		runner.credit_done_ns = os_gettime_ns();
+		pthread_cond_broadcast(&runner.cond);
+	}
+	pthread_mutex_unlock(&runner.mutex);
+}
+
+// Stands in for OBS's video thread. Ticks that the output is still busy for
+// are skipped, as OBS would.
+static void* video_thread(void* data)
+{
+	obs_output_t* output = data;
+	const struct video_output_info* voi = &runner.video.info;
+	uint64_t interval_ns = 1000000000ULL * voi->fps_den / voi->fps_num;
+	uint64_t tick_ns = os_gettime_ns();
+	int64_t index = 0;
+
+	while (!os_atomic_load_bool(&output->video_stopping)) {
+		fill_pattern(index++);
+		runner.frame.timestamp = tick_ns;
+		output->info.raw_video(output->data, &runner.frame);
+
+		check_credit(output);
+
+		tick_ns += interval_ns;
+		uint64_t now_ns = os_gettime_ns();
+		if (tick_ns < now_ns)
+			tick_ns += (now_ns - tick_ns) / interval_ns
+				   * interval_ns
+				   + interval_ns;
+
+		os_sleepto_ns(tick_ns);
+	}
+
+	return NULL;
+}
+
+static void signal_output(obs_output_t* output, const char* signal, int code)
+{
+	calldata_t cd = {0};
+	calldata_set_ptr(&cd, "output", output);
+	calldata_set_int(&cd, "code", code);
+	signal_handler_signal(output->signal_handler, signal, &cd);
+	calldata_free(&cd);
+}
+
+// libobs stand-ins, exported so the plugin binds to these
+
+void obs_register_output_s(const struct obs_output_info* info, size_t size)
+{
+	struct obs_output_info copy = {0};
+	memcpy(&copy, info, size < sizeof(copy) ? size : sizeof(copy));
+	da_push_back(runner.output_types, &copy);
+}
+
+obs_output_t* obs_output_create(const char* id, const char* name,
+				obs_data_t* settings, obs_data_t* hotkey_data)
+{
+	UNUSED_PARAMETER(hotkey_data);
+
+	const struct obs_output_info* info = NULL;
+	for (size_t i = 0; i < runner.output_types.num; i++)
+		if (strcmp(runner.output_types.array[i].id, id) == 0)
+			info = &runner.output_types.array[i];
+
+	if (!info) {
+		blog(LOG_ERROR, "No output type \"%s\" registered", id);
+		return NULL;
+	}
+
+	obs_output_t* output = bzalloc(sizeof(obs_output_t));
+	output->info = *info;
+	output->name = bstrdup(name);
+	output->settings = obs_data_create();
+	if (settings) obs_data_apply(output->settings, settings);
+	output->proc_handler = proc_handler_create();
+	output->signal_handler = signal_handler_create();
+
+	static const char* signals[] = {
+		"void start(ptr output)",
+		"void stop(ptr output, int code)",
+		"void activate(ptr output)",
+		"void deactivate(ptr output)",
+		NULL,
+	};
+	signal_handler_add_array(output->signal_handler, signals);
+
+	output->data = output->info.create(output->settings, output);
+	da_push_back(runner.outputs, &output);
+
+	return output;
+}
+
+void obs_output_release(obs_output_t* output)
+{
+	if (!output) return;
+
+	if (os_atomic_load_bool(&output->active))
+		output->info.stop(output->data, 0);
+
+	output->info.destroy(output->data);
+	da_erase_item(runner.outputs, &output);
+
+	signal_handler_destroy(output->signal_handler);
+	proc_handler_destroy(output->proc_handler);
+	obs_data_release(output->settings);
+	bfree(output->name);
+	bfree(output);
+}
+
+bool obs_output_start(obs_output_t* output)
+{
+	if (os_atomic_load_bool(&output->active)) return false;
+
+	output->stop_code = OBS_OUTPUT_SUCCESS;
+	return output->info.start(output->data);
+}
+
+void obs_output_stop(obs_output_t* output)
+{
+	if (os_atomic_load_bool(&output->active))
+		output->info.stop(output->data, os_gettime_ns());
+}
+
+void obs_output_force_stop(obs_output_t* output)
+{
+	output->info.stop(output->data, 0);
+}
+
+bool obs_output_active(const obs_output_t* output)
+{
+	return output && os_atomic_load_bool(&output->active);
+}
+
+void obs_output_update(obs_output_t* output, obs_data_t* settings)
+{
+	obs_data_apply(output->settings, settings);
+	if (output->info.update)
+		output->info.update(output->data, output->settings);
+}
+
+obs_data_t* obs_output_get_settings(const obs_output_t* output)
+{
+	obs_data_addref(output->settings);
+	return output->settings;
+}
+
+proc_handler_t* obs_output_get_proc_handler(const obs_output_t* output)
+{
+	return output->proc_handler;
+}
+
+signal_handler_t* obs_output_get_signal_handler(const obs_output_t* output)
+{
+	return output->signal_handler;
+}
+
+video_t* obs_output_video(const obs_output_t* output)
+{
+	UNUSED_PARAMETER(output);
+
+	return &runner.video;
+}
+
+uint32_t obs_output_get_width(const obs_output_t* output)
+{
+	UNUSED_PARAMETER(output);
+
+	return runner.video.info.width;
+}
+
+uint32_t obs_output_get_height(const obs_output_t* output)
+{
+	UNUSED_PARAMETER(output);
+
+	return runner.video.info.height;
+}
+
+bool obs_output_can_begin_data_capture(const obs_output_t* output,
+				       uint32_t flags)
+{
+	UNUSED_PARAMETER(flags);
+
+	return !os_atomic_load_bool(&output->active);
+}
+
+// There are no OBS encoders to share
+bool obs_output_initialize_encoders(obs_output_t* output, uint32_t flags)
+{
+	UNUSED_PARAMETER(output);
+	UNUSED_PARAMETER(flags);
+
+	return false;
+}
+
+bool obs_output_begin_data_capture(obs_output_t* output, uint32_t flags)
+{
+	UNUSED_PARAMETER(flags);
+
+	if (os_atomic_load_bool(&output->active)) return false;
+
+	os_atomic_set_bool(&output->active, true);
+
+	if (output->info.raw_video
+	    && !(output->info.flags & OBS_OUTPUT_ENCODED)) {
+		os_atomic_set_bool(&output->video_stopping, false);
+		output->video_thread_active =
+			pthread_create(&output->video_thread, NULL,
+				       video_thread, output)
+			== 0;
+	}
+
+	signal_output(output, "activate", 0);
+	return true;
+}
+
+void obs_output_end_data_capture(obs_output_t* output)
+{
+	if (!os_atomic_set_bool(&output->active, false)) return;
+
+	// Outputs can stop themselves from inside raw_video
+	if (output->video_thread_active) {
+		os_atomic_set_bool(&output->video_stopping, true);
+		if (!pthread_equal(pthread_self(), output->video_thread))
+			pthread_join(output->video_thread, NULL);
+		else
+			pthread_detach(output->video_thread);
+		output->video_thread_active = false;
+	}
+
+	signal_output(output, "deactivate", 0);
+	signal_output(output, "stop", output->stop_code);
+}
+
+void obs_output_signal_stop(obs_output_t* output, int code)
+{
+	output->stop_code = code;
+
+	// Failing to start still gets a stop signal
+	if (os_atomic_load_bool(&output->active))
+		obs_output_end_data_capture(output);
+	else
+		signal_output(output, "stop", code);
+}
+
+void obs_output_set_video_encoder(obs_output_t* output,
+				  obs_encoder_t* encoder)
+{
+	output->video_encoder = encoder;
+}
+
+obs_encoder_t* obs_output_get_video_encoder(const obs_output_t* output)
+{
+	return output->video_encoder;
+}
+
+obs_encoder_t* obs_get_encoder_by_name(const char* name)
+{
+	UNUSED_PARAMETER(name);
+
+	return NULL;
+}
+
+const struct video_output_info* video_output_get_info(const video_t* video)
+{
+	return video ? &video->info : NULL;
+}
+
+float obs_get_video_hdr_nominal_peak_level(void)
+{
+	return 1000.0f;
+}
+
+proc_handler_t* obs_get_proc_handler(void)
+{
+	return runner.obs_ph;
+}
+
+// obs-websocket stand-in
+
+static void ws_get_ph(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(data);
+
+	calldata_set_ptr(cd, "ph", runner.websocket_ph);
+}
+
+static void ws_get_api_version(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(data);
+
+	calldata_set_int(cd, "version", 3);
+}
+
+static void ws_vendor_register(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(data);
+
+	bfree(runner.vendor_name);
+	runner.vendor_name = bstrdup(calldata_string(cd, "name"));
+	calldata_set_ptr(cd, "vendor", &runner);
+}
+
+static void ws_vendor_request_register(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(data);
+
+	struct request_callback* callback = calldata_ptr(cd, "callback");
+	const char* type = calldata_string(cd, "type");
+
+	if (!callback || !type) {
+		calldata_set_bool(cd, "success", false);
+		return;
+	}
+
+	struct vendor_request* request = da_push_back_new(runner.requests);
+	request->type = bstrdup(type);
+	request->callback = *callback;
+
+	calldata_set_bool(cd, "success", true);
+}
+
+static void ws_vendor_event_emit(void* data, calldata_t* cd)
+{
+	UNUSED_PARAMETER(data);
+
+	const char* type = calldata_string(cd, "type");
+	obs_data_t* event_data = calldata_ptr(cd, "data");
+
+	if (runner.verbose)
+		printf("  event %s %s\n", type,
+		       event_data ? obs_data_get_json(event_data) : "");
+
+	struct vendor_event event = {bstrdup(type), os_gettime_ns()};
+
+	pthread_mutex_lock(&runner.mutex);
+	da_push_back(runner.events, &event);
+	pthread_cond_broadcast(&runner.cond);
+	pthread_mutex_unlock(&runner.mutex);
+
+	calldata_set_bool(cd, "success", true);
+}
+
+static void setup_handlers(void)
+{
+	runner.obs_ph = proc_handler_create();
+	proc_handler_add(runner.obs_ph,
+			 "void obs_websocket_api_get_ph(out ptr ph)", ws_get_ph,
+			 NULL);
+
+	proc_handler_t* ph = runner.websocket_ph = proc_handler_create();
+	proc_handler_add(ph, "void get_api_version(out int version)",
+			 ws_get_api_version, NULL);
+	proc_handler_add(ph, "void vendor_register(in string name, "
+			     "out ptr vendor)",
+			 ws_vendor_register, NULL);
+	proc_handler_add(ph, "void vendor_request_register(in ptr vendor, "
+			     "in string type, in ptr callback, "
+			     "out bool success)",
+			 ws_vendor_request_register, NULL);
+	proc_handler_add(ph, "void vendor_event_emit(in ptr vendor, "
+			     "in string type, in ptr data, "
+			     "out bool success)",
+			 ws_vendor_event_emit, NULL);
+}
+
+// Script running
+
+static struct timespec deadline_after(uint64_t timeout_ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	uint64_t ns = (uint64_t) ts.tv_nsec + timeout_ns;
+	ts.tv_sec += (time_t) (ns / 1000000000ULL);
+	ts.tv_nsec = (long) (ns % 1000000000ULL);
+
+	return ts;
+}
+
+// Looks for either event from index `from` on. Returns the one that came, or
+// NULL after the timeout.
+static const char* wait_for_event(size_t from, const char* a, const char* b,
+				  uint64_t* time_ns)
+{
+	struct timespec deadline = deadline_after(runner.timeout_ns);
+	const char* found = NULL;
+
+	pthread_mutex_lock(&runner.mutex);
+
+	for (;;) {
+		for (; from < runner.events.num && !found; from++) {
+			struct vendor_event* event = &runner.events.array[from];
+
+			if (strcmp(event->type, a) == 0
+			    || strcmp(event->type, b) == 0) {
+				found = event->type;
+				*time_ns = event->time_ns;
+			}
+		}
+
+		if (found
+		    || pthread_cond_timedwait(&runner.cond, &runner.mutex,
+					      &deadline)
+			       != 0)
+			break;
+	}
+
+	pthread_mutex_unlock(&runner.mutex);
+	return found;
+}
+
+// Frame requests land on whichever output is recording
+static obs_output_t* active_output(void)
+{
+	for (size_t i = 0; i < runner.outputs.num; i++)
+		if (obs_output_active(runner.outputs.array[i]))
+			return runner.outputs.array[i];
+
+	return NULL;
+}
+
+static bool wait_for_credit(obs_output_t* output, uint64_t* time_ns)
+{
+	if (!output) return false;
+
+	struct timespec deadline = deadline_after(runner.timeout_ns);
+
+	pthread_mutex_lock(&runner.mutex);
+	runner.credit_output = output;
+	runner.credit_done_ns = 0;
+	pthread_mutex_unlock(&runner.mutex);
+
+	// The video thread may have used it all up before the wait was set
+	// up; counts as done now
+	if (requested_frames(output) <= 0) {
+		pthread_mutex_lock(&runner.mutex);
+		if (!runner.credit_done_ns)
+			runner.credit_done_ns = os_gettime_ns();
+		pthread_mutex_unlock(&runner.mutex);
+	}
+
+	pthread_mutex_lock(&runner.mutex);
+	while (!runner.credit_done_ns)
+		if (pthread_cond_timedwait(&runner.cond, &runner.mutex,
+					   &deadline)
+		    != 0)
+			break;
+
+	*time_ns = runner.credit_done_ns;
+	runner.credit_output = NULL;
+	pthread_mutex_unlock(&runner.mutex);
+
+	return *time_ns != 0;
+}
+
+static struct request_stats* get_stats(const char* type)
+{
+	for (size_t i = 0; i < runner.stats.num; i++)
+		if (strcmp(runner.stats.array[i].type, type) == 0)
+			return &runner.stats.array[i];
+
+	struct request_stats* stats = da_push_back_new(runner.stats);
+	stats->type = bstrdup(type);
+	return stats;
+}
+
+static void run_request(const char* type, const char* json)
+{
+	struct request_stats* stats = get_stats(type);
+	struct vendor_request* request = NULL;
+
+	for (size_t i = 0; i < runner.requests.num; i++)
+		if (strcmp(runner.requests.array[i].type, type) == 0)
+			request = &runner.requests.array[i];
+
+	obs_data_t* request_data = json && *json
+					   ? obs_data_create_from_json(json)
+					   : obs_data_create();
+
+	if (!request || !request_data) {
+		fprintf(stderr, "%s: %s\n", type,
+			request ? "invalid request JSON" : "unknown request");
+		obs_data_release(request_data);
+		stats->failed++;
+		return;
+	}
+
+	obs_data_t* response = obs_data_create();
+
+	pthread_mutex_lock(&runner.mutex);
+	size_t events_before = runner.events.num;
+	pthread_mutex_unlock(&runner.mutex);
+
+	uint64_t start_ns = os_gettime_ns();
+	request->callback.callback(request_data, response,
+				   request->callback.priv);
+	uint64_t end_ns = os_gettime_ns();
+	bool success = true;
+
+	if (strcmp(type, "start_recording") == 0) {
+		const char* result = NULL;
+		if (obs_data_get_bool(response, "success"))
+			result = wait_for_event(events_before,
+						"record_start_success",
+						"record_start_fail", &end_ns);
+
+		success = result && strcmp(result, "record_start_success") == 0;
+	} else if (strcmp(type, "request_frames") == 0) {
+		success = wait_for_credit(active_output(), &end_ns);
+	}
+
+	if (runner.verbose)
+		printf("%s %s-> %s (%.2f ms)\n", type, json ? json : "",
+		       obs_data_get_json(response),
+		       (double) (end_ns - start_ns) / 1e6);
+
+	if (success) {
+		uint64_t elapsed_ns = end_ns - start_ns;
+		da_push_back(stats->samples, &elapsed_ns);
+	} else {
+		fprintf(stderr, "%s failed or timed out\n", type);
+		stats->failed++;
+	}
+
+	obs_data_release(response);
+	obs_data_release(request_data);
+}
+
+static char* skip_space(char* str)
+{
+	while (*str == ' ' || *str == '\t') str++;
+	return str;
+}
+
+// Index of the "end" closing the repeat at `line`, or `count` if missing
+static size_t find_end(char** lines, size_t line, size_t count)
+{
+	int depth = 0;
+
+	for (size_t i = line; i < count; i++) {
+		if (strncmp(lines[i], "repeat", 6) == 0) depth++;
+		else if (strcmp(lines[i], "end") == 0 && --depth == 0) return i;
+	}
+
+	return count;
+}
+
+static void run_lines(char** lines, size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; i++) {
+		char* line = lines[i];
+
+		if (!*line || *line == '#') continue;
+
+		if (strncmp(line, "repeat ", 7) == 0) {
+			size_t block_end = find_end(lines, i, end);
+			int count = atoi(line + 7);
+
+			for (int n = 0; n < count; n++)
+				run_lines(lines, i + 1, block_end);
+
+			i = block_end;
+			continue;
+		}
+
+		if (strncmp(line, "sleep ", 6) == 0) {
+			os_sleep_ms((uint32_t) atoi(line + 6));
+			continue;
+		}
+
+		// Request type up to the first space, JSON after it
+		char* json = strpbrk(line, " \t");
+		if (json) {
+			*json = 0;
+			json = skip_space(json + 1);
+		}
+
+		run_request(line, json);
+	}
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool print_report(void)
+{
+	bool all_passed = true;
+
+	printf("\n%-20s %6s %9s %9s %9s %9s %6s\n", "request", "count",
+	       "mean ms", "p50 ms", "p95 ms", "max ms", "failed");
+
+	for (size_t i = 0; i < runner.stats.num; i++) {
+		struct request_stats* stats = &runner.stats.array[i];
+		size_t count = stats->samples.num;
+		uint64_t* samples = stats->samples.array;
+		double total_ns = 0.0;
+
+		qsort(samples, count, sizeof(uint64_t), compare_u64);
+		for (size_t n = 0; n < count; n++)
+			total_ns += (double) samples[n];
+
+		if (stats->failed) all_passed = false;
+
+		if (!count) {
+			printf("%-20s %6d %9s %9s %9s %9s %6d\n", stats->type,
+			       0, "-", "-", "-", "-", stats->failed);
+			continue;
+		}
+
+		printf("%-20s %6zu %9.2f %9.2f %9.2f %9.2f %6d\n", stats->type,
+		       count, total_ns / (double) count / 1e6,
+		       (double) samples[count / 2] / 1e6,
+		       (double) samples[(count - 1) * 95 / 100] / 1e6,
+		       (double) samples[count - 1] / 1e6, stats->failed);
+	}
+
+	return all_passed;
+}
+
+static void quiet_log(int level, const char* format, va_list args,
+		      void* param)
+{
+	UNUSED_PARAMETER(param);
+
+	if (level > LOG_WARNING) return;
+
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+}
+
+static void print_usage(const char* name)
+{
+	printf("Usage: %s --plugin path --script path [--size WxH] "
+	       "[--fps num/den] [--timeout ms] [--quiet] [--verbose]\n",
+	       name);
+}
+
+int main(int argc, char** argv)
+{
+	struct video_output_info* voi = &runner.video.info;
+	*voi = (struct video_output_info) {
+		.name = "headless",
+		.format = VIDEO_FORMAT_NV12,
+		.width = 1280,
+		.height = 720,
+		.fps_num = 60,
+		.fps_den = 1,
+		.colorspace = VIDEO_CS_709,
+		.range = VIDEO_RANGE_PARTIAL,
+	};
+
+	const char* plugin_path = NULL;
+	const char* script_path = NULL;
+	uint32_t timeout_ms = DEFAULT_TIMEOUT_MS;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--plugin") == 0 && has_value) {
+			plugin_path = argv[++i];
+		} else if (strcmp(arg, "--script") == 0 && has_value) {
+			script_path = argv[++i];
+		} else if (strcmp(arg, "--size") == 0 && has_value) {
+			if (sscanf(argv[++i], "%ux%u", &voi->width,
+				   &voi->height)
+			    != 2) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(arg, "--fps") == 0 && has_value) {
+			if (sscanf(argv[++i], "%u/%u", &voi->fps_num,
+				   &voi->fps_den)
+			    < 1) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(arg, "--timeout") == 0 && has_value) {
+			timeout_ms = (uint32_t) atoi(argv[++i]);
+		} else if (strcmp(arg, "--quiet") == 0) {
+			base_set_log_handler(quiet_log, NULL);
+		} else if (strcmp(arg, "--verbose") == 0) {
+			runner.verbose = true;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!plugin_path || !script_path || !voi->width || !voi->height
+	    || !voi->fps_num || !voi->fps_den) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	char* script = os_quick_read_utf8_file(script_path);
+	if (!script) {
+		fprintf(stderr, "Failed to read script \"%s\"\n", script_path);
+		return 1;
+	}
+
+	runner.timeout_ns = (uint64_t) timeout_ms * 1000000ULL;
+	pthread_mutex_init(&runner.mutex, NULL);
+	pthread_cond_init(&runner.cond, NULL);
+	setup_handlers();
+
+	// One NV12 frame with neutral chroma; only luma gets redrawn
+	size_t luma_size = (size_t) voi->width * voi->height;
+	runner.frame_buffer = bmalloc(luma_size + luma_size / 2);
+	memset(runner.frame_buffer + luma_size, 128, luma_size / 2);
+	runner.frame.data[0] = runner.frame_buffer;
+	runner.frame.data[1] = runner.frame_buffer + luma_size;
+	runner.frame.linesize[0] = voi->width;
+	runner.frame.linesize[1] = voi->width;
+
+	void* module = dlopen(plugin_path, RTLD_NOW);
+	if (!module) {
+		fprintf(stderr, "Failed to load plugin: %s\n", dlerror());
+		bfree(script);
+		return 1;
+	}
+
+	bool (*module_load)(void) = (bool (*)(void)) dlsym(module,
+							   "obs_module_load");
+	void (*module_post_load)(void) =
+		(void (*)(void)) dlsym(module, "obs_module_post_load");
+	void (*module_unload)(void) =
+		(void (*)(void)) dlsym(module, "obs_module_unload");
+
+	if (!module_load || !module_load()) {
+		fprintf(stderr, "Plugin failed to load\n");
+		dlclose(module);
+		bfree(script);
+		return 1;
+	}
+
+	if (module_post_load) module_post_load();
+
+	printf("Plugin registered vendor \"%s\" with %zu requests, running "
+	       "at %ux%u %u/%u fps\n",
+	       runner.vendor_name ? runner.vendor_name : "",
+	       runner.requests.num, voi->width, voi->height, voi->fps_num,
+	       voi->fps_den);
+
+	// Split into lines in place, trimmed at both ends
+	DARRAY(char*) lines;
+	da_init(lines);
+	for (char* line = strtok(script, "\r\n"); line;
+	     line = strtok(NULL, "\r\n")) {
+		line = skip_space(line);
+		size_t len = strlen(line);
+		while (len && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+			line[--len] = 0;
+
+		da_push_back(lines, &line);
+	}
+
+	run_lines(lines.array, 0, lines.num);
+
+	// Stops whatever the script left running
+	if (module_unload) module_unload();
+	dlclose(module);
+
+	bool all_passed = print_report();
+
+	da_free(lines);
+	bfree(script);
+	bfree(runner.frame_buffer);
+
+	for (size_t i = 0; i < runner.requests.num; i++)
+		bfree(runner.requests.array[i].type);
+	da_free(runner.requests);
+	for (size_t i = 0; i < runner.events.num; i++)
+		bfree(runner.events.array[i].type);
+	da_free(runner.events);
+	for (size_t i = 0; i < runner.stats.num; i++) {
+		bfree(runner.stats.array[i].type);
+		da_free(runner.stats.array[i].samples);
+	}
+	da_free(runner.stats);
+	da_free(runner.output_types);
+	da_free(runner.outputs);
+	bfree(runner.vendor_name);
+
+	proc_handler_destroy(runner.websocket_ph);
+	proc_handler_destroy(runner.obs_ph);
+	pthread_cond_destroy(&runner.cond);
+	pthread_mutex_destroy(&runner.mutex);
+
+	return all_passed ? 0 : 1;
+}
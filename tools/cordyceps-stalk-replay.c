@@ -0,0 +1,353 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Feeds a raw dump (see cordyceps-stalk-raw.h) through the same encoder setup
+// and packet writing as the output, as fast as the encoder allows, and reports
+// how long it took. Meant for profiling encoder settings against real game
+// footage without the game.
+//
+// Usage: cordyceps-stalk-replay [options] <dump.csraw>
+//   -o <file>        Output file, defaults to "<dump>.replay.mp4"
+//   --codec <name>   h264, hevc, av1 or vp9, defaults to h264
+//   --threads <n>    Encoder threads, defaults to letting the encoder pick
+//   --preset <name>  x264 preset, defaults to veryfast
+//   --crf <value>    Constant rate factor, defaults to 23
+//   --bitrate <kbps> Average bitrate, switches to ABR
+//   --gop <frames>   Keyframe interval, defaults to 120
+//   --frames <count> Stop after this many frames
+//   --paced          Feed frames at the times they were captured instead
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <util/darray.h>
+#include <util/dstr.h>
+#include <libavutil/pixdesc.h>
+
+#include "cordyceps-stalk-encoder.h"
+#include "cordyceps-stalk-pool.h"
+#include "cordyceps-stalk-raw.h"
+
+struct replay {
+	struct ffmpeg_context context;
+
+	struct cso_alloc_stats alloc_stats;
+	struct cso_packet_pool packet_pool;
+	struct cso_buffer_pool buffer_pool;
+
+	// A NULL entry tells the write thread to stop
+	pthread_t write_thread;
+	pthread_mutex_t write_mutex;
+	os_sem_t* write_semaphore;
+	DARRAY(AVPacket*) packets;
+
+	uint64_t total_bytes;
+	int write_errors;
+
+	DARRAY(uint64_t) encode_ns;
+};
+
+static void queue_packet(struct replay* replay, AVPacket* packet)
+{
+	pthread_mutex_lock(&replay->write_mutex);
+	da_push_back(replay->packets, &packet);
+	pthread_mutex_unlock(&replay->write_mutex);
+	os_sem_post(replay->write_semaphore);
+}
+
+static void* write_thread(void* data)
+{
+	struct replay* replay = data;
+	struct ffmpeg_context* context = &replay->context;
+
+	while (os_sem_wait(replay->write_semaphore) == 0) {
+		pthread_mutex_lock(&replay->write_mutex);
+		AVPacket* packet = replay->packets.array[0];
+		da_erase(replay->packets, 0);
+		pthread_mutex_unlock(&replay->write_mutex);
+
+		if (!packet) break;
+
+		AVRational stream_time_base = context->video_stream->time_base;
+		packet->pts = av_rescale_q_rnd(
+			packet->pts, context->time_base, stream_time_base,
+			AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+		packet->dts = av_rescale_q_rnd(
+			packet->dts, context->time_base, stream_time_base,
+			AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+		packet->duration = av_rescale_q(
+			packet->duration, context->time_base, stream_time_base);
+
+		replay->total_bytes += packet->size;
+
+		if (av_write_frame(context->output_ctx, packet) < 0)
+			replay->write_errors++;
+		av_write_frame(context->output_ctx, NULL);
+
+		cso_packet_pool_put(&replay->packet_pool, packet);
+	}
+
+	return NULL;
+}
+
+static int encode_frame(struct replay* replay, AVFrame* frame)
+{
+	int ret = avcodec_send_frame(replay->context.video_ctx, frame);
+
+	while (ret == 0) {
+		AVPacket* packet = cso_packet_pool_get(&replay->packet_pool);
+
+		ret = avcodec_receive_packet(replay->context.video_ctx, packet);
+
+		if (ret == 0 && packet->size) queue_packet(replay, packet);
+		else cso_packet_pool_put(&replay->packet_pool, packet);
+	}
+
+	if (ret == AVERROR_EOF || ret == AVERROR(EAGAIN)) ret = 0;
+
+	return ret;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint64_t* sorted, size_t count, double p)
+{
+	if (!count) return 0.0;
+
+	size_t i = (size_t) (p * (double) (count - 1) + 0.5);
+	return (double) sorted[i] / 1000000.0;
+}
+
+static void print_usage(const char* name)
+{
+	printf("Usage: %s [-o output.mp4] [--codec name] [--threads count] "
+	       "[--preset name] [--crf value] "
+	       "[--bitrate kbps] [--gop frames] [--frames count] [--paced] "
+	       "<dump.csraw>\n",
+	       name);
+}
+
+int main(int argc, char** argv)
+{
+	struct cso_encoder_settings settings = {
+		.gop_size = 120,
+		.rate_control = CSO_RATE_CONTROL_CRF,
+		.crf = 23.0,
+		.bitrate = 25000,
+	};
+	snprintf(settings.preset, sizeof(settings.preset), "veryfast");
+
+	const char* dump_path = NULL;
+	const char* output_path = NULL;
+	int64_t max_frames = -1;
+	bool paced = false;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "-o") == 0 && has_value) {
+			output_path = argv[++i];
+		} else if (strcmp(arg, "--codec") == 0 && has_value) {
+			settings.codec = cso_codec_from_string(argv[++i]);
+		} else if (strcmp(arg, "--threads") == 0 && has_value) {
+			settings.threads = atoi(argv[++i]);
+		} else if (strcmp(arg, "--preset") == 0 && has_value) {
+			snprintf(settings.preset, sizeof(settings.preset), "%s",
+				 argv[++i]);
+		} else if (strcmp(arg, "--crf") == 0 && has_value) {
+			settings.crf = atof(argv[++i]);
+		} else if (strcmp(arg, "--bitrate") == 0 && has_value) {
+			settings.rate_control = CSO_RATE_CONTROL_ABR;
+			settings.bitrate = atoi(argv[++i]);
+		} else if (strcmp(arg, "--gop") == 0 && has_value) {
+			settings.gop_size = atoi(argv[++i]);
+		} else if (strcmp(arg, "--frames") == 0 && has_value) {
+			max_frames = atoll(argv[++i]);
+		} else if (strcmp(arg, "--paced") == 0) {
+			paced = true;
+		} else if (arg[0] != '-' && !dump_path) {
+			dump_path = arg;
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!dump_path) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	struct cso_raw_reader reader;
+	if (!cso_raw_reader_open(&reader, dump_path)) return 1;
+
+	struct dstr default_output;
+	dstr_init_copy(&default_output, dump_path);
+	dstr_cat(&default_output, ".replay.mp4");
+	if (!output_path) output_path = default_output.array;
+
+	struct replay* replay = bzalloc(sizeof(struct replay));
+	struct ffmpeg_context* context = &replay->context;
+	const struct cso_raw_info* info = &reader.info;
+	bool started = false;
+	int ret = 1;
+
+	cso_packet_pool_init(&replay->packet_pool, &replay->alloc_stats);
+	replay->buffer_pool.stats = &replay->alloc_stats;
+	pthread_mutex_init(&replay->write_mutex, NULL);
+	os_sem_init(&replay->write_semaphore, 0);
+
+	context->config.filepath = output_path;
+	context->config.output_format = av_guess_format("mp4", NULL, NULL);
+	context->config.buffer_pool = &replay->buffer_pool;
+	context->config.encoder = settings;
+	context->config.width = info->width;
+	context->config.height = info->height;
+	context->config.fps_num = info->fps_num;
+	context->config.fps_den = info->fps_den;
+	context->config.hdr_nominal_peak_level = 1000;
+	context->config.pixel_format = info->format;
+	context->config.color_range = info->color_range;
+	context->config.color_primaries = info->color_primaries;
+	context->config.color_trc = info->color_trc;
+	context->config.colorspace = info->colorspace;
+
+	if (!context->config.output_format || !cso_encoder_open(context)
+	    || !cso_muxer_open(context))
+		goto cleanup;
+
+	if (pthread_create(&replay->write_thread, NULL, write_thread, replay)
+	    != 0)
+		goto cleanup;
+
+	started = true;
+
+	printf("Replaying %s: %dx%d %s at %d/%d fps, %lld frames\n",
+	       dump_path, info->width, info->height,
+	       av_get_pix_fmt_name(info->format), info->fps_num, info->fps_den,
+	       (long long) reader.frame_count);
+
+	struct cso_raw_record record;
+	int64_t requests = 0;
+	int64_t requested_frames = 0;
+	int64_t dropped = 0;
+	int encode_errors = 0;
+	uint64_t start_ns = os_gettime_ns();
+
+	while (context->total_frames != max_frames
+	       && cso_raw_reader_next(&reader, &record)) {
+		if (record.type == CSO_RAW_REQUEST) {
+			requests++;
+			requested_frames += record.value;
+			continue;
+		}
+
+		if (record.type == CSO_RAW_DROP) {
+			dropped += record.value;
+			continue;
+		}
+
+		if (paced) os_sleepto_ns(start_ns + record.time_ns);
+
+		struct video_data frame;
+		cso_raw_reader_get_frame(&reader, &frame);
+		frame.timestamp = (uint64_t) record.value;
+
+		uint64_t frame_start_ns = os_gettime_ns();
+
+		if (av_frame_make_writable(context->vframe) < 0) break;
+
+		cso_encoder_ingest(context, &frame);
+		context->vframe->pts = context->total_frames;
+
+		if (encode_frame(replay, context->vframe) < 0) encode_errors++;
+
+		uint64_t encode_ns = os_gettime_ns() - frame_start_ns;
+		da_push_back(replay->encode_ns, &encode_ns);
+
+		context->total_frames++;
+	}
+
+	if (encode_frame(replay, NULL) < 0) encode_errors++;
+
+	queue_packet(replay, NULL);
+	pthread_join(replay->write_thread, NULL);
+
+	double seconds = (double) (os_gettime_ns() - start_ns) / 1000000000.0;
+	av_write_trailer(context->output_ctx);
+
+	qsort(replay->encode_ns.array, replay->encode_ns.num, sizeof(uint64_t),
+	      compare_u64);
+
+	uint64_t total_encode_ns = 0;
+	for (size_t i = 0; i < replay->encode_ns.num; i++)
+		total_encode_ns += replay->encode_ns.array[i];
+
+	size_t count = replay->encode_ns.num;
+	printf("Encoded %lld frames in %.2f s (%.1f fps)\n",
+	       (long long) context->total_frames, seconds,
+	       seconds > 0.0 ? (double) context->total_frames / seconds : 0.0);
+	printf("Per frame ingest + encode: mean %.2f ms, median %.2f ms, "
+	       "p99 %.2f ms, max %.2f ms\n",
+	       count ? (double) total_encode_ns / (double) count / 1000000.0
+		     : 0.0,
+	       percentile_ms(replay->encode_ns.array, count, 0.5),
+	       percentile_ms(replay->encode_ns.array, count, 0.99),
+	       percentile_ms(replay->encode_ns.array, count, 1.0));
+	printf("Wrote %llu bytes to %s\n",
+	       (unsigned long long) replay->total_bytes, output_path);
+	printf("Capture had %lld frame requests for %lld frames, %lld frames "
+	       "dropped from the dump\n",
+	       (long long) requests, (long long) requested_frames,
+	       (long long) dropped);
+
+	if (encode_errors || replay->write_errors)
+		printf("%d encode errors, %d write errors\n", encode_errors,
+		       replay->write_errors);
+	else
+		ret = 0;
+
+cleanup:
+	if (!started)
+		printf("Failed to set up the encoder for %s\n", dump_path);
+
+	avcodec_free_context(&context->video_ctx);
+	av_frame_free(&context->vframe);
+	if (context->output_ctx) cso_muxer_close(context->output_ctx, false);
+
+	cso_buffer_pool_free(&replay->buffer_pool);
+	cso_packet_pool_free(&replay->packet_pool);
+	os_sem_destroy(replay->write_semaphore);
+	pthread_mutex_destroy(&replay->write_mutex);
+	da_free(replay->packets);
+	da_free(replay->encode_ns);
+	bfree(replay);
+
+	cso_raw_reader_close(&reader);
+	dstr_free(&default_output);
+
+	return ret;
+}
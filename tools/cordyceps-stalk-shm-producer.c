@@ -0,0 +1,216 @@
+/*
+Cordyceps-stalk
+Copyright (C) 2024 ErrorStringExpectedGotNil
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+// Reference producer for the shared-memory ring (see cordyceps-stalk-shm.h).
+// Writes a moving test pattern the way a game mod would, so direct ingest can
+// be tried without the game. Start this first, then start the output with
+// ingest_source set to "shm".
+//
+// Usage: cordyceps-stalk-shm-producer [options]
+//   --name <name>     Ring name, defaults to "cordyceps-stalk"
+//   --size <WxH>      Frame size, defaults to 1920x1080
+//   --fps <num/den>   Nominal frame rate written to the ring, defaults to 60/1
+//   --format <name>   nv12, i420 or bgra, defaults to nv12
+//   --slots <count>   Ring slots, defaults to 4
+//   --frames <count>  Stop after this many frames
+//   --rate <fps>      Write at most this many frames per second; by default
+//                     frames are written as fast as the output takes them
+
+#include <obs-module.h>
+#include <plugin-support.h>
+#include <util/platform.h>
+#include <signal.h>
+
+#include "cordyceps-stalk-shm.h"
+
+static volatile bool stop_requested = false;
+
+static void handle_signal(int sig)
+{
+	UNUSED_PARAMETER(sig);
+
+	stop_requested = true;
+}
+
+static void fill_pattern(struct video_data* frame,
+			 const struct video_output_info* voi, int64_t index)
+{
+	uint32_t bar = (uint32_t) (index * 8 % voi->width);
+
+	if (voi->format == VIDEO_FORMAT_BGRA) {
+		for (uint32_t y = 0; y < voi->height; y++) {
+			uint8_t* row = frame->data[0] + y * frame->linesize[0];
+
+			for (uint32_t x = 0; x < voi->width; x++) {
+				uint8_t* px = row + x * 4;
+				bool on_bar = x - bar < 8;
+
+				px[0] = on_bar ? 255 : (uint8_t) (x + index);
+				px[1] = on_bar ? 255 : (uint8_t) (y + index);
+				px[2] = on_bar ? 255 : (uint8_t) (x + y);
+				px[3] = 255;
+			}
+		}
+		return;
+	}
+
+	for (uint32_t y = 0; y < voi->height; y++) {
+		uint8_t* row = frame->data[0] + y * frame->linesize[0];
+
+		for (uint32_t x = 0; x < voi->width; x++)
+			row[x] = x - bar < 8 ? 235 : (uint8_t) (x + y + index);
+	}
+
+	// Neutral chroma, so only the luma pattern shows
+	uint32_t chroma_height = (voi->height + 1) / 2;
+	for (int plane = 1; plane < MAX_AV_PLANES && frame->data[plane];
+	     plane++)
+		memset(frame->data[plane], 128,
+		       (size_t) frame->linesize[plane] * chroma_height);
+}
+
+static void print_usage(const char* name)
+{
+	printf("Usage: %s [--name name] [--size WxH] [--fps num/den] "
+	       "[--format nv12|i420|bgra] [--slots count] [--frames count] "
+	       "[--rate fps]\n",
+	       name);
+}
+
+int main(int argc, char** argv)
+{
+	struct video_output_info voi = {
+		.format = VIDEO_FORMAT_NV12,
+		.width = 1920,
+		.height = 1080,
+		.fps_num = 60,
+		.fps_den = 1,
+		.colorspace = VIDEO_CS_709,
+		.range = VIDEO_RANGE_PARTIAL,
+	};
+
+	const char* name = CSO_SHM_DEFAULT_NAME;
+	uint32_t slots = CSO_SHM_DEFAULT_SLOTS;
+	int64_t max_frames = -1;
+	double rate = 0.0;
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (strcmp(arg, "--name") == 0 && has_value) {
+			name = argv[++i];
+		} else if (strcmp(arg, "--size") == 0 && has_value) {
+			if (sscanf(argv[++i], "%ux%u", &voi.width, &voi.height)
+			    != 2) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(arg, "--fps") == 0 && has_value) {
+			if (sscanf(argv[++i], "%u/%u", &voi.fps_num,
+				   &voi.fps_den)
+			    < 1) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(arg, "--format") == 0 && has_value) {
+			const char* format = argv[++i];
+
+			if (strcmp(format, "nv12") == 0) {
+				voi.format = VIDEO_FORMAT_NV12;
+			} else if (strcmp(format, "i420") == 0) {
+				voi.format = VIDEO_FORMAT_I420;
+			} else if (strcmp(format, "bgra") == 0) {
+				voi.format = VIDEO_FORMAT_BGRA;
+				voi.range = VIDEO_RANGE_FULL;
+			} else {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(arg, "--slots") == 0 && has_value) {
+			slots = (uint32_t) atoi(argv[++i]);
+		} else if (strcmp(arg, "--frames") == 0 && has_value) {
+			max_frames = atoll(argv[++i]);
+		} else if (strcmp(arg, "--rate") == 0 && has_value) {
+			rate = atof(argv[++i]);
+		} else {
+			print_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!voi.width || !voi.height || !voi.fps_num || !voi.fps_den
+	    || !slots) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	struct cso_shm_ring ring;
+	if (!cso_shm_create(&ring, name, &voi, slots)) return 1;
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	printf("Writing %ux%u frames to \"%s\" (%u slots), Ctrl+C to stop\n",
+	       voi.width, voi.height, name, slots);
+
+	uint64_t interval_ns = rate > 0.0 ? (uint64_t) (1e9 / rate) : 0;
+	uint64_t start_ns = os_gettime_ns();
+	uint64_t waiting_ns = 0;
+	int64_t frames = 0;
+
+	while (!stop_requested && frames != max_frames) {
+		struct video_data frame;
+
+		// The ring being full is the output pushing back
+		uint64_t wait_start_ns = os_gettime_ns();
+		while (!cso_shm_begin_write(&ring, &frame)) {
+			if (stop_requested) break;
+			os_sleep_ms(1);
+		}
+		waiting_ns += os_gettime_ns() - wait_start_ns;
+
+		if (stop_requested) break;
+
+		fill_pattern(&frame, &voi, frames);
+		cso_shm_end_write(&ring, os_gettime_ns());
+		frames++;
+
+		if (interval_ns) {
+			uint64_t due_ns = start_ns + frames * interval_ns;
+			uint64_t now_ns = os_gettime_ns();
+			if (due_ns > now_ns)
+				os_sleep_ms((uint32_t) ((due_ns - now_ns)
+							/ 1000000));
+		}
+	}
+
+	double seconds = (double) (os_gettime_ns() - start_ns) / 1e9;
+
+	printf("Wrote %lld frames in %.2f s (%.1f fps), %.1f%% of it waiting "
+	       "on the output\n",
+	       (long long) frames, seconds,
+	       seconds > 0.0 ? (double) frames / seconds : 0.0,
+	       seconds > 0.0 ? (double) waiting_ns / 1e9 / seconds * 100.0
+			     : 0.0);
+
+	// An output that already has the ring open keeps its mapping, so it
+	// still gets the frames left in it
+	cso_shm_close(&ring);
+	return 0;
+}